@@ -0,0 +1,803 @@
+// CoAP load generator and latency benchmark for the basic CoAP server.
+//
+// Runs on Linux against the server, typically built for native_posix
+// and reached over its TAP interface (or on real hardware through a
+// border router). It keeps a window of up to -c requests outstanding,
+// optionally paced at -r requests per second, and matches responses
+// to requests by token. This is the same windowed send/compare loop
+// as zephyr-examples/echo_client/src/udp.c, with CoAP's confirmable
+// retransmission rules (RFC 7252, Section 4.2) on top for CON mode.
+//
+// At the end it reports throughput, loss, retransmissions and a
+// latency histogram with p50/p99/p999. Latency is measured from the
+// first transmission of a request to its response, so it includes
+// any retransmission delay.
+//
+// With -S, requests go over DTLS 1.2 with a pre-shared key, as for
+// the server's CONFIG_BASIC_COAP_DTLS, and the handshake time is
+// reported too. Comparing runs with and without -S gives the
+// per-request cost of DTLS.
+//
+// With -s, the server's own statistics for each resource in the mix
+// are fetched from its "stats" resource before and after the run, and
+// the mean time the server spent on each response (from receiving the
+// request to sending the response, in cycles of its clock) is
+// reported. This needs CONFIG_BASIC_COAP_STATS, and is only accurate
+// if nothing else is using the same resources during the run.
+//
+// The server limits each client's request rate
+// (CONFIG_BASIC_COAP_RATE_LIMIT) and sheds load with 5.03 responses
+// when its request queue backs up (CONFIG_BASIC_COAP_SHED_THRESHOLD).
+// Requests over the rate limit are dropped, so they show up here as
+// loss or retransmissions, and 5.03s as error responses. Turn both
+// off in the server to measure its raw capacity.
+//
+// Usage: coap_bench [options] host
+//
+//   -p port      server port (5683, or 5684 with -S)
+//   -m methods   comma-separated mix of get, put and wellknown (get)
+//   -N           send non-confirmable requests (default confirmable)
+//   -c window    maximum requests outstanding at once (1)
+//   -r rate      requests per second, 0 for as fast as the window
+//                allows (0)
+//   -d seconds   run for this long (10)
+//   -n count     stop after this many requests instead
+//   -a ms        CON ACK_TIMEOUT (2000); NON requests are counted as
+//                lost after 4 times this with no response
+//   -R count     CON MAX_RETRANSMIT (4)
+//   -H           print the full latency histogram
+//   -S id:key    use DTLS with this PSK identity and hex key
+//   -s           report server cycles per response
+//
+// For .well-known/core, only the first block of a block-wise response
+// is fetched.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+
+// ----------------------------------------------------------------------
+// COAP MESSAGES
+
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+
+#define COAP_GET 1
+#define COAP_PUT 3
+
+#define OPTION_URI_PATH 11
+#define OPTION_CONTENT_FORMAT 12
+#define OPTION_URI_QUERY 15
+
+#define TOKEN_LEN 4
+#define MAX_MSG_LEN 1280
+
+enum request_kind { REQ_GET, REQ_PUT, REQ_WELLKNOWN };
+
+// Append an option, given the number of the previous one. Only
+// handles values shorter than 269 bytes and deltas up to 12, which is
+// all we need.
+static uint8_t *put_option(uint8_t *p, int *last, int number,
+                           const char *value, size_t len) {
+  if (len < 13) {
+    *p++ = (uint8_t)((number - *last) << 4 | len);
+  } else {
+    *p++ = (uint8_t)((number - *last) << 4 | 13);
+    *p++ = (uint8_t)(len - 13);
+  }
+  memcpy(p, value, len);
+  *last = number;
+  return p + len;
+}
+
+// Build a request, returning its length.
+static size_t build_request(uint8_t *buf, enum request_kind kind, bool con,
+                            uint16_t id, const uint8_t *token, bool led_on) {
+  uint8_t code = kind == REQ_PUT ? COAP_PUT : COAP_GET;
+  buf[0] = 0x40 | (con ? COAP_TYPE_CON : COAP_TYPE_NON) << 4 | TOKEN_LEN;
+  buf[1] = code;
+  buf[2] = id >> 8;
+  buf[3] = id & 0xff;
+  memcpy(buf + 4, token, TOKEN_LEN);
+
+  uint8_t *p = buf + 4 + TOKEN_LEN;
+  int last = 0;
+  if (kind == REQ_WELLKNOWN) {
+    p = put_option(p, &last, OPTION_URI_PATH, ".well-known", 11);
+    p = put_option(p, &last, OPTION_URI_PATH, "core", 4);
+  } else {
+    p = put_option(p, &last, OPTION_URI_PATH, "led", 3);
+  }
+  if (kind == REQ_PUT) {
+    // Content-Format text/plain (0) is encoded as an empty value.
+    p = put_option(p, &last, OPTION_CONTENT_FORMAT, "", 0);
+    *p++ = 0xff;
+    *p++ = led_on ? '1' : '0';
+  }
+  return p - buf;
+}
+
+
+// ----------------------------------------------------------------------
+// LATENCY HISTOGRAM
+
+// Log-linear buckets: 16 per power of two of microseconds, so each
+// bucket is within about 6% of its neighbours.
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS (33 * SUB_BUCKETS)
+
+static uint64_t histogram[BUCKETS];
+static uint64_t samples;
+static uint64_t latency_sum;
+static uint64_t latency_max;
+
+static int bucket_of(uint64_t us) {
+  if (us < SUB_BUCKETS) return (int)us;
+  int e = 63 - __builtin_clzll(us);
+  int b = (e - SUB_BITS + 1) * SUB_BUCKETS +
+          (int)((us >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+  return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+// Smallest value that falls in bucket b.
+static uint64_t bucket_floor(int b) {
+  if (b < SUB_BUCKETS) return b;
+  int e = b / SUB_BUCKETS + SUB_BITS - 1;
+  return (uint64_t)(SUB_BUCKETS + b % SUB_BUCKETS) << (e - SUB_BITS);
+}
+
+static void record_latency(uint64_t us) {
+  ++histogram[bucket_of(us)];
+  ++samples;
+  latency_sum += us;
+  if (us > latency_max) latency_max = us;
+}
+
+// Latency at a given quantile, as the floor of its bucket.
+static uint64_t percentile(double q) {
+  uint64_t rank = (uint64_t)(q * samples);
+  uint64_t seen = 0;
+  for (int b = 0; b < BUCKETS; ++b) {
+    seen += histogram[b];
+    if (seen > rank) return bucket_floor(b);
+  }
+  return latency_max;
+}
+
+
+// ----------------------------------------------------------------------
+// OUTSTANDING REQUESTS
+
+// One slot per request in the window. The token is the slot index and
+// a generation count, so late responses to a slot's previous request
+// are recognised and ignored.
+struct slot {
+  bool in_use;
+  bool acked;
+  uint16_t generation;
+  uint16_t id;
+  int retransmits;
+  uint64_t first_sent;
+  uint64_t deadline;
+  uint64_t timeout;
+  size_t len;
+  uint8_t buf[MAX_MSG_LEN];
+};
+
+struct options {
+  const char *host;
+  const char *port;
+  enum request_kind mix[8];
+  int mix_len;
+  bool con;
+  int window;
+  double rate;
+  double duration;
+  long count;
+  uint64_t ack_timeout;
+  int max_retransmit;
+  bool show_histogram;
+  bool server_stats;
+  const char *psk_identity;
+  uint8_t psk[32];
+  size_t psk_len;
+};
+
+struct counters {
+  uint64_t sent;
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t lost;
+  uint64_t retransmits;
+  uint64_t unmatched;
+};
+
+static struct counters counters;
+
+// The DTLS connection, with -S.
+static SSL *ssl;
+static uint64_t handshake_us;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void token_of(int index, const struct slot *s, uint8_t *token) {
+  token[0] = index >> 8;
+  token[1] = index & 0xff;
+  token[2] = s->generation >> 8;
+  token[3] = s->generation & 0xff;
+}
+
+// Send and receive a datagram, over DTLS if we're using it. Receiving
+// doesn't wait: it returns -1 with errno set to EAGAIN if there's
+// nothing to read.
+static ssize_t send_msg(int sock, const uint8_t *buf, size_t len) {
+  if (!ssl) return send(sock, buf, len, 0);
+  int r = SSL_write(ssl, buf, (int)len);
+  if (r <= 0) {
+    errno = EIO;
+    return -1;
+  }
+  return r;
+}
+
+static ssize_t recv_msg(int sock, uint8_t *buf, size_t len) {
+  if (!ssl) return recv(sock, buf, len, MSG_DONTWAIT);
+  int r = SSL_read(ssl, buf, (int)len);
+  if (r > 0) return r;
+  switch (SSL_get_error(ssl, r)) {
+  case SSL_ERROR_WANT_READ: errno = EAGAIN; break;
+  case SSL_ERROR_ZERO_RETURN: errno = ECONNRESET; break;
+  default: errno = EIO; break;
+  }
+  return -1;
+}
+
+static int send_slot(int sock, struct slot *s) {
+  if (send_msg(sock, s->buf, s->len) < 0 && errno != ENOBUFS) {
+    perror("send");
+    return -1;
+  }
+  return 0;
+}
+
+// Start a new request in a free slot.
+static int start_request(int sock, const struct options *opts,
+                         struct slot *slots, int index, uint64_t now) {
+  static uint16_t next_id;
+  static uint64_t n;
+  struct slot *s = &slots[index];
+
+  uint8_t token[TOKEN_LEN];
+  ++s->generation;
+  token_of(index, s, token);
+
+  enum request_kind kind = opts->mix[n % opts->mix_len];
+  s->id = next_id++;
+  s->len = build_request(s->buf, kind, opts->con, s->id, token, n & 1);
+  s->in_use = true;
+  s->acked = false;
+  s->retransmits = 0;
+  s->first_sent = now;
+
+  // ACK_TIMEOUT times a random factor between 1 and ACK_RANDOM_FACTOR
+  // (1.5) for CON. NON requests just get a fixed time to answer.
+  if (opts->con)
+    s->timeout = opts->ack_timeout + rand() % (opts->ack_timeout / 2 + 1);
+  else
+    s->timeout = 4 * opts->ack_timeout;
+  s->deadline = now + s->timeout;
+
+  ++n;
+  ++counters.sent;
+  return send_slot(sock, s);
+}
+
+// Retransmit or give up on requests whose deadline has passed.
+static int expire_requests(int sock, const struct options *opts,
+                           struct slot *slots, uint64_t now) {
+  for (int i = 0; i < opts->window; ++i) {
+    struct slot *s = &slots[i];
+    if (!s->in_use || now < s->deadline) continue;
+    if (opts->con && !s->acked && s->retransmits < opts->max_retransmit) {
+      ++s->retransmits;
+      ++counters.retransmits;
+      s->timeout *= 2;
+      s->deadline = now + s->timeout;
+      if (send_slot(sock, s) < 0) return -1;
+    } else {
+      ++counters.lost;
+      s->in_use = false;
+    }
+  }
+  return 0;
+}
+
+// Handle one message from the server.
+static void handle_response(int sock, const struct options *opts,
+                            struct slot *slots, const uint8_t *buf,
+                            size_t len, uint64_t now) {
+  if (len < 4 || buf[0] >> 6 != 1) {
+    ++counters.unmatched;
+    return;
+  }
+  int type = buf[0] >> 4 & 3;
+  int tkl = buf[0] & 0x0f;
+  uint8_t code = buf[1];
+  uint16_t id = buf[2] << 8 | buf[3];
+
+  // An empty ACK means the server will send a separate response
+  // later: stop retransmitting, but keep waiting (for up to the usual
+  // exchange lifetime).
+  if (type == COAP_TYPE_ACK && code == 0) {
+    for (int i = 0; i < opts->window; ++i) {
+      struct slot *s = &slots[i];
+      if (s->in_use && s->id == id && !s->acked) {
+        s->acked = true;
+        s->deadline = s->first_sent + 247 * 1000000ull;
+        return;
+      }
+    }
+    ++counters.unmatched;
+    return;
+  }
+
+  // A confirmable (separate) response needs an ACK from us.
+  if (type == COAP_TYPE_CON) {
+    uint8_t ack[4] = { 0x60, 0, buf[2], buf[3] };
+    send_msg(sock, ack, sizeof(ack));
+  }
+
+  if (tkl != TOKEN_LEN || len < 4 + TOKEN_LEN) {
+    ++counters.unmatched;
+    return;
+  }
+  int index = buf[4] << 8 | buf[5];
+  uint16_t generation = buf[6] << 8 | buf[7];
+  if (index >= opts->window || !slots[index].in_use ||
+      slots[index].generation != generation) {
+    // Most likely a duplicate response to a retransmission.
+    ++counters.unmatched;
+    return;
+  }
+
+  struct slot *s = &slots[index];
+  s->in_use = false;
+  ++counters.completed;
+  if (code >> 5 != 2) ++counters.errors;
+  record_latency(now - s->first_sent);
+}
+
+
+// ----------------------------------------------------------------------
+// SERVER STATISTICS
+
+#define STATS_TOKEN "\xff\xff\xff\xff"
+
+// The parts of a resource's "GET stats?r=<path>" details that we use.
+struct server_stats {
+  uint32_t hz;
+  uint32_t responses;  // Total of the latency histogram.
+  uint32_t cycles;     // Latency sum, modulo 2^32.
+};
+
+static const char *request_path(enum request_kind kind) {
+  return kind == REQ_WELLKNOWN ? ".well-known/core" : "led";
+}
+
+// Find the payload of a response, skipping its options. Returns NULL
+// if there isn't one.
+static const uint8_t *find_payload(const uint8_t *p, const uint8_t *end) {
+  while (p < end && *p != 0xff) {
+    int len = *p++ & 0x0f;
+    int delta = p[-1] >> 4;
+    p += delta == 13 ? 1 : delta == 14 ? 2 : 0;
+    if (len == 13) {
+      if (p >= end) return NULL;
+      len = 13 + *p++;
+    } else if (len == 14) {
+      if (p + 1 >= end) return NULL;
+      len = 269 + (p[0] << 8 | p[1]);
+      p += 2;
+    }
+    p += len;
+  }
+  return p < end ? p + 1 : NULL;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Fetch the statistics for one resource, with a confirmable GET
+// retransmitted a few times if need be. Called before and after the
+// run, so nothing else is outstanding.
+static int fetch_server_stats(int sock, const char *path,
+                              struct server_stats *st) {
+  static uint16_t id = 0x8000;
+  char query[64];
+  int query_len = snprintf(query, sizeof(query), "r=%s", path);
+
+  uint8_t req[MAX_MSG_LEN];
+  req[0] = 0x40 | COAP_TYPE_CON << 4 | TOKEN_LEN;
+  req[1] = COAP_GET;
+  req[2] = ++id >> 8;
+  req[3] = id & 0xff;
+  memcpy(req + 4, STATS_TOKEN, TOKEN_LEN);
+  uint8_t *p = req + 4 + TOKEN_LEN;
+  int last = 0;
+  p = put_option(p, &last, OPTION_URI_PATH, "stats", 5);
+  p = put_option(p, &last, OPTION_URI_QUERY, query, query_len);
+
+  for (int attempt = 0; attempt < 4; ++attempt) {
+    if (send_msg(sock, req, p - req) < 0) {
+      perror("send");
+      return -1;
+    }
+    uint64_t deadline = now_us() + 2000000;
+    for (uint64_t now; (now = now_us()) < deadline;) {
+      struct pollfd pfd = { .fd = sock, .events = POLLIN };
+      if (poll(&pfd, 1, (int)((deadline - now) / 1000) + 1) <= 0) continue;
+
+      uint8_t buf[MAX_MSG_LEN];
+      ssize_t len = recv_msg(sock, buf, sizeof(buf));
+      // Skip anything else, such as a late answer to an earlier fetch.
+      if (len < 4 + TOKEN_LEN || (buf[0] & 0x0f) != TOKEN_LEN ||
+          (buf[2] << 8 | buf[3]) != id ||
+          memcmp(buf + 4, STATS_TOKEN, TOKEN_LEN) != 0)
+        continue;
+      if (buf[1] >> 5 != 2) {
+        fprintf(stderr, "stats?%s: error %d.%02d\n", query, buf[1] >> 5,
+                buf[1] & 0x1f);
+        return -1;
+      }
+
+      // See src/stats.c for the format: a header, requests, errors and
+      // bytes sent per method, the latency histogram and the sum.
+      const uint8_t *end = buf + len;
+      const uint8_t *pl = find_payload(buf + 4 + TOKEN_LEN, end);
+      if (!pl || end - pl < 8) break;
+      int methods = pl[2], buckets = pl[3];
+      if (end - pl < 8 + 4 * (3 * methods + buckets + 1)) break;
+      st->hz = get_le32(pl + 4);
+      const uint8_t *latency = pl + 8 + 4 * 3 * methods;
+      st->responses = 0;
+      for (int b = 0; b < buckets; ++b)
+        st->responses += get_le32(latency + 4 * b);
+      st->cycles = get_le32(latency + 4 * buckets);
+      return 0;
+    }
+  }
+  fprintf(stderr, "stats?%s: no usable response (does the server have "
+          "CONFIG_BASIC_COAP_STATS?)\n", query);
+  return -1;
+}
+
+// The distinct resources in the mix.
+static int mix_paths(const struct options *opts, const char **paths) {
+  int n = 0;
+  for (int i = 0; i < opts->mix_len; ++i) {
+    const char *path = request_path(opts->mix[i]);
+    int j = 0;
+    while (j < n && strcmp(paths[j], path) != 0) ++j;
+    if (j == n) paths[n++] = path;
+  }
+  return n;
+}
+
+static void report_server_stats(const char *path,
+                                const struct server_stats *before,
+                                const struct server_stats *after) {
+  // Unsigned arithmetic takes care of the counters wrapping.
+  uint32_t responses = after->responses - before->responses;
+  uint32_t cycles = after->cycles - before->cycles;
+  if (!responses || !after->hz) {
+    printf("server %s: no responses\n", path);
+    return;
+  }
+  double mean = (double)cycles / responses;
+  printf("server %s: %u responses, mean %.0f cycles (%.1f us) "
+         "per response\n", path, responses, mean, mean * 1e6 / after->hz);
+}
+
+
+// ----------------------------------------------------------------------
+// MAIN PROGRAM
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-m get,put,wellknown] [-N] [-c window]\n"
+          "          [-r rate] [-d seconds | -n count] [-a ack_timeout_ms]\n"
+          "          [-R max_retransmit] [-H] [-S identity:hexkey] [-s] host\n",
+          prog);
+  exit(2);
+}
+
+static void parse_mix(struct options *opts, char *arg) {
+  opts->mix_len = 0;
+  for (char *m = strtok(arg, ","); m; m = strtok(NULL, ",")) {
+    if (opts->mix_len == (int)(sizeof(opts->mix) / sizeof(opts->mix[0]))) break;
+    if (strcmp(m, "get") == 0)
+      opts->mix[opts->mix_len++] = REQ_GET;
+    else if (strcmp(m, "put") == 0)
+      opts->mix[opts->mix_len++] = REQ_PUT;
+    else if (strcmp(m, "wellknown") == 0)
+      opts->mix[opts->mix_len++] = REQ_WELLKNOWN;
+    else {
+      fprintf(stderr, "Unknown method: %s\n", m);
+      exit(2);
+    }
+  }
+  if (opts->mix_len == 0) exit(2);
+}
+
+static void parse_psk(struct options *opts, char *arg) {
+  char *colon = strchr(arg, ':');
+  size_t hex_len = colon ? strlen(colon + 1) : 0;
+  if (!colon || hex_len == 0 || hex_len % 2 || hex_len / 2 > sizeof(opts->psk)) {
+    fprintf(stderr, "Bad PSK: expected identity:hexkey\n");
+    exit(2);
+  }
+  *colon = '\0';
+  opts->psk_identity = arg;
+  opts->psk_len = hex_len / 2;
+  for (size_t i = 0; i < opts->psk_len; ++i) {
+    unsigned v;
+    if (sscanf(colon + 1 + 2 * i, "%2x", &v) != 1) {
+      fprintf(stderr, "Bad PSK: expected identity:hexkey\n");
+      exit(2);
+    }
+    opts->psk[i] = (uint8_t)v;
+  }
+}
+
+// OpenSSL asks for the PSK during the handshake.
+static const struct options *psk_opts;
+
+static unsigned psk_callback(SSL *s, const char *hint, char *identity,
+                             unsigned max_identity_len, unsigned char *psk,
+                             unsigned max_psk_len) {
+  (void)s;
+  (void)hint;
+  if (strlen(psk_opts->psk_identity) >= max_identity_len ||
+      psk_opts->psk_len > max_psk_len)
+    return 0;
+  strcpy(identity, psk_opts->psk_identity);
+  memcpy(psk, psk_opts->psk, psk_opts->psk_len);
+  return (unsigned)psk_opts->psk_len;
+}
+
+// Do the DTLS handshake on a connected socket, timing it, then make
+// the socket non-blocking so that SSL_read doesn't wait.
+static int dtls_connect(int sock, const struct options *opts,
+                        const struct sockaddr *addr) {
+  psk_opts = opts;
+  SSL_CTX *ctx = SSL_CTX_new(DTLS_client_method());
+  if (!ctx) goto fail;
+  SSL_CTX_set_min_proto_version(ctx, DTLS1_2_VERSION);
+  SSL_CTX_set_psk_client_callback(ctx, psk_callback);
+  // TLS_PSK_WITH_AES_128_CCM_8 is the suite RFC 7252 requires for
+  // PSK mode. OpenSSL puts 64-bit tags below its default security
+  // level.
+  if (!SSL_CTX_set_cipher_list(ctx, "PSK-AES128-CCM8:PSK-AES128-CCM:"
+                                    "@SECLEVEL=0"))
+    goto fail;
+
+  ssl = SSL_new(ctx);
+  SSL_CTX_free(ctx);
+  if (!ssl) goto fail;
+  BIO *bio = BIO_new_dgram(sock, BIO_NOCLOSE);
+  if (!bio) goto fail;
+  BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, (void *)addr);
+  SSL_set_bio(ssl, bio, bio);
+  SSL_set_options(ssl, SSL_OP_NO_QUERY_MTU);
+  DTLS_set_link_mtu(ssl, MAX_MSG_LEN);
+
+  uint64_t start = now_us();
+  if (SSL_connect(ssl) != 1) goto fail;
+  handshake_us = now_us() - start;
+  printf("DTLS handshake %.1f ms (%s)\n", handshake_us / 1000.0,
+         SSL_get_cipher_name(ssl));
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return 0;
+
+fail:
+  fprintf(stderr, "DTLS handshake failed\n");
+  ERR_print_errors_fp(stderr);
+  return -1;
+}
+
+static int open_socket(const struct options *opts) {
+  struct addrinfo hints = { .ai_socktype = SOCK_DGRAM };
+  struct addrinfo *res;
+  int r = getaddrinfo(opts->host, opts->port, &hints, &res);
+  if (r != 0) {
+    fprintf(stderr, "%s: %s\n", opts->host, gai_strerror(r));
+    return -1;
+  }
+
+  // Connect, so that we only see datagrams from the server and can
+  // use send and recv.
+  int sock = socket(res->ai_family, SOCK_DGRAM, 0);
+  if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+    perror(opts->host);
+    sock = -1;
+  } else if (opts->psk_identity && dtls_connect(sock, opts, res->ai_addr) < 0) {
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(res);
+  return sock;
+}
+
+static void report(const struct options *opts, double elapsed) {
+  printf("mode %s, window %d", opts->con ? "CON" : "NON", opts->window);
+  if (opts->rate > 0)
+    printf(", rate %.1f req/s\n", opts->rate);
+  else
+    printf(", unpaced\n");
+  printf("sent %llu, completed %llu, lost %llu (%.2f%%), "
+         "retransmissions %llu, error responses %llu, unmatched %llu\n",
+         (unsigned long long)counters.sent,
+         (unsigned long long)counters.completed,
+         (unsigned long long)counters.lost,
+         counters.sent ? 100.0 * counters.lost / counters.sent : 0.0,
+         (unsigned long long)counters.retransmits,
+         (unsigned long long)counters.errors,
+         (unsigned long long)counters.unmatched);
+  printf("throughput %.1f req/s over %.2f s\n",
+         counters.completed / elapsed, elapsed);
+  if (samples == 0) return;
+  printf("latency us: p50 %llu, p99 %llu, p999 %llu, max %llu, mean %.1f\n",
+         (unsigned long long)percentile(0.50),
+         (unsigned long long)percentile(0.99),
+         (unsigned long long)percentile(0.999),
+         (unsigned long long)latency_max, (double)latency_sum / samples);
+
+  if (!opts->show_histogram) return;
+  printf("%12s %12s %8s\n", "from us", "count", "cum %");
+  uint64_t seen = 0;
+  for (int b = 0; b < BUCKETS; ++b) {
+    if (!histogram[b]) continue;
+    seen += histogram[b];
+    printf("%12llu %12llu %8.3f\n", (unsigned long long)bucket_floor(b),
+           (unsigned long long)histogram[b], 100.0 * seen / samples);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct options opts = {
+    .port = NULL, .mix = { REQ_GET }, .mix_len = 1, .con = true,
+    .window = 1, .duration = 10, .ack_timeout = 2000000, .max_retransmit = 4,
+  };
+  int c;
+  while ((c = getopt(argc, argv, "p:m:Nc:r:d:n:a:R:HS:s")) != -1) {
+    switch (c) {
+    case 'p': opts.port = optarg; break;
+    case 'm': parse_mix(&opts, optarg); break;
+    case 'N': opts.con = false; break;
+    case 'c': opts.window = atoi(optarg); break;
+    case 'r': opts.rate = atof(optarg); break;
+    case 'd': opts.duration = atof(optarg); break;
+    case 'n': opts.count = atol(optarg); break;
+    case 'a': opts.ack_timeout = atol(optarg) * 1000ull; break;
+    case 'R': opts.max_retransmit = atoi(optarg); break;
+    case 'H': opts.show_histogram = true; break;
+    case 'S': parse_psk(&opts, optarg); break;
+    case 's': opts.server_stats = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || opts.window < 1 || opts.window > 65535 ||
+      opts.ack_timeout == 0)
+    usage(argv[0]);
+  opts.host = argv[optind];
+  if (!opts.port) opts.port = opts.psk_identity ? "5684" : "5683";
+
+  int sock = open_socket(&opts);
+  if (sock < 0) return 1;
+
+  struct slot *slots = calloc(opts.window, sizeof(*slots));
+  if (!slots) return 1;
+  srand((unsigned)now_us());
+
+  const char *paths[8];
+  struct server_stats before[8], after[8];
+  int num_paths = opts.server_stats ? mix_paths(&opts, paths) : 0;
+  for (int i = 0; i < num_paths; ++i)
+    if (fetch_server_stats(sock, paths[i], &before[i]) < 0) return 1;
+
+  uint64_t start = now_us();
+  uint64_t end = opts.count ? UINT64_MAX : start + opts.duration * 1e6;
+  uint64_t interval = opts.rate > 0 ? 1e6 / opts.rate : 0;
+  uint64_t next_send = start;
+  int outstanding = 0;
+
+  while (true) {
+    uint64_t now = now_us();
+    bool sending = now < end &&
+                   (opts.count == 0 || counters.sent < (uint64_t)opts.count);
+
+    // Fill the window, subject to the pacing rate.
+    for (int i = 0; sending && i < opts.window; ++i) {
+      if (slots[i].in_use) continue;
+      if (interval && now < next_send) break;
+      if (start_request(sock, &opts, slots, i, now) < 0) return 1;
+      if (interval) {
+        // Don't try to catch up in a burst after the window has been
+        // full for a long time.
+        next_send += interval;
+        if (next_send + 1000000 < now) next_send = now;
+      }
+      if (opts.count && counters.sent >= (uint64_t)opts.count) break;
+    }
+
+    if (expire_requests(sock, &opts, slots, now) < 0) return 1;
+
+    outstanding = 0;
+    uint64_t wake = sending && interval ? next_send : UINT64_MAX;
+    for (int i = 0; i < opts.window; ++i) {
+      if (!slots[i].in_use) continue;
+      ++outstanding;
+      if (slots[i].deadline < wake) wake = slots[i].deadline;
+    }
+    if (!sending && outstanding == 0) break;
+    if (sending && end < wake) wake = end;
+
+    // Wait for a response or the next deadline.
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    struct timespec ts = { 0, 0 };
+    if (wake > now) {
+      ts.tv_sec = (wake - now) / 1000000;
+      ts.tv_nsec = (wake - now) % 1000000 * 1000;
+    }
+    if (ppoll(&pfd, 1, &ts, NULL) < 0 && errno != EINTR) {
+      perror("ppoll");
+      return 1;
+    }
+
+    // Drain everything that has arrived.
+    uint8_t buf[MAX_MSG_LEN];
+    ssize_t len;
+    while ((len = recv_msg(sock, buf, sizeof(buf))) >= 0)
+      handle_response(sock, &opts, slots, buf, len, now_us());
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+      perror("recv");
+      return 1;
+    }
+  }
+
+  report(&opts, (now_us() - start) / 1e6);
+  for (int i = 0; i < num_paths; ++i) {
+    if (fetch_server_stats(sock, paths[i], &after[i]) < 0) return 1;
+    report_server_stats(paths[i], &before[i], &after[i]);
+  }
+  if (ssl) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+  }
+  close(sock);
+  free(slots);
+  return 0;
+}
@@ -0,0 +1,154 @@
+// Host-side microbenchmark for the CoAP request router.
+//
+// Compares the generated perfect hash lookup used by router.c against
+// the linear scan done by Zephyr's coap_handle_request, for synthetic
+// resource tables of 2, 20 and 200 resources. Each table is a
+// resources.def-style file, turned into a routing table by
+// scripts/gen_router.py exactly as in the firmware build (see the
+// Makefile).
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "router_hash.h"
+
+#include "table_2.h"
+#include "table_20.h"
+#include "table_200.h"
+
+#define MAX_SEGS 4
+#define LOOKUPS 10000000
+
+// A request's Uri-Path options, as coap_packet_parse would give them.
+struct segment {
+  const uint8_t *value;
+  uint8_t len;
+};
+struct request {
+  struct segment segs[MAX_SEGS];
+  int nsegs;
+};
+
+// Resource paths, expanded from the .def files the same way
+// endpoints.c does.
+#define COAP_RESOURCE(name, get, post, put, del, user_data, ...) \
+  { __VA_ARGS__, NULL },
+static const char *const paths_2[][MAX_SEGS + 1] = {
+#include "resources_2.def"
+};
+static const char *const paths_20[][MAX_SEGS + 1] = {
+#include "resources_20.def"
+};
+static const char *const paths_200[][MAX_SEGS + 1] = {
+#include "resources_200.def"
+};
+#undef COAP_RESOURCE
+
+struct table {
+  int n;
+  const char *const (*paths)[MAX_SEGS + 1];
+  const uint16_t *displace;
+  uint32_t bucket_mask, slot_mask;
+  const void *slots;
+  bool wide_slots;
+  unsigned empty;
+};
+
+#define TABLE(N)                                                       \
+  { N, paths_##N, table_##N##_displace, TABLE_##N##_BUCKET_MASK,       \
+    TABLE_##N##_SLOT_MASK, table_##N##_slots,                          \
+    sizeof(table_##N##_slots[0]) > 1, TABLE_##N##_EMPTY }
+
+static const struct table tables[] = { TABLE(2), TABLE(20), TABLE(200) };
+
+static bool path_matches(const char *const *path, const struct request *req) {
+  int i;
+  for (i = 0; i < req->nsegs; ++i) {
+    if (!path[i]) return false;
+    if (strlen(path[i]) != req->segs[i].len ||
+        memcmp(path[i], req->segs[i].value, req->segs[i].len) != 0)
+      return false;
+  }
+  return path[i] == NULL;
+}
+
+static int linear_lookup(const struct table *t, const struct request *req) {
+  for (int i = 0; i < t->n; ++i)
+    if (path_matches(t->paths[i], req)) return i;
+  return -1;
+}
+
+static int hash_lookup(const struct table *t, const struct request *req) {
+  uint32_t h = ROUTER_HASH_INIT;
+  for (int i = 0; i < req->nsegs; ++i)
+    h = router_hash_segment(h, req->segs[i].value, req->segs[i].len);
+  uint32_t slot = router_slot(h, t->displace, t->bucket_mask, t->slot_mask);
+  unsigned idx = t->wide_slots ? ((const uint16_t *)t->slots)[slot]
+                               : ((const uint8_t *)t->slots)[slot];
+  if (idx == t->empty) return -1;
+  return path_matches(t->paths[idx], req) ? (int)idx : -1;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Time LOOKUPS lookups over the given requests, in ns per lookup.
+static double run(int (*lookup)(const struct table *, const struct request *),
+                  const struct table *t, const struct request *reqs,
+                  int nreqs, long *sum) {
+  double start = now();
+  for (long i = 0; i < LOOKUPS; ++i) *sum += lookup(t, &reqs[i % nreqs]);
+  return (now() - start) * 1e9 / LOOKUPS;
+}
+
+static void make_request(struct request *req, const char *const *path) {
+  req->nsegs = 0;
+  for (; *path; ++path) {
+    req->segs[req->nsegs].value = (const uint8_t *)*path;
+    req->segs[req->nsegs].len = strlen(*path);
+    ++req->nsegs;
+  }
+}
+
+int main(void) {
+  long sum = 0;
+  printf("%10s %14s %14s %14s\n", "resources", "linear ns", "hash ns",
+         "hash miss ns");
+  for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); ++i) {
+    const struct table *t = &tables[i];
+
+    // Check that every resource is found by both methods.
+    struct request *reqs = calloc(t->n, sizeof(*reqs));
+    for (int j = 0; j < t->n; ++j) {
+      make_request(&reqs[j], t->paths[j]);
+      if (linear_lookup(t, &reqs[j]) != j || hash_lookup(t, &reqs[j]) != j) {
+        fprintf(stderr, "lookup failed for resource %d of %d\n", j, t->n);
+        return 1;
+      }
+    }
+
+    // Requests are spread evenly over the resources.
+    double linear = run(linear_lookup, t, reqs, t->n, &sum);
+    double hash = run(hash_lookup, t, reqs, t->n, &sum);
+
+    // Unknown paths: the worst case for the linear scan.
+    static const char *const missing[] = { "no", "such", "resource", NULL };
+    struct request miss;
+    make_request(&miss, missing);
+    if (hash_lookup(t, &miss) != -1) return 1;
+    double hash_miss = run(hash_lookup, t, &miss, 1, &sum);
+
+    printf("%10d %14.1f %14.1f %14.1f\n", t->n, linear, hash, hash_miss);
+    free(reqs);
+  }
+
+  // Keep the lookups from being optimised away.
+  return sum == 42;
+}
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Generate the perfect hash routing table for the CoAP resources.
+
+Reads the COAP_RESOURCE(...) entries from src/resources.def and writes
+a header with a "hash and displace" perfect hash over the resources'
+Uri-Path segments (see src/router_hash.h, whose hash functions are
+duplicated here), mapping each path to its index in coap_resources.
+
+Usage: gen_router.py [--prefix NAME] resources.def router_table.h
+"""
+
+import argparse
+import re
+import sys
+
+MASK32 = 0xffffffff
+HASH_INIT = 2166136261
+HASH_PRIME = 16777619
+GOLDEN = 0x9e3779b9
+MAX_DISPLACE = 0xffff
+
+
+def hash_path(segments):
+    h = HASH_INIT
+    for seg in segments:
+        h = ((h ^ ord('/')) * HASH_PRIME) & MASK32
+        for b in seg.encode():
+            h = ((h ^ b) * HASH_PRIME) & MASK32
+    return h
+
+
+def mix(h):
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & MASK32
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & MASK32
+    h ^= h >> 16
+    return h
+
+
+def slot(h, d, slot_mask):
+    return mix(h ^ ((d * GOLDEN) & MASK32)) & slot_mask
+
+
+def pow2_at_least(n):
+    p = 1
+    while p < n:
+        p *= 2
+    return p
+
+
+def parse(path):
+    """Return the list of resource paths (as segment lists), in order."""
+    text = ' '.join(line.split('//', 1)[0] for line in open(path))
+    resources = []
+    for m in re.finditer(r'COAP_RESOURCE\s*\(([^)]*)\)', text):
+        segments = re.findall(r'"((?:[^"\\]|\\.)*)"', m.group(1))
+        if not segments:
+            sys.exit('{}: resource with no path: {}'.format(path, m.group(0)))
+        resources.append(segments)
+    return resources
+
+
+def build(resources):
+    """Find bucket displacements giving a collision-free slot table."""
+    n = len(resources)
+    nslots = pow2_at_least(max(2, n + n // 4))
+    nbuckets = pow2_at_least(max(1, (n + 1) // 2))
+    hashes = [hash_path(r) for r in resources]
+    if len(set(hashes)) != n:
+        sys.exit('duplicate resource paths (or path hash collision)')
+
+    buckets = [[] for _ in range(nbuckets)]
+    for i, h in enumerate(hashes):
+        buckets[(mix(h) >> 16) & (nbuckets - 1)].append(i)
+
+    displace = [0] * nbuckets
+    slots = [None] * nslots
+    order = sorted(range(nbuckets), key=lambda b: -len(buckets[b]))
+    for b in order:
+        if not buckets[b]:
+            continue
+        for d in range(MAX_DISPLACE + 1):
+            want = [slot(hashes[i], d, nslots - 1) for i in buckets[b]]
+            if len(set(want)) == len(want) and \
+               all(slots[s] is None for s in want):
+                break
+        else:
+            sys.exit('could not place bucket {}'.format(b))
+        displace[b] = d
+        for i, s in zip(buckets[b], want):
+            slots[s] = i
+    return displace, slots
+
+
+def write(out, prefix, resources, displace, slots, source):
+    n = len(resources)
+    slot_type = 'uint8_t' if n < 0xff else 'uint16_t'
+    empty = 0xff if n < 0xff else 0xffff
+    upper = prefix.upper()
+    lines = [
+        '// Generated by scripts/gen_router.py from {}: do not edit.'
+        .format(source),
+        '',
+        '#define {}_RESOURCES {}'.format(upper, n),
+        '#define {}_BUCKET_MASK {}u'.format(upper, len(displace) - 1),
+        '#define {}_SLOT_MASK {}u'.format(upper, len(slots) - 1),
+        '#define {}_EMPTY {}'.format(upper, empty),
+        '',
+        'static const uint16_t {}_displace[{}] = {{'
+        .format(prefix, len(displace)),
+    ]
+    for i in range(0, len(displace), 8):
+        lines.append('  ' + ', '.join(str(d) for d in displace[i:i + 8]) +
+                     ',')
+    lines += ['};', '',
+              'static const {} {}_slots[{}] = {{'
+              .format(slot_type, prefix, len(slots))]
+    for s, i in enumerate(slots):
+        if i is None:
+            lines.append('  {},'.format(empty))
+        else:
+            lines.append('  {},  // {}'.format(i, '/'.join(resources[i])))
+    lines += ['};', '']
+    with open(out, 'w') as f:
+        f.write('\n'.join(lines))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--prefix', default='router',
+                        help='prefix for generated names')
+    parser.add_argument('input')
+    parser.add_argument('output')
+    args = parser.parse_args()
+
+    resources = parse(args.input)
+    displace, slots = build(resources)
+    write(args.output, args.prefix, resources, displace, slots,
+          args.input.split('/')[-1])
+
+
+if __name__ == '__main__':
+    main()
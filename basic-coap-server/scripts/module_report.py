@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+"""Print the RAM and ROM used by each module of a Zephyr build.
+
+Reads the GNU ld map file (build/zephyr/zephyr.map) and adds up the
+input sections that went into each output section, by the library
+they came from: libzephyr.a, libkernel.a, the mbedTLS and OpenThread
+libraries, and so on. Objects from the application library
+(libapp.a) are listed one source file at a time.
+
+An output section counts as ROM if its load address is in a read-only
+memory region, and as RAM if its run address is in a writable one, so
+initialised data counts as both. If the map file has no memory regions
+(e.g. a host build), sections are classified by name instead.
+
+Usage: module_report.py [--by-file] [--sort rom|ram|name] zephyr.map
+"""
+
+import argparse
+import collections
+import os
+import re
+import sys
+
+# Output sections that take up no space on the target.
+NOT_ALLOCATED = re.compile(
+    r'^\.(debug|comment|ARM\.attributes|symtab|strtab|shstrtab|stab|'
+    r'gnu_debug|note\.gnu\.build-id$)')
+
+REGION = re.compile(r'^(\S+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)(?:\s+(\S+))?$')
+OUTPUT = re.compile(r'^(\S+)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)'
+                    r'(?:\s+load address 0x([0-9a-f]+))?)?\s*$')
+INPUT = re.compile(r'^ (\S+)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)'
+                   r'(?:\s+(.*\S))?)?\s*$')
+SECTION_ADDRESS = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)'
+                             r'(?:\s+load address 0x([0-9a-f]+))?\s*$')
+CONTINUATION = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(.+)$')
+MEMBER = re.compile(r'^(.*?)([^/]+\.a)\((.+)\)$')
+
+
+class Region:
+    def __init__(self, name, origin, length, attributes):
+        self.name = name
+        self.origin = origin
+        self.end = origin + length
+        self.writable = 'w' in attributes and '!w' not in attributes
+
+    def contains(self, addr):
+        return self.origin <= addr < self.end
+
+
+def module_name(source, by_file):
+    """Map an input file name from the map file to a module name."""
+    m = MEMBER.match(source)
+    if not m:
+        return os.path.basename(source)
+    archive, member = m.group(2), m.group(3)
+    if by_file or archive == 'libapp.a':
+        member = re.sub(r'\.(c|cpp|S)?\.?obj$|\.o$', '', member)
+        if archive == 'libapp.a':
+            return member
+        return '{}({})'.format(archive, member)
+    return archive
+
+
+def classify_by_name(section):
+    """(rom, ram) for an output section, without memory regions."""
+    if re.match(r'^\.(bss|tbss|noinit)', section):
+        return False, True
+    if re.match(r'^\.(data|tdata)', section):
+        return True, True
+    return True, False
+
+
+def parse_map(f, by_file):
+    regions = []
+    sizes = collections.defaultdict(lambda: [0, 0])
+    section = None
+    rom = ram = False
+    pending = False
+    state = 'start'
+
+    def add(source, size):
+        if size == 0:
+            return
+        entry = sizes[module_name(source, by_file)]
+        if rom:
+            entry[0] += size
+        if ram:
+            entry[1] += size
+
+    for line in f:
+        line = line.rstrip('\n')
+        if state == 'start':
+            if line.startswith('Memory Configuration'):
+                state = 'regions'
+            continue
+        if state == 'regions':
+            if line.startswith('Linker script and memory map'):
+                state = 'map'
+                continue
+            m = REGION.match(line)
+            if m and m.group(1) not in ('Name', '*default*'):
+                regions.append(Region(m.group(1), int(m.group(2), 16),
+                                      int(m.group(3), 16), m.group(4) or ''))
+            continue
+
+        if pending:
+            # A long input section name pushes its address and size on
+            # to the next line.
+            m = CONTINUATION.match(line)
+            if m:
+                add(m.group(3), int(m.group(2), 16))
+            pending = False
+            continue
+
+        if not line:
+            continue
+        if not line[0].isspace():
+            m = OUTPUT.match(line)
+            if not m or NOT_ALLOCATED.match(m.group(1)):
+                section = None
+                continue
+            section = m.group(1)
+            if m.group(2) is None:
+                # A long output section name pushes its address and
+                # size on to the next line.
+                rom = ram = None
+            else:
+                rom, ram = section_kind(section, m.group(2), m.group(4),
+                                        regions)
+            continue
+
+        if section is None:
+            continue
+        if rom is None:
+            m = SECTION_ADDRESS.match(line)
+            if m:
+                rom, ram = section_kind(section, m.group(1), m.group(3),
+                                        regions)
+            else:
+                section = None
+            continue
+
+        # Input sections are indented by one space. Input section
+        # descriptions from the linker script ("*(.text*)") and
+        # symbol assignments are indented too, but don't start with
+        # a section name.
+        m = INPUT.match(line)
+        if not m:
+            continue
+        name = m.group(1)
+        if name == '*fill*':
+            add('(fill)', int(m.group(3), 16))
+        elif not (name.startswith('.') or name == 'COMMON'):
+            continue
+        elif m.group(2) is None:
+            pending = True
+        elif m.group(4) and not m.group(4).startswith('0x'):
+            add(m.group(4), int(m.group(3), 16))
+
+    return regions, sizes
+
+
+def section_kind(section, vma, lma, regions):
+    """(rom, ram) for an output section at the given run address and
+    load address (hex strings; the load address may be None)."""
+    if not regions:
+        return classify_by_name(section)
+    vma = int(vma, 16)
+    lma = int(lma, 16) if lma else vma
+    rom = any(r.contains(lma) and not r.writable for r in regions)
+    ram = any(r.contains(vma) and r.writable for r in regions)
+    return rom, ram
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Per-module RAM and ROM usage from a linker map file.')
+    parser.add_argument('map', help='GNU ld map file, e.g. zephyr.map')
+    parser.add_argument('--by-file', action='store_true',
+                        help='list every object file, not just libraries')
+    parser.add_argument('--sort', choices=['rom', 'ram', 'name'],
+                        default='rom', help='sort order (%(default)s)')
+    args = parser.parse_args()
+
+    try:
+        with open(args.map) as f:
+            regions, sizes = parse_map(f, args.by_file)
+    except OSError as e:
+        sys.exit('{}: {}'.format(args.map, e.strerror))
+
+    if args.sort == 'name':
+        rows = sorted(sizes.items())
+    else:
+        column = 0 if args.sort == 'rom' else 1
+        rows = sorted(sizes.items(), key=lambda kv: (-kv[1][column], kv[0]))
+    rows = [(name, rom, ram) for name, (rom, ram) in rows if rom or ram]
+
+    width = max([len(name) for name, _, _ in rows] + [6])
+    print('{:<{}} {:>9} {:>9}'.format('Module', width, 'ROM', 'RAM'))
+    print('-' * (width + 20))
+    for name, rom, ram in rows:
+        print('{:<{}} {:>9} {:>9}'.format(name, width, rom, ram))
+    print('-' * (width + 20))
+    print('{:<{}} {:>9} {:>9}'.format('Total', width,
+                                      sum(r[1] for r in rows),
+                                      sum(r[2] for r in rows)))
+
+    for r in regions:
+        print('{} region: {} bytes at 0x{:08x} ({})'.format(
+            r.name, r.end - r.origin, r.origin,
+            'RAM' if r.writable else 'ROM'))
+
+
+if __name__ == '__main__':
+    main()
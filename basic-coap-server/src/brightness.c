@@ -0,0 +1,267 @@
+// Basic OpenThread CoAP server: PWM LED brightness and fades.
+//
+// The "pwm-led0" LED is driven by PWM, with its brightness set either
+// directly or by a fade: a PUT of "fade to 40% over 2 s" is handled
+// here by a k_timer stepping the brightness every
+// CONFIG_BASIC_COAP_FADE_STEP_MS, rather than by the controller
+// sending dozens of separate requests.
+//
+// On the nRF52840 DK (P0.13) and dongle (P0.08), "pwm-led0" is the
+// same pin as LED 0 of the "gpio-leds" node. Once the PWM has driven
+// the pin, setting it as a GPIO does nothing, so led.c spots the
+// shared pin at build time and switches that LED through here:
+// "PUT led" (and bit 0 of "PUT leds") sets 0 or full brightness,
+// cancelling any fade, and "GET led" reports the LED as on at any
+// brightness above zero. If the PWM can't be set up, the LED is left
+// as a plain GPIO LED.
+//
+// Brightness levels go from 0 to 255, and are mapped through a gamma
+// table so that equal steps look equally big. The PWM period is found
+// the same way as in zephyr-examples/blinky_pwm (start long and halve
+// it until the hardware accepts it), but only on first boot: the
+// result is saved with the settings subsystem and just checked on
+// later boots.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <device.h>
+#include <devicetree.h>
+#include <drivers/pwm.h>
+#include <settings/settings.h>
+
+#include "brightness.h"
+
+// The devicetree node identifier for the "pwm-led0" alias.
+#define PWM_LED0_NODE DT_ALIAS(pwm_led0)
+
+#if DT_NODE_HAS_STATUS(PWM_LED0_NODE, okay)
+#define PWM_LABEL DT_PWMS_LABEL(PWM_LED0_NODE)
+#define PWM_CHANNEL DT_PWMS_CHANNEL(PWM_LED0_NODE)
+#define PWM_FLAGS DT_PWMS_FLAGS(PWM_LED0_NODE)
+#else
+#error "Unsupported board: pwm-led0 devicetree alias is not defined"
+#define PWM_LABEL ""
+#define PWM_CHANNEL 0
+#define PWM_FLAGS 0
+#endif
+
+// Longest PWM period we'd like (i.e. lowest frequency that doesn't
+// flicker), and the shortest we'll accept while calibrating.
+#define MAX_PERIOD_USEC (USEC_PER_SEC / CONFIG_BASIC_COAP_PWM_FREQUENCY)
+#define MIN_PERIOD_USEC (MAX_PERIOD_USEC / 16U)
+
+#define SETTINGS_SUBTREE "basic_coap/pwm"
+#define SETTINGS_PERIOD_KEY SETTINGS_SUBTREE "/period"
+
+// Duty cycle for each brightness level, as a fraction of 65535: level
+// i is 65535 * (i / 255) ^ 2.2.
+static const uint16_t gamma_table[256] = {
+      0,     0,     2,     4,     7,    11,    17,    24,
+     32,    42,    53,    65,    79,    94,   111,   129,
+    148,   169,   192,   216,   242,   270,   299,   330,
+    362,   396,   432,   469,   508,   549,   591,   635,
+    681,   729,   779,   830,   883,   938,   995,  1053,
+   1113,  1175,  1239,  1305,  1373,  1443,  1514,  1587,
+   1663,  1740,  1819,  1900,  1983,  2068,  2155,  2243,
+   2334,  2427,  2521,  2618,  2717,  2817,  2920,  3024,
+   3131,  3240,  3350,  3463,  3578,  3694,  3813,  3934,
+   4057,  4182,  4309,  4438,  4570,  4703,  4838,  4976,
+   5115,  5257,  5401,  5547,  5695,  5845,  5998,  6152,
+   6309,  6468,  6629,  6792,  6957,  7124,  7294,  7466,
+   7640,  7816,  7994,  8175,  8358,  8543,  8730,  8919,
+   9111,  9305,  9501,  9699,  9900, 10102, 10307, 10515,
+  10724, 10936, 11150, 11366, 11585, 11806, 12029, 12254,
+  12482, 12712, 12944, 13179, 13416, 13655, 13896, 14140,
+  14386, 14635, 14885, 15138, 15394, 15652, 15912, 16174,
+  16439, 16706, 16975, 17247, 17521, 17798, 18077, 18358,
+  18642, 18928, 19216, 19507, 19800, 20095, 20393, 20694,
+  20996, 21301, 21609, 21919, 22231, 22546, 22863, 23182,
+  23504, 23829, 24156, 24485, 24817, 25151, 25487, 25826,
+  26168, 26512, 26858, 27207, 27558, 27912, 28268, 28627,
+  28988, 29351, 29717, 30086, 30457, 30830, 31206, 31585,
+  31966, 32349, 32735, 33124, 33514, 33908, 34304, 34702,
+  35103, 35507, 35913, 36321, 36732, 37146, 37562, 37981,
+  38402, 38825, 39252, 39680, 40112, 40546, 40982, 41421,
+  41862, 42306, 42753, 43202, 43654, 44108, 44565, 45025,
+  45487, 45951, 46418, 46888, 47360, 47835, 48313, 48793,
+  49275, 49761, 50249, 50739, 51232, 51728, 52226, 52727,
+  53230, 53736, 54245, 54756, 55270, 55787, 56306, 56828,
+  57352, 57879, 58409, 58941, 59476, 60014, 60554, 61097,
+  61642, 62190, 62741, 63295, 63851, 64410, 64971, 65535,
+};
+
+static const struct device *pwm;
+static uint32_t period_usec;
+static uint32_t period_cycles;
+
+// Fade state, shared between the timer handler (which runs in
+// interrupt context) and requests.
+static struct k_spinlock fade_lock;
+static uint8_t level;
+static uint8_t fade_from;
+static uint8_t fade_to;
+static int64_t fade_start;
+static uint32_t fade_ms;
+static bool fading;
+
+static void fade_step(struct k_timer *timer);
+K_TIMER_DEFINE(fade_timer, fade_step, NULL);
+
+
+// Set the PWM output for a brightness level.
+
+static int apply_level(uint8_t lvl) {
+  uint32_t pulse = (uint64_t)gamma_table[lvl] * period_cycles / 65535U;
+  return pwm_pin_set_cycles(pwm, PWM_CHANNEL, period_cycles, pulse,
+                            PWM_FLAGS);
+}
+
+
+// Fade timer handler: move the brightness along a straight line (in
+// brightness levels, so perceptually even) from fade_from to fade_to,
+// and stop the timer when we get there.
+
+static void fade_step(struct k_timer *timer) {
+  k_spinlock_key_t key = k_spin_lock(&fade_lock);
+  uint32_t elapsed = k_uptime_get() - fade_start;
+  if (elapsed >= fade_ms) {
+    level = fade_to;
+    fading = false;
+    k_timer_stop(timer);
+  } else {
+    int delta = (int)fade_to - fade_from;
+    level = fade_from + delta * (int32_t)elapsed / (int32_t)fade_ms;
+  }
+  apply_level(level);
+  k_spin_unlock(&fade_lock, key);
+}
+
+
+// ----------------------------------------------------------------------
+// PWM PERIOD CALIBRATION
+
+// Settings loader for the saved PWM period.
+
+static int load_period(const char *key, size_t len,
+                       settings_read_cb read_cb, void *cb_arg, void *param) {
+  if (!settings_name_steq(key, "period", NULL) || len != sizeof(uint32_t))
+    return 0;
+  uint32_t *period = param;
+  if (read_cb(cb_arg, period, sizeof(*period)) != sizeof(*period))
+    *period = 0;
+  return 0;
+}
+
+// Find the longest period up to MAX_PERIOD_USEC the PWM hardware
+// supports. A saved period is used if the hardware still accepts it,
+// so the probing only happens once per device.
+
+static bool calibrate(void) {
+  uint32_t saved = 0;
+  settings_subsys_init();
+  settings_load_subtree_direct(SETTINGS_SUBTREE, load_period, &saved);
+  if (saved && pwm_pin_set_usec(pwm, PWM_CHANNEL, saved, 0, PWM_FLAGS) == 0) {
+    period_usec = saved;
+    LOG_DBG("Using saved PWM period %u usec", period_usec);
+    return true;
+  }
+
+  period_usec = MAX_PERIOD_USEC;
+  while (pwm_pin_set_usec(pwm, PWM_CHANNEL, period_usec, 0, PWM_FLAGS)) {
+    period_usec /= 2U;
+    if (period_usec < MIN_PERIOD_USEC) {
+      LOG_ERR("PWM device %s does not support a period of at least %u usec",
+              PWM_LABEL, MIN_PERIOD_USEC);
+      return false;
+    }
+  }
+
+  LOG_INF("Calibrated PWM period: %u usec", period_usec);
+  settings_save_one(SETTINGS_PERIOD_KEY, &period_usec, sizeof(period_usec));
+  return true;
+}
+
+
+// ----------------------------------------------------------------------
+// PUBLIC API
+
+bool init_brightness(void) {
+  pwm = device_get_binding(PWM_LABEL);
+  if (!pwm) {
+    LOG_ERR("Didn't find PWM device %s", PWM_LABEL);
+    return false;
+  }
+
+  // The fade engine works in cycles, so that the timer handler doesn't
+  // have to convert.
+  uint64_t cycles_per_sec;
+  if (!calibrate() ||
+      pwm_get_cycles_per_sec(pwm, PWM_CHANNEL, &cycles_per_sec) < 0)
+    goto fail;
+  period_cycles = period_usec * cycles_per_sec / USEC_PER_SEC;
+
+  level = 0;
+  if (apply_level(level) < 0) goto fail;
+  return true;
+
+fail:
+  // Leave the LED to led.c, if it's one of the GPIO LEDs too.
+  pwm = NULL;
+  return false;
+}
+
+
+// Whether init_brightness found the PWM and set it up.
+
+bool brightness_ready(void) { return pwm != NULL; }
+
+
+// Current brightness, 0-255.
+
+uint8_t get_brightness(void) { return level; }
+
+
+// Where the fade in progress is going (0-255) and how long it has
+// left to run. Returns false if there's no fade running.
+
+bool get_fade(uint8_t *target, uint32_t *remaining_ms) {
+  k_spinlock_key_t key = k_spin_lock(&fade_lock);
+  bool r = fading;
+  if (r) {
+    uint32_t elapsed = k_uptime_get() - fade_start;
+    *target = fade_to;
+    *remaining_ms = elapsed < fade_ms ? fade_ms - elapsed : 0;
+  }
+  k_spin_unlock(&fade_lock, key);
+  return r;
+}
+
+
+// Fade to a new brightness (0-255) over the given time. A fade time of
+// zero sets the brightness immediately. Any fade in progress is
+// replaced, starting from wherever it had got to.
+
+int fade_brightness(uint8_t target, uint32_t duration_ms) {
+  if (!pwm) return -ENODEV;
+
+  k_spinlock_key_t key = k_spin_lock(&fade_lock);
+  k_timer_stop(&fade_timer);
+  int r = 0;
+  if (duration_ms == 0 || target == level) {
+    level = target;
+    fading = false;
+    r = apply_level(level);
+  } else {
+    fade_from = level;
+    fade_to = target;
+    fade_start = k_uptime_get();
+    fade_ms = duration_ms;
+    fading = true;
+    k_timer_start(&fade_timer, K_MSEC(CONFIG_BASIC_COAP_FADE_STEP_MS),
+                  K_MSEC(CONFIG_BASIC_COAP_FADE_STEP_MS));
+  }
+  k_spin_unlock(&fade_lock, key);
+  return r;
+}
@@ -0,0 +1,13 @@
+#ifndef _H_BRIGHTNESS_
+#define _H_BRIGHTNESS_
+
+#include <stdint.h>
+
+bool init_brightness(void);
+bool brightness_ready(void);
+
+uint8_t get_brightness(void);
+bool get_fade(uint8_t *target, uint32_t *remaining_ms);
+int fade_brightness(uint8_t target, uint32_t duration_ms);
+
+#endif
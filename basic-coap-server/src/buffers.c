@@ -0,0 +1,67 @@
+// Basic OpenThread CoAP server: CoAP reply buffer pool.
+//
+// Every reply is built in a buffer of the same size, so rather than
+// using k_malloc from the (small) system heap, we keep a fixed set of
+// MAX_COAP_MSG_LEN blocks in a memory slab. Slab allocation is
+// constant time and can't fragment, which matters for a server that's
+// supposed to run for weeks at a time.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+
+#include "buffers.h"
+#include "coap.h"
+
+
+K_MEM_SLAB_DEFINE(reply_slab, MAX_COAP_MSG_LEN,
+                  CONFIG_BASIC_COAP_REPLY_BUFFERS, 4);
+
+// Usage tracking for the "basic_coap buffers" shell command.
+static atomic_t used;
+static atomic_t high_water;
+static atomic_t waits;
+
+
+// Allocate a reply buffer of MAX_COAP_MSG_LEN bytes. This never
+// fails: if the pool is empty, we wait for another thread to release
+// a buffer. (Each thread only ever holds two buffers at a time, a reply
+// and an observe notification, and the pool is sized for that, so this
+// can't deadlock.)
+
+uint8_t *alloc_reply_buffer(void) {
+  void *buf;
+  if (k_mem_slab_alloc(&reply_slab, &buf, K_NO_WAIT) < 0) {
+    atomic_inc(&waits);
+    k_mem_slab_alloc(&reply_slab, &buf, K_FOREVER);
+  }
+
+  // Update the high-water mark. The compare-and-swap loop is needed
+  // because other threads may be allocating at the same time.
+  atomic_val_t now = atomic_inc(&used) + 1;
+  atomic_val_t max;
+  do {
+    max = atomic_get(&high_water);
+  } while (now > max && !atomic_cas(&high_water, max, now));
+
+  return (uint8_t *)buf;
+}
+
+
+// Return a reply buffer to the pool.
+
+void free_reply_buffer(uint8_t *buf) {
+  if (!buf) return;
+  void *mem = buf;
+  k_mem_slab_free(&reply_slab, &mem);
+  atomic_dec(&used);
+}
+
+
+void get_reply_buffer_stats(struct reply_buffer_stats *stats) {
+  stats->total = CONFIG_BASIC_COAP_REPLY_BUFFERS;
+  stats->used = atomic_get(&used);
+  stats->high_water = atomic_get(&high_water);
+  stats->waits = atomic_get(&waits);
+}
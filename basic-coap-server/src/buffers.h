@@ -0,0 +1,19 @@
+#ifndef _H_BUFFERS_
+#define _H_BUFFERS_
+
+#include <zephyr.h>
+
+// Snapshot of reply buffer pool usage.
+struct reply_buffer_stats {
+  uint32_t total;       // Number of buffers in the pool.
+  uint32_t used;        // Buffers currently allocated.
+  uint32_t high_water;  // Most buffers ever allocated at once.
+  uint32_t waits;       // Allocations that had to wait for a buffer.
+};
+
+uint8_t *alloc_reply_buffer(void);
+void free_reply_buffer(uint8_t *buf);
+
+void get_reply_buffer_stats(struct reply_buffer_stats *stats);
+
+#endif
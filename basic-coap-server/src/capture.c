@@ -0,0 +1,213 @@
+// Basic OpenThread CoAP server: packet capture ring.
+//
+// Logging every packet as text is too slow to leave on under load, so
+// instead the most recent packets are recorded in binary form, with a
+// timestamp and the peer address, in a fixed ring of slots. Recording
+// a packet is a slot claim and a memcpy, and takes no locks, so it
+// can be done from the receive thread and all the workers at once.
+// The "basic_coap capture dump" shell command prints the ring as a
+// pcap file (hex-encoded, since the shell is text), with IPv6 and UDP
+// headers reconstructed so that Wireshark decodes it as CoAP.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include <net/net_if.h>
+#include <net/net_ip.h>
+
+#include "capture.h"
+#include "transport.h"
+
+
+#define CAPTURE_PACKETS CONFIG_BASIC_COAP_CAPTURE_PACKETS
+#define SNAPLEN CONFIG_BASIC_COAP_CAPTURE_SNAPLEN
+BUILD_ASSERT((CAPTURE_PACKETS & (CAPTURE_PACKETS - 1)) == 0,
+             "Capture ring size must be a power of two");
+
+// Each slot has a sequence number, used like a seqlock: a writer sets
+// it to 2n+1 while it's filling the slot with packet number n, and to
+// 2n+2 when it's done. A reader copies the slot out and only uses the
+// copy if the sequence number was the same (and even) before and
+// after, so a slot being overwritten is skipped rather than dumped
+// half-written.
+struct capture_slot {
+  atomic_t seq;
+  uint64_t timestamp_us;
+  struct in6_addr peer;
+  uint16_t port;
+  uint8_t dir;
+  uint16_t orig_len;
+  uint16_t len;
+  uint8_t data[SNAPLEN];
+};
+
+static struct capture_slot ring[CAPTURE_PACKETS];
+
+// Number of packets ever recorded: packet n goes in slot n mod
+// CAPTURE_PACKETS.
+static atomic_t next_packet;
+
+
+// Record a packet. The peer is the source address for received
+// packets and the destination for sent ones.
+
+void capture_packet(enum capture_dir dir, const struct sockaddr *peer,
+                    const uint8_t *data, uint16_t len) {
+  uint32_t n = (uint32_t)atomic_inc(&next_packet);
+  struct capture_slot *slot = &ring[n & (CAPTURE_PACKETS - 1)];
+
+  atomic_set(&slot->seq, 2 * n + 1);
+  compiler_barrier();
+
+  const struct sockaddr_in6 *peer6 = (const struct sockaddr_in6 *)peer;
+  slot->timestamp_us = k_ticks_to_us_floor64(k_uptime_ticks());
+  net_ipaddr_copy(&slot->peer, &peer6->sin6_addr);
+  slot->port = peer6->sin6_port;
+  slot->dir = dir;
+  slot->orig_len = len;
+  slot->len = MIN(len, SNAPLEN);
+  memcpy(slot->data, data, slot->len);
+
+  compiler_barrier();
+  atomic_set(&slot->seq, 2 * n + 2);
+}
+
+
+// ----------------------------------------------------------------------
+// PCAP EXPORT
+
+// pcap file header, for raw IPv6 packets (LINKTYPE_IPV6). All the
+// multi-byte fields in pcap files are in the writer's byte order.
+struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} __packed;
+
+struct pcap_record_header {
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} __packed;
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_IPV6 229
+
+// IPv6 and UDP headers in front of each CoAP message. Unlike the pcap
+// headers, these are in network byte order.
+struct ipv6_udp_header {
+  uint8_t vtc;
+  uint8_t tcflow;
+  uint16_t flow;
+  uint16_t payload_len;
+  uint8_t next_header;
+  uint8_t hop_limit;
+  struct in6_addr src;
+  struct in6_addr dst;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint16_t udp_len;
+  uint16_t udp_chksum;
+} __packed;
+
+#define IPV6_UDP_HEADER_LEN sizeof(struct ipv6_udp_header)
+
+// Print bytes as hex, 32 bytes per line.
+
+static void print_hex(const struct shell *shell, const void *data, size_t len) {
+  const uint8_t *p = data;
+  char line[2 * 32 + 1];
+  while (len > 0) {
+    size_t n = MIN(len, 32);
+    for (size_t i = 0; i < n; ++i) {
+      static const char digits[] = "0123456789abcdef";
+      line[2 * i] = digits[p[i] >> 4];
+      line[2 * i + 1] = digits[p[i] & 0x0f];
+    }
+    line[2 * n] = '\0';
+    shell_print(shell, "%s", line);
+    p += n;
+    len -= n;
+  }
+}
+
+static void dump_slot(const struct shell *shell,
+                      const struct capture_slot *slot) {
+  // Our own address as the peer would have seen it. (The UDP checksum
+  // is left as zero: Wireshark doesn't check it by default.)
+  struct in6_addr local = IN6ADDR_ANY_INIT;
+  const struct in6_addr *src =
+    net_if_ipv6_select_src_addr(net_if_get_default(), &slot->peer);
+  if (src) net_ipaddr_copy(&local, src);
+
+  struct ipv6_udp_header ip = {
+    .vtc = 0x60,
+    .payload_len = htons(8 + slot->orig_len),
+    .next_header = IPPROTO_UDP,
+    .hop_limit = 64,
+    .udp_len = htons(8 + slot->orig_len),
+  };
+  if (slot->dir == CAPTURE_RX) {
+    net_ipaddr_copy(&ip.src, &slot->peer);
+    net_ipaddr_copy(&ip.dst, &local);
+    ip.src_port = slot->port;
+    ip.dst_port = htons(COAP_PORT);
+  } else {
+    net_ipaddr_copy(&ip.src, &local);
+    net_ipaddr_copy(&ip.dst, &slot->peer);
+    ip.src_port = htons(COAP_PORT);
+    ip.dst_port = slot->port;
+  }
+
+  struct pcap_record_header rec = {
+    .ts_sec = slot->timestamp_us / USEC_PER_SEC,
+    .ts_usec = slot->timestamp_us % USEC_PER_SEC,
+    .incl_len = IPV6_UDP_HEADER_LEN + slot->len,
+    .orig_len = IPV6_UDP_HEADER_LEN + slot->orig_len,
+  };
+
+  print_hex(shell, &rec, sizeof(rec));
+  print_hex(shell, &ip, sizeof(ip));
+  print_hex(shell, slot->data, slot->len);
+}
+
+
+// Print the packets in the ring, oldest first, as a hex-encoded pcap
+// file. Turn it back into binary with "xxd -r -p".
+
+void capture_dump(const struct shell *shell) {
+  static const struct pcap_file_header header = {
+    .magic = PCAP_MAGIC,
+    .version_major = 2,
+    .version_minor = 4,
+    .snaplen = IPV6_UDP_HEADER_LEN + SNAPLEN,
+    .linktype = LINKTYPE_IPV6,
+  };
+  print_hex(shell, &header, sizeof(header));
+
+  uint32_t end = (uint32_t)atomic_get(&next_packet);
+  uint32_t count = MIN(end, CAPTURE_PACKETS);
+  for (uint32_t n = end - count; n != end; ++n) {
+    struct capture_slot *slot = &ring[n & (CAPTURE_PACKETS - 1)];
+    struct capture_slot copy;
+
+    // Skip packets that are being written, or have been overwritten
+    // since we started.
+    if ((uint32_t)atomic_get(&slot->seq) != 2 * n + 2) continue;
+    compiler_barrier();
+    memcpy(&copy, slot, sizeof(copy));
+    compiler_barrier();
+    if ((uint32_t)atomic_get(&slot->seq) != 2 * n + 2) continue;
+
+    dump_slot(shell, &copy);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef _H_CAPTURE_
+#define _H_CAPTURE_
+
+#include <zephyr.h>
+#include <shell/shell.h>
+#include <net/net_ip.h>
+
+enum capture_dir { CAPTURE_RX, CAPTURE_TX };
+
+#ifdef CONFIG_BASIC_COAP_CAPTURE
+void capture_packet(enum capture_dir dir, const struct sockaddr *peer,
+                    const uint8_t *data, uint16_t len);
+void capture_dump(const struct shell *shell);
+#else
+static inline void capture_packet(enum capture_dir dir,
+                                  const struct sockaddr *peer,
+                                  const uint8_t *data, uint16_t len) { }
+#endif
+
+#endif
@@ -0,0 +1,272 @@
+// Basic OpenThread CoAP server: CBOR encoding and decoding.
+//
+// Just enough of CBOR (RFC 7049) for resource representations:
+// unsigned integers, booleans, null, text strings, arrays and maps,
+// all with definite lengths. The encoder writes straight into a reply
+// buffer, from a response's payload writer (see response.h), and the
+// decoder reads request payloads in place, so neither needs any
+// memory of its own beyond the few pointers in the writer or reader.
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include "cbor.h"
+
+
+// Simple values (major type 7).
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+
+// Largest value that fits in the initial byte, and the additional
+// information values giving the size of a value that follows.
+#define CBOR_INLINE_MAX 23
+#define CBOR_FOLLOWS_1 24
+#define CBOR_FOLLOWS_2 25
+#define CBOR_FOLLOWS_4 26
+
+// How many nested arrays and maps cbor_skip gets through.
+#define CBOR_MAX_DEPTH 4
+
+
+// ----------------------------------------------------------------------
+// ENCODER
+
+void cbor_writer_init(struct cbor_writer *w, uint8_t *buf, size_t len) {
+  w->start = w->p = buf;
+  w->end = buf + len;
+}
+
+
+// Length of everything written, or -ENOSPC if it didn't all fit.
+
+int cbor_writer_len(const struct cbor_writer *w) {
+  return w->p > w->end ? -ENOSPC : w->p - w->start;
+}
+
+
+// Write the head of an item: its major type and a value (the integer
+// itself, or a length or count), in as few bytes as possible.
+
+static void put_head(struct cbor_writer *w, enum cbor_type type,
+                     uint32_t value) {
+  int len = CBOR_HEAD_LEN(value);
+  if (w->end - w->p < len) {
+    // Remember the overflow, without ever writing past the end.
+    w->p = w->end + 1;
+    return;
+  }
+
+  uint8_t *p = w->p;
+  if (len == 1) {
+    *p++ = type << 5 | value;
+  } else {
+    *p++ = type << 5 | (len == 2 ? CBOR_FOLLOWS_1 :
+                        len == 3 ? CBOR_FOLLOWS_2 : CBOR_FOLLOWS_4);
+    for (int i = len - 2; i >= 0; --i) *p++ = value >> (8 * i);
+  }
+  w->p = p;
+}
+
+void cbor_put_uint(struct cbor_writer *w, uint32_t value) {
+  put_head(w, CBOR_UINT, value);
+}
+
+void cbor_put_bool(struct cbor_writer *w, bool value) {
+  put_head(w, CBOR_SIMPLE, value ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void cbor_put_null(struct cbor_writer *w) {
+  put_head(w, CBOR_SIMPLE, CBOR_NULL);
+}
+
+void cbor_put_text(struct cbor_writer *w, const char *text) {
+  size_t len = strlen(text);
+  put_head(w, CBOR_TEXT, len);
+  if (w->p > w->end) return;
+  if (w->end - w->p < len) {
+    w->p = w->end + 1;
+    return;
+  }
+  memcpy(w->p, text, len);
+  w->p += len;
+}
+
+// Arrays and maps are just a head giving the number of items (or
+// key/value pairs) that follow.
+
+void cbor_put_array(struct cbor_writer *w, uint32_t items) {
+  put_head(w, CBOR_ARRAY, items);
+}
+
+void cbor_put_map(struct cbor_writer *w, uint32_t pairs) {
+  put_head(w, CBOR_MAP, pairs);
+}
+
+
+// ----------------------------------------------------------------------
+// DECODER
+
+void cbor_reader_init(struct cbor_reader *r, const uint8_t *buf, size_t len) {
+  r->p = buf;
+  r->end = buf + len;
+}
+
+bool cbor_at_end(const struct cbor_reader *r) { return r->p == r->end; }
+
+
+// Decode the head of the next item, without moving past it. Returns
+// the head's length, or -EINVAL.
+
+static int get_head(const struct cbor_reader *r,
+                    enum cbor_type *type, uint32_t *value) {
+  if (r->p >= r->end) return -EINVAL;
+  *type = r->p[0] >> 5;
+  uint8_t info = r->p[0] & 0x1f;
+  if (info <= CBOR_INLINE_MAX) {
+    *value = info;
+    return 1;
+  }
+
+  // 8-byte values and indefinite lengths are no use to us.
+  int len = info == CBOR_FOLLOWS_1 ? 2 : info == CBOR_FOLLOWS_2 ? 3 :
+    info == CBOR_FOLLOWS_4 ? 5 : -EINVAL;
+  if (len < 0 || r->end - r->p < len) return -EINVAL;
+  *value = 0;
+  for (int i = 1; i < len; ++i) *value = *value << 8 | r->p[i];
+  return len;
+}
+
+
+// Move past the head of an item of the given type, returning its value.
+
+static int get_typed(struct cbor_reader *r, enum cbor_type type,
+                     uint32_t *value) {
+  enum cbor_type t;
+  int len = get_head(r, &t, value);
+  if (len < 0 || t != type) return -EINVAL;
+  r->p += len;
+  return 0;
+}
+
+
+// Major type of the next item, or -EINVAL at the end of the input.
+
+int cbor_peek_type(const struct cbor_reader *r) {
+  return r->p < r->end ? r->p[0] >> 5 : -EINVAL;
+}
+
+bool cbor_peek_null(const struct cbor_reader *r) {
+  return r->p < r->end && r->p[0] == (CBOR_SIMPLE << 5 | CBOR_NULL);
+}
+
+int cbor_get_uint(struct cbor_reader *r, uint32_t *value) {
+  return get_typed(r, CBOR_UINT, value);
+}
+
+int cbor_get_bool(struct cbor_reader *r, bool *value) {
+  if (r->p >= r->end) return -EINVAL;
+  if (r->p[0] != (CBOR_SIMPLE << 5 | CBOR_FALSE) &&
+      r->p[0] != (CBOR_SIMPLE << 5 | CBOR_TRUE))
+    return -EINVAL;
+  *value = r->p[0] == (CBOR_SIMPLE << 5 | CBOR_TRUE);
+  ++r->p;
+  return 0;
+}
+
+int cbor_get_null(struct cbor_reader *r) {
+  if (!cbor_peek_null(r)) return -EINVAL;
+  ++r->p;
+  return 0;
+}
+
+
+// A text string, left where it is in the input: it isn't
+// NUL-terminated.
+
+int cbor_get_text(struct cbor_reader *r, const uint8_t **text, size_t *len) {
+  struct cbor_reader save = *r;
+  uint32_t n;
+  if (get_typed(r, CBOR_TEXT, &n) < 0) return -EINVAL;
+  if (r->end - r->p < n) {
+    *r = save;
+    return -EINVAL;
+  }
+  *text = r->p;
+  *len = n;
+  r->p += n;
+  return 0;
+}
+
+int cbor_get_array(struct cbor_reader *r, uint32_t *items) {
+  return get_typed(r, CBOR_ARRAY, items);
+}
+
+int cbor_get_map(struct cbor_reader *r, uint32_t *pairs) {
+  return get_typed(r, CBOR_MAP, pairs);
+}
+
+
+// Move past the next item if it's the given text string, e.g. a map
+// key.
+
+bool cbor_match_text(struct cbor_reader *r, const char *text) {
+  struct cbor_reader save = *r;
+  const uint8_t *s;
+  size_t len;
+  if (cbor_get_text(r, &s, &len) == 0 &&
+      len == strlen(text) && memcmp(s, text, len) == 0)
+    return true;
+  *r = save;
+  return false;
+}
+
+
+// Move past the next item, whatever it is, including everything in
+// it if it's an array or map (nested up to CBOR_MAX_DEPTH deep). Used
+// to ignore map entries we don't know about.
+
+int cbor_skip(struct cbor_reader *r) {
+  struct cbor_reader save = *r;
+  uint32_t pending[CBOR_MAX_DEPTH + 1] = { 1 };
+  int depth = 0;
+
+  while (depth >= 0) {
+    if (pending[depth] == 0) {
+      --depth;
+      continue;
+    }
+    --pending[depth];
+
+    enum cbor_type type;
+    uint32_t value;
+    int len = get_head(r, &type, &value);
+    if (len < 0) goto fail;
+    r->p += len;
+
+    switch (type) {
+    case CBOR_BYTES:
+    case CBOR_TEXT:
+      if (r->end - r->p < value) goto fail;
+      r->p += value;
+      break;
+    case CBOR_ARRAY:
+    case CBOR_MAP:
+      if (depth == CBOR_MAX_DEPTH) goto fail;
+      pending[++depth] = type == CBOR_MAP ? 2 * value : value;
+      break;
+    case CBOR_TAG:
+      // A tag applies to the item after it.
+      ++pending[depth];
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+
+fail:
+  *r = save;
+  return -EINVAL;
+}
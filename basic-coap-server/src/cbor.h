@@ -0,0 +1,69 @@
+#ifndef _H_CBOR_
+#define _H_CBOR_
+
+#include <zephyr.h>
+
+// "application/cbor" content format (RFC 7049, Section 7.4).
+#define CBOR_FORMAT 60
+
+// CBOR major types (RFC 7049, Section 2.1).
+enum cbor_type {
+  CBOR_UINT = 0,
+  CBOR_NINT = 1,
+  CBOR_BYTES = 2,
+  CBOR_TEXT = 3,
+  CBOR_ARRAY = 4,
+  CBOR_MAP = 5,
+  CBOR_TAG = 6,
+  CBOR_SIMPLE = 7,  // false, true, null, undefined and floats.
+};
+
+// Encoded sizes, for working out the largest payload of a response.
+#define CBOR_HEAD_LEN(n) \
+  ((n) < 24 ? 1 : (n) <= 0xff ? 2 : (n) <= 0xffff ? 3 : 5)
+#define CBOR_TEXT_LEN(s) (CBOR_HEAD_LEN(sizeof(s) - 1) + sizeof(s) - 1)
+#define CBOR_BOOL_LEN 1
+
+// Streaming encoder, writing straight into a caller's buffer. Writes
+// past the end are dropped and remembered, so a sequence of calls
+// only needs checking once, with cbor_writer_len.
+struct cbor_writer {
+  uint8_t *start;
+  uint8_t *p;
+  uint8_t *end;
+};
+
+void cbor_writer_init(struct cbor_writer *w, uint8_t *buf, size_t len);
+int cbor_writer_len(const struct cbor_writer *w);
+
+void cbor_put_uint(struct cbor_writer *w, uint32_t value);
+void cbor_put_bool(struct cbor_writer *w, bool value);
+void cbor_put_null(struct cbor_writer *w);
+void cbor_put_text(struct cbor_writer *w, const char *text);
+void cbor_put_array(struct cbor_writer *w, uint32_t items);
+void cbor_put_map(struct cbor_writer *w, uint32_t pairs);
+
+// Decoder, reading in place from a request payload. Each call returns
+// 0 and moves past the item, or returns -EINVAL (wrong type, or
+// malformed or truncated input) and leaves the reader where it was.
+// Indefinite-length items aren't supported.
+struct cbor_reader {
+  const uint8_t *p;
+  const uint8_t *end;
+};
+
+void cbor_reader_init(struct cbor_reader *r, const uint8_t *buf, size_t len);
+bool cbor_at_end(const struct cbor_reader *r);
+
+int cbor_peek_type(const struct cbor_reader *r);
+bool cbor_peek_null(const struct cbor_reader *r);
+int cbor_get_uint(struct cbor_reader *r, uint32_t *value);
+int cbor_get_bool(struct cbor_reader *r, bool *value);
+int cbor_get_null(struct cbor_reader *r);
+int cbor_get_text(struct cbor_reader *r, const uint8_t **text, size_t *len);
+int cbor_get_array(struct cbor_reader *r, uint32_t *items);
+int cbor_get_map(struct cbor_reader *r, uint32_t *pairs);
+bool cbor_match_text(struct cbor_reader *r, const char *text);
+int cbor_skip(struct cbor_reader *r);
+
+#endif
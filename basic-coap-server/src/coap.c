@@ -5,53 +5,224 @@ LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
 
 #include <zephyr.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <random/rand32.h>
 
 #include <net/coap.h>
-#include <net/coap_link_format.h>
 #include <net/net_ip.h>
 #include <net/socket.h>
-#include <net/udp.h>
 
+#include "buffers.h"
+#include "capture.h"
 #include "coap.h"
+#include "dedup.h"
+#include "endpoints.h"
+#include "multicast.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "router.h"
+#include "stats.h"
+#include "timers.h"
+#include "transport.h"
 #include "utils.h"
+#include "wellknown.h"
 
 
-// CoAP resource definitions: defined in endpoints.c.
-extern struct coap_resource coap_resources[];
-
 // Defined in main.c.
 extern void quit(void);
 
 
-// This is the IANA assigned port for CoAP.
-#define COAP_PORT 5683
-
-// This is the link local (FF02) version of the "All CoAP Nodes"
-// address FF0X::FD, from the "IPv6 Multicast Address Space Registry",
-// in the "Variable Scope Multicast Addresses" space (RFC 3307).
-#define ALL_NODES_LOCAL_COAP_MCAST {{{0xff,0x02,0,0,0,0,0,0,0,0,0,0,0,0,0,0xfd}}}
+// Received requests live in a fixed-size pool, and pointers to them
+// are passed from the transport to the workers through a message
+// queue. The queue is as long as the pool, so putting a request on it
+// never blocks.
+K_MEM_SLAB_DEFINE(request_slab, sizeof(struct coap_request_msg),
+                  CONFIG_BASIC_COAP_REQUEST_QUEUE, 4);
+K_MSGQ_DEFINE(request_queue, sizeof(struct coap_request_msg *),
+              CONFIG_BASIC_COAP_REQUEST_QUEUE, 4);
+
+// State for the request a worker thread is currently handling. The
+// CoAP API's endpoint handler signature has no room for anything like
+// this, so it's reached through the thread's custom data pointer.
+struct coap_exchange {
+  struct dedup_entry *dedup;  // Deduplication table entry, if any.
+  bool replied;               // Has a response been sent yet?
+  bool multicast;             // Was the request sent to a group?
+  uint8_t no_response;        // Response classes not to send.
+  int resource;               // Index in coap_resources, for statistics.
+  uint8_t method;             // Request code, for statistics.
+  uint32_t received;          // Cycle count when the request arrived.
+};
+
+// The No-Response option (RFC 7967), which Zephyr's CoAP API doesn't
+// define. Its value is a bitmask of response classes the client isn't
+// interested in.
+#define COAP_OPTION_NO_RESPONSE 258
+#define NO_RESPONSE_2XX BIT(1)
+#define NO_RESPONSE_4XX BIT(3)
+#define NO_RESPONSE_5XX BIT(4)
+
+static inline uint8_t no_response_bit(uint8_t code) {
+  uint8_t code_class = code >> 5;
+  return code_class == 2 ? NO_RESPONSE_2XX :
+         code_class == 4 ? NO_RESPONSE_4XX :
+         code_class == 5 ? NO_RESPONSE_5XX : 0;
+}
 
-// CoAP socket file descriptor.
-static int sock = -1;
+// Responses to multicast requests are sent after a random "leisure"
+// delay (RFC 7252, Section 8.2), so that all the nodes in a group
+// don't answer at once. Delayed responses are copied here to wait,
+// as are 5.03s for shed requests, which are sent from the event loop
+// rather than the thread that received the request.
+struct delayed_reply {
+  struct coap_timer timer;
+  struct sockaddr addr;
+  socklen_t addr_len;
+  uint16_t len;
+  uint8_t data[MAX_COAP_MSG_LEN];
+};
+
+K_MEM_SLAB_DEFINE(delayed_reply_slab, sizeof(struct delayed_reply),
+                  CONFIG_BASIC_COAP_MCAST_DELAYED_REPLIES, 4);
+
+// Confirmable messages we send (RFC 7252, Section 4.2) are kept here
+// until they're acknowledged, reset or given up on. Each one is
+// retransmitted by its own protocol timer, with the timeout doubling
+// every time, so they're all run by the event loop rather than needing
+// a thread or work item each. At most NSTART are outstanding to any
+// one peer: later ones wait in the table, in order, until an earlier
+// one finishes.
+enum con_state { CON_FREE, CON_WAITING, CON_SENT };
+
+struct con_exchange {
+  struct coap_timer timer;
+  enum con_state state;
+  uint8_t retransmits;
+  uint16_t id;
+  uint32_t timeout;        // Current retransmission timeout, in ms.
+  uint32_t seq;            // Sending order, for messages waiting.
+  coap_con_callback_t callback;
+  void *user_data;
+  struct sockaddr addr;
+  socklen_t addr_len;
+  uint16_t len;
+  uint8_t data[CONFIG_BASIC_COAP_CON_MSG_LEN];
+};
+
+static struct con_exchange con_exchanges[CONFIG_BASIC_COAP_CON_EXCHANGES];
+static uint32_t con_seq;
+
+// Protects the exchange table. This is a mutex rather than a spinlock
+// because retransmissions are sent with it held.
+K_MUTEX_DEFINE(con_lock);
+
+// There's always a timer for every exchange, so starting one can't
+// fail. (The brightness resource has a timer too, for its deferred
+// fade responses, and there's one for retrying after a reconnection.)
+BUILD_ASSERT(CONFIG_BASIC_COAP_TIMERS >=
+             CONFIG_BASIC_COAP_CON_EXCHANGES +
+             CONFIG_BASIC_COAP_MCAST_DELAYED_REPLIES +
+             IS_ENABLED(CONFIG_BASIC_COAP_BRIGHTNESS) + 1,
+             "Need a CoAP timer for every confirmable message and "
+             "delayed reply, plus the fade and reconnection timers: "
+             "see BASIC_COAP_TIMERS");
+
+// Every thread that can build replies needs two reply buffers: one for
+// the reply and one for any observe notifications it triggers.
+BUILD_ASSERT(CONFIG_BASIC_COAP_REPLY_BUFFERS >=
+             2 * MAX(CONFIG_BASIC_COAP_WORKERS, 1),
+             "Need two reply buffers per CoAP worker thread");
+
+
+// The receive thread runs an event loop, polling the transport's
+// sockets along with one end of a socket pair that other threads write
+// to to wake it up, with a timeout from the protocol timers (see
+// timers.c). Slot 0 is the wakeup socket.
+struct socket_handler {
+  coap_socket_handler_t handler;
+  void *user_data;
+};
+
+static struct pollfd pollfds[CONFIG_NET_SOCKETS_POLL_MAX];
+static struct socket_handler handlers[CONFIG_NET_SOCKETS_POLL_MAX];
+static int npollfds;
+static int wakeup_fds[2] = { -1, -1 };
+
+// Set to stop the event loop.
+static atomic_t stopping;
+
+// Set while the transport is waiting for a request buffer to be freed.
+static atomic_t paused;
+
+// The server follows the network connection: while the network is
+// down, the event loop parks it, closing the transport's sockets and
+// leaving the multicast groups, but keeping its buffers and tables.
+// When the network comes back, the loop brings the transport back up.
+// network_down is set from main.c's network event handler, and parked
+// is only touched by the receive thread.
+static atomic_t network_down;
+static bool parked;
+
+// If bringing the transport back up fails, the loop tries again this
+// often until it works.
+#define UNPARK_RETRY_MS 1000
+static struct coap_timer unpark_timer;
+
+// When the network last connected (uptime in ms, modulo 2^32), and
+// whether a request has been served since, for the time-to-first-
+// request statistic.
+static atomic_t connected_at;
+static atomic_t awaiting_first;
 
 
 static void process_coap(void);
-static int process_client_request(void);
-static void process_coap_request(uint8_t *data, uint16_t data_len,
-                                 struct sockaddr *addr, socklen_t addr_len);
-// static bool join_coap_multicast_group(void);
+static void handle_request_msg(struct coap_request_msg *msg);
+static int send_coap_data(const uint8_t *data, uint16_t len,
+                          const struct sockaddr *addr, socklen_t addr_len);
+static void process_coap_request(struct coap_request_msg *msg);
+static bool admit_request(struct coap_request_msg *msg);
+static bool same_peer(const struct sockaddr *a, const struct sockaddr *b);
+static void start_con(struct con_exchange *x);
+static void con_expired(struct coap_timer *timer);
+static bool handle_con_answer(const struct sockaddr *addr, uint16_t id,
+                              bool reset);
+static void cancel_con_exchanges(void);
+static void note_request_served(void);
+static int send_delayed_reply(const uint8_t *data, uint16_t len,
+                              const struct sockaddr *addr,
+                              socklen_t addr_len);
+static int queue_reply(const uint8_t *data, uint16_t len,
+                       const struct sockaddr *addr, socklen_t addr_len,
+                       uint32_t delay_ms);
 
 
 // ----------------------------------------------------------------------
 // CoAP SERVER THREAD DEFINITIONS
 
+// The receive thread only needs a big stack if it's also handling
+// requests itself.
+#if CONFIG_BASIC_COAP_WORKERS > 0
+#define STACK_SIZE 2048
+#else
 #define STACK_SIZE 8192
+#endif
 #define THREAD_PRIORITY K_PRIO_PREEMPT(8)
 
 K_THREAD_DEFINE(coap_thread_id, STACK_SIZE,
                 process_coap, NULL, NULL, NULL,
                 THREAD_PRIORITY, 0, -1);
 
+// Worker threads are created at startup, since their number is
+// configurable. They all run at the same priority as the receive
+// thread, so on SMP targets they spread across CPUs.
+#if CONFIG_BASIC_COAP_WORKERS > 0
+K_THREAD_STACK_ARRAY_DEFINE(worker_stacks, CONFIG_BASIC_COAP_WORKERS,
+                            CONFIG_BASIC_COAP_WORKER_STACK_SIZE);
+static struct k_thread worker_threads[CONFIG_BASIC_COAP_WORKERS];
+
+static void coap_worker(void *p1, void *p2, void *p3);
+#endif
+
 
 // ----------------------------------------------------------------------
 // PUBLIC API
@@ -61,53 +232,308 @@ K_THREAD_DEFINE(coap_thread_id, STACK_SIZE,
 
 int send_coap_reply(struct coap_packet *cpkt,
                     const struct sockaddr *addr, socklen_t addr_len) {
-  // Debug message (defined in utils.h).
-  hexdump("Response", cpkt->data, cpkt->offset);
+  struct coap_exchange *exchange = k_thread_custom_data_get();
+
+  // Drop responses the client doesn't want. They still count as the
+  // reply, but there's nothing to replay for a retransmission, which
+  // is just dropped.
+  uint8_t suppress = no_response_bit(coap_header_get_code(cpkt));
+  if (exchange && (exchange->no_response & suppress)) {
+    LOG_DBG("Response suppressed");
+    if (!exchange->replied) {
+      dedup_silent(exchange->dedup);
+      stats_response(exchange->resource, exchange->method,
+                     coap_header_get_code(cpkt), 0, exchange->received);
+    }
+    exchange->replied = true;
+    return 0;
+  }
 
-  // Use the basic socket API to send the reply data over the server
-  // socket.
-  int r = sendto(sock, cpkt->data, cpkt->offset, 0, addr, addr_len);
-  if (r < 0) {
-    LOG_ERR("Failed to send %d", errno);
-    r = -errno;
+  int r;
+  if (exchange && exchange->multicast) {
+    r = send_delayed_reply(cpkt->data, cpkt->offset, addr, addr_len);
+  } else {
+    r = send_coap_data(cpkt->data, cpkt->offset, addr, addr_len);
+  }
+
+  // Save the response to the request being handled, so that we can
+  // send it again if the request is retransmitted.
+  if (exchange && !exchange->replied && r >= 0) {
+    dedup_store(exchange->dedup, cpkt->data, cpkt->offset);
+    stats_response(exchange->resource, exchange->method,
+                   coap_header_get_code(cpkt), cpkt->offset,
+                   exchange->received);
+    exchange->replied = true;
+    note_request_served();
   }
 
   return r;
 }
 
 
-// Send a CoAP reply for the ".well-known/core" resource introspection
-// endpoint.
+// Send a CoAP message that isn't the reply to the request currently
+// being handled, e.g. an observe notification.
+
+int send_coap_message(struct coap_packet *cpkt,
+                      const struct sockaddr *addr, socklen_t addr_len) {
+  return send_coap_data(cpkt->data, cpkt->offset, addr, addr_len);
+}
+
+
+// Answer the request being handled with a separate response, for
+// handlers whose work takes too long to reply straight away (RFC 7252,
+// Section 5.2.2). For a confirmable request, this sends an empty ACK
+// right away, so that the client stops retransmitting. The handler
+// then returns, and some time later builds the real response with
+// coap_deferred_init and sends it with send_coap_deferred, from any
+// thread. The deferred struct holds everything needed for that, and
+// must live until then. Returns -ENOTSUP for multicast requests,
+// which should just be answered directly (their response is delayed
+// anyway), and -EALREADY if a response has been sent already.
+
+int coap_defer_response(struct coap_deferred *deferred,
+                        struct coap_packet *req,
+                        const struct sockaddr *addr, socklen_t addr_len) {
+  struct coap_exchange *exchange = k_thread_custom_data_get();
+  if (!exchange) return -EINVAL;
+  if (exchange->multicast) return -ENOTSUP;
+  if (exchange->replied) return -EALREADY;
+
+  memcpy(&deferred->addr, addr, addr_len);
+  deferred->addr_len = addr_len;
+  deferred->tkl = coap_header_get_token(req, deferred->token);
+  deferred->con = coap_header_get_type(req) == COAP_TYPE_CON;
+  deferred->no_response = exchange->no_response;
+  deferred->resource = exchange->resource;
+  deferred->method = exchange->method;
+  deferred->received = exchange->received;
+
+  // The empty ACK is what a retransmission of the request gets. There's
+  // nothing to replay for a non-confirmable request, which is just
+  // dropped if it's repeated.
+  exchange->replied = true;
+  if (!deferred->con) {
+    dedup_silent(exchange->dedup);
+    return 0;
+  }
+
+  uint16_t id = coap_header_get_id(req);
+  uint8_t ack[4] = {
+    (1 << 6) | (COAP_TYPE_ACK << 4), COAP_CODE_EMPTY, id >> 8, id & 0xff
+  };
+  dedup_store(exchange->dedup, ack, sizeof(ack));
+  int r = send_coap_data(ack, sizeof(ack), addr, addr_len);
+  return r < 0 ? r : 0;
+}
 
-int well_known_core_get(struct coap_resource *res,
-                        struct coap_packet *req, struct sockaddr *addr,
-                        socklen_t addr_len) {
-  // This is for the "well known" CoAP resources, which are basically
-  // an introspection method for learning about what "real" resources
-  // are supported. The Zephyr CoAP API deals with processing these.
 
-  // Allocate reply buffer.
-  uint8_t *data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
-  if (!data) return -ENOMEM;
+// Start building a deferred response: the header and token. The
+// response is confirmable if the request was (RFC 7252, Section
+// 5.2.2), so it needs to fit in CONFIG_BASIC_COAP_CON_MSG_LEN.
+
+int coap_deferred_init(struct coap_deferred *deferred,
+                       struct coap_packet *resp, uint8_t *data,
+                       uint16_t max_len, uint8_t code) {
+  return coap_packet_init(resp, data, max_len, 1,
+                          deferred->con ? COAP_TYPE_CON : COAP_TYPE_NON_CON,
+                          deferred->tkl, deferred->token, code,
+                          coap_next_id());
+}
+
+
+// Send a deferred response. A confirmable one is retransmitted until
+// the client acknowledges it.
+
+int send_coap_deferred(struct coap_deferred *deferred,
+                       struct coap_packet *resp) {
+  uint8_t code = coap_header_get_code(resp);
+  int r = 0;
+  if (deferred->no_response & no_response_bit(code)) {
+    LOG_DBG("Response suppressed");
+  } else if (deferred->con) {
+    r = send_coap_con(resp, &deferred->addr, deferred->addr_len, NULL, NULL);
+  } else {
+    r = send_coap_message(resp, &deferred->addr, deferred->addr_len);
+  }
+
+  if (r >= 0) {
+    stats_response(deferred->resource, deferred->method, code,
+                   r > 0 ? resp->offset : 0, deferred->received);
+  }
+  return r;
+}
+
+
+// Send a confirmable message that isn't a piggybacked reply, e.g. a
+// confirmable observe notification, and retransmit it until it's
+// acknowledged. The packet must have type CON and a new message ID
+// from coap_next_id(). The callback (if not NULL) is told how it went,
+// unless this returns an error: -EMSGSIZE if the message is too big
+// to keep for retransmission, or -ENOMEM if too many confirmable
+// messages are pending already. A message that has to wait for
+// earlier ones to the same peer (NSTART) is sent later.
+
+int send_coap_con(struct coap_packet *cpkt,
+                  const struct sockaddr *addr, socklen_t addr_len,
+                  coap_con_callback_t callback, void *user_data) {
+  if (cpkt->offset > CONFIG_BASIC_COAP_CON_MSG_LEN) {
+    LOG_WRN("Confirmable message too big (%u bytes)", cpkt->offset);
+    return -EMSGSIZE;
+  }
+
+  k_mutex_lock(&con_lock, K_FOREVER);
+
+  struct con_exchange *x = NULL;
+  int outstanding = 0;
+  for (int i = 0; i < ARRAY_SIZE(con_exchanges); ++i) {
+    struct con_exchange *e = &con_exchanges[i];
+    if (e->state == CON_FREE) {
+      if (!x) x = e;
+    } else if (same_peer(&e->addr, addr)) {
+      ++outstanding;
+    }
+  }
+  if (!x) {
+    k_mutex_unlock(&con_lock);
+    LOG_WRN("Too many confirmable messages pending");
+    stats_enomem();
+    return -ENOMEM;
+  }
+
+  coap_timer_init(&x->timer, con_expired);
+  x->state = CON_WAITING;
+  x->id = coap_header_get_id(cpkt);
+  x->seq = con_seq++;
+  x->callback = callback;
+  x->user_data = user_data;
+  memcpy(&x->addr, addr, addr_len);
+  x->addr_len = addr_len;
+  x->len = cpkt->offset;
+  memcpy(x->data, cpkt->data, cpkt->offset);
+
+  // Failing to send the first transmission isn't fatal: it's retried
+  // like any other.
+  if (outstanding < CONFIG_BASIC_COAP_NSTART) start_con(x);
+
+  k_mutex_unlock(&con_lock);
+  return cpkt->offset;
+}
+
+
+// Report the exchange table's usage, for the memory usage report.
+
+void coap_con_usage(uint16_t *total, uint16_t *used, size_t *entry_size) {
+  k_mutex_lock(&con_lock, K_FOREVER);
+  *used = 0;
+  for (int i = 0; i < ARRAY_SIZE(con_exchanges); ++i) {
+    if (con_exchanges[i].state != CON_FREE) ++*used;
+  }
+  k_mutex_unlock(&con_lock);
+  *total = ARRAY_SIZE(con_exchanges);
+  *entry_size = sizeof(struct con_exchange);
+}
 
-  // Full the reply buffer using a CoAP API function.
-  struct coap_packet resp;
-  int r = coap_well_known_core_get(res, req, &resp, data, MAX_COAP_MSG_LEN);
-  if (r < 0) goto end;
 
-  // Send the reply.
-  r = send_coap_reply(&resp, addr, addr_len);
+// Reply to a request from a response cache. Returns -ENOENT if the
+// cache is empty, in which case the caller should build the response
+// the long way and store it with store_cached_coap_reply. Otherwise,
+// all we need to do here is write a new header and token and copy the
+// cached options and payload after them.
+
+int send_cached_coap_reply(struct coap_reply_cache *cache,
+                           struct coap_packet *req,
+                           const struct sockaddr *addr, socklen_t addr_len) {
+  // Quick unlocked check: a stale answer here just means we take the
+  // slow path, or notice the cache is empty under the lock below.
+  if (!cache->valid) return -ENOENT;
+
+  // Piggybacked reply type, as for replies built the long way.
+  uint8_t type = coap_header_get_type(req);
+  type = type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON_CON;
+  uint16_t id = coap_header_get_id(req);
+
+  uint8_t *data = alloc_reply_buffer();
+
+  // Fixed header (RFC 7252, Section 3): version 1, type and token
+  // length, code, message ID. Then the token and the cached body.
+  uint8_t tkl = coap_header_get_token(req, data + 4);
+  data[0] = (1 << 6) | (type << 4) | tkl;
+  data[2] = id >> 8;
+  data[3] = id & 0xff;
+
+  // The cache may be updated by another worker thread, so copy it out
+  // under its lock.
+  k_spinlock_key_t key = k_spin_lock(&cache->lock);
+  bool valid = cache->valid;
+  data[1] = cache->code;
+  uint8_t len = cache->len;
+  memcpy(data + 4 + tkl, cache->body, len);
+  k_spin_unlock(&cache->lock, key);
+
+  int r = -ENOENT;
+  if (valid) {
+    struct coap_packet resp = {
+      .data = data,
+      .offset = 4 + tkl + len,
+      .max_len = MAX_COAP_MSG_LEN,
+    };
+    r = send_coap_reply(&resp, addr, addr_len);
+  }
 
-end:
-  k_free(data);
+  free_reply_buffer(data);
   return r;
 }
 
 
+// Save everything after the header and token of a response built with
+// the CoAP API, for use by send_cached_coap_reply. Responses that are
+// too big to cache are just not cached.
+
+void store_cached_coap_reply(struct coap_reply_cache *cache,
+                             const struct coap_packet *resp) {
+  uint8_t start = 4 + (resp->data[0] & 0x0f);
+  if (resp->offset - start > COAP_REPLY_CACHE_LEN) return;
+
+  k_spinlock_key_t key = k_spin_lock(&cache->lock);
+  cache->code = resp->data[1];
+  cache->len = resp->offset - start;
+  memcpy(cache->body, resp->data + start, cache->len);
+  cache->valid = true;
+  k_spin_unlock(&cache->lock, key);
+}
+
+
+// Throw away a cached response, e.g. when the resource state changes.
+
+void invalidate_cached_coap_reply(struct coap_reply_cache *cache) {
+  k_spinlock_key_t key = k_spin_lock(&cache->lock);
+  cache->valid = false;
+  k_spin_unlock(&cache->lock, key);
+}
+
+
 // Public interface to start the CoAP server.
 
 void start_coap(void)
 {
+  // Render the resource discovery document.
+  init_well_known_core();
+
+  atomic_set(&stopping, false);
+  atomic_set(&paused, false);
+
+#if CONFIG_BASIC_COAP_WORKERS > 0
+  for (int i = 0; i < CONFIG_BASIC_COAP_WORKERS; ++i) {
+    static char names[CONFIG_BASIC_COAP_WORKERS][12];
+    k_tid_t tid = k_thread_create(&worker_threads[i], worker_stacks[i],
+                                  K_THREAD_STACK_SIZEOF(worker_stacks[i]),
+                                  coap_worker, NULL, NULL, NULL,
+                                  THREAD_PRIORITY, 0, K_NO_WAIT);
+    snprintk(names[i], sizeof(names[i]), "coap_w%d", i);
+    k_thread_name_set(tid, names[i]);
+  }
+#endif
+
   k_thread_name_set(coap_thread_id, "coap");
   k_thread_start(coap_thread_id);
 }
@@ -117,42 +543,287 @@ void start_coap(void)
 
 void stop_coap(void)
 {
-  // Not a very graceful way to close a thread, but we may be blocked
-  // waiting for a network message, so there's probably no better way
-  // to do it.
-  k_thread_abort(coap_thread_id);
-  if (sock >= 0) (void)close(sock);
+  // Stop the event loop, so that no more requests are received.
+  atomic_set(&stopping, true);
+  coap_wakeup();
+  k_thread_join(coap_thread_id, K_FOREVER);
+
+  // Let the workers finish the requests already queued, then tell
+  // them to exit.
+#if CONFIG_BASIC_COAP_WORKERS > 0
+  for (int i = 0; i < CONFIG_BASIC_COAP_WORKERS; ++i) {
+    struct coap_request_msg *msg = NULL;
+    k_msgq_put(&request_queue, &msg, K_FOREVER);
+  }
+  for (int i = 0; i < CONFIG_BASIC_COAP_WORKERS; ++i) {
+    k_thread_join(&worker_threads[i], K_FOREVER);
+  }
+#endif
+
+  // Give up on confirmable messages still waiting for an answer, and
+  // run any other timers still pending right away, here, so that
+  // whatever is waiting on them is cleaned up: delayed multicast
+  // responses are sent early rather than lost. (If the server is
+  // parked, the transport is closed already, and these go nowhere.)
+  cancel_con_exchanges();
+  coap_timers_expire(true);
+
+  transport_close();
+  npollfds = 0;
+  for (int i = 0; i < 2; ++i) {
+    if (wakeup_fds[i] >= 0) (void)close(wakeup_fds[i]);
+    wakeup_fds[i] = -1;
+  }
+  leave_multicast_groups();
+}
+
+
+// Tell the server that the network has connected or disconnected
+// (NET_EVENT_L4_CONNECTED and NET_EVENT_L4_DISCONNECTED). The event
+// loop does the work, so these can be called from the network
+// management thread, and before the server has been started.
+
+void coap_network_up(void) {
+  atomic_set(&connected_at, k_uptime_get_32());
+  atomic_set(&awaiting_first, true);
+  stats_connected();
+  atomic_set(&network_down, false);
+  coap_wakeup();
+}
+
+void coap_network_down(void) {
+  atomic_set(&network_down, true);
+  coap_wakeup();
+}
+
+
+// Wake up the event loop, e.g. to recalculate its timeout after a
+// timer is started. This can be called from any thread.
+
+void coap_wakeup(void) {
+  // If the socket pair is full, the loop has a wakeup pending anyway.
+  uint8_t b = 0;
+  if (wakeup_fds[1] >= 0) (void)send(wakeup_fds[1], &b, 1, 0);
+}
+
+
+// ----------------------------------------------------------------------
+// TRANSPORT INTERFACE
+
+// Add a socket to the event loop. The handler is called on the receive
+// thread whenever the socket is readable.
+
+int coap_add_socket(int fd, coap_socket_handler_t handler, void *user_data) {
+  if (npollfds == ARRAY_SIZE(pollfds)) {
+    LOG_ERR("Too many CoAP sockets");
+    return -ENOMEM;
+  }
+  pollfds[npollfds] = (struct pollfd){ .fd = fd, .events = POLLIN };
+  handlers[npollfds] = (struct socket_handler){ handler, user_data };
+  ++npollfds;
+  return 0;
+}
+
+
+// Get a buffer for a received request. The socket transport receives
+// straight into this, while the net_context transport just uses it to
+// hold the client address and a reference to the received packet.
+
+struct coap_request_msg *alloc_request_msg(k_timeout_t timeout) {
+  struct coap_request_msg *msg;
+  if (k_mem_slab_alloc(&request_slab, (void **)&msg, timeout) < 0) {
+    stats_enomem();
+    return NULL;
+  }
+  msg->addr_len = sizeof(msg->addr);
+  msg->data = msg->buf;
+  msg->len = 0;
+  msg->transport = NULL;
+  msg->multicast = false;
+  return msg;
+}
+
+
+// Release a request buffer, along with anything the transport attached
+// to it.
+
+void free_request_msg(struct coap_request_msg *msg) {
+  transport_release(msg);
+  k_mem_slab_free(&request_slab, (void **)&msg);
+
+  // Let the event loop go back to reading requests.
+  if (atomic_cas(&paused, true, false)) coap_wakeup();
+}
+
+
+// Called by the transport for each message received: hand it off to a
+// worker thread (or handle it directly if there are no workers), unless
+// it's turned away by rate limiting or load shedding.
+
+void coap_request_received(struct coap_request_msg *msg) {
+  msg->received = k_cycle_get_32();
+  stats_rx(msg->len);
+  capture_packet(CAPTURE_RX, &msg->addr, msg->data, msg->len);
+  hexdump("RECEIVED", msg->data, msg->len);
+
+  if (!admit_request(msg)) {
+    free_request_msg(msg);
+    return;
+  }
+
+#if CONFIG_BASIC_COAP_WORKERS > 0
+  // This may be the network RX thread, which mustn't block.
+  if (k_msgq_put(&request_queue, &msg, K_NO_WAIT) < 0) {
+    LOG_WRN("Request queue full: dropping message");
+    stats_enomem();
+    free_request_msg(msg);
+  }
+#else
+  handle_request_msg(msg);
+#endif
 }
 
 
 // ----------------------------------------------------------------------
 // PRIVATE FUNCTIONS
 
-// Initialise the CoAP server. The Zephyr CoAP API doesn't have
-// anything to do with sockets, so you set up the low-level server
-// sockets yourself. It's just a simple UDP "socket + bind" thing
-// anyway.
-
-static int start_coap_server(void) {
-  // Create a listener socket address on the well-known CoAP port.
-  struct sockaddr_in6 addr6;
-  memset(&addr6, 0, sizeof(addr6));
-  addr6.sin6_family = AF_INET6;
-  addr6.sin6_port = htons(COAP_PORT);
-
-  // Create a UDPv6 ("datagram") socket.
-  sock = socket(addr6.sin6_family, SOCK_DGRAM, IPPROTO_UDP);
-  if (sock < 0) {
-    LOG_ERR("Failed to create UDP socket %d", errno);
+// Create the socket pair used to wake up the event loop. Both ends
+// are non-blocking: the loop drains its end without waiting, and a
+// full pair means a wakeup is pending already.
+
+static int open_wakeup(void) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, wakeup_fds) < 0) {
+    LOG_ERR("Failed to create wakeup socket pair %d", errno);
     return -errno;
   }
+  for (int i = 0; i < 2; ++i) {
+    (void)fcntl(wakeup_fds[i], F_SETFL, O_NONBLOCK);
+  }
+  npollfds = 0;
+  return coap_add_socket(wakeup_fds[0], NULL, NULL);
+}
+
+
+// Park the server when the network goes down. Requests already queued
+// are still handled, but their responses go nowhere. Confirmable
+// messages waiting for an answer are given up on, rather than being
+// retransmitted into the void.
+
+static void park(void) {
+  LOG_INF("Network down: parking CoAP server");
+  transport_close();
+  npollfds = 1;  // Just the wakeup socket.
+  leave_multicast_groups();
+  cancel_con_exchanges();
+  parked = true;
+}
+
+
+// Bring the server back up when the network returns. The multicast
+// groups are joined again, since the Thread interface's subscriptions
+// may not have survived a re-attach, and the transport is opened
+// again. Anything left over from before is stale by now: requests the
+// deduplication table remembers, and any confirmable messages sent
+// while parked.
 
-  // Bind the socket to our address: this means that this socket will
-  // receive any messages sent to this device's CoAP port.
-  int r = bind(sock, (struct sockaddr *)&addr6, sizeof(addr6));
+static int unpark(void) {
+  if (join_multicast_groups() < 0) {
+    LOG_WRN("Multicast requests will not be received");
+  }
+  int r = transport_open();
   if (r < 0) {
-    LOG_ERR("Failed to bind UDP socket %d", errno);
-    return -errno;
+    transport_close();
+    npollfds = 1;
+    leave_multicast_groups();
+    return r;
+  }
+
+  cancel_con_exchanges();
+  dedup_flush();
+  parked = false;
+  LOG_INF("Network up: CoAP server running");
+  return 0;
+}
+
+
+// Nothing to do when the retry timer expires: the event loop tries to
+// unpark again as soon as it's run the timers.
+
+static void unpark_retry(struct coap_timer *timer) { }
+
+
+// Record how long it took to serve the first request after the
+// network connected.
+
+static void note_request_served(void) {
+  if (atomic_cas(&awaiting_first, true, false)) {
+    uint32_t since = (uint32_t)atomic_get(&connected_at);
+    stats_first_request(k_uptime_get_32() - since);
+  }
+}
+
+
+// The event loop: wait for a socket to become readable or for the
+// earliest timer to expire, and deal with whichever happened, parking
+// and unparking the server as the network goes and comes back. Returns
+// 0 when stopped by stop_coap, and a negative error code if a socket
+// fails.
+
+static int run_event_loop(void) {
+  while (!atomic_get(&stopping)) {
+    bool down = atomic_get(&network_down);
+    if (down && !parked) {
+      park();
+    } else if (!down && parked && !coap_timer_running(&unpark_timer)) {
+      if (unpark() < 0) {
+        LOG_ERR("Failed to open CoAP transport: retrying");
+        (void)coap_timer_start(&unpark_timer, UNPARK_RETRY_MS);
+      }
+    }
+
+    // With no request buffers free, leave incoming requests queued in
+    // the network stack until a worker frees one.
+    short events = atomic_get(&paused) ? 0 : POLLIN;
+    for (int i = 1; i < npollfds; ++i) pollfds[i].events = events;
+
+    if (poll(pollfds, npollfds, coap_timers_next_timeout()) < 0) {
+      if (errno == EINTR) continue;
+      LOG_ERR("Poll error %d", errno);
+      return -errno;
+    }
+
+    coap_timers_expire(false);
+
+    if (pollfds[0].revents & POLLIN) {
+      uint8_t buf[8];
+      while (recv(wakeup_fds[0], buf, sizeof(buf), 0) > 0) ;
+    }
+
+    for (int i = 1; i < npollfds; ++i) {
+      // Socket errors are to be expected if the network has just gone
+      // down: go round again to park the server instead.
+      if (pollfds[i].revents & (POLLERR | POLLNVAL)) {
+        if (atomic_get(&network_down)) break;
+        LOG_ERR("Socket error on CoAP socket %d", i);
+        return -EIO;
+      }
+      if (!(pollfds[i].revents & POLLIN)) continue;
+
+      int r = handlers[i].handler(pollfds[i].fd, handlers[i].user_data);
+      if (r == -EAGAIN) {
+        // Out of request buffers. Check again after setting the flag,
+        // in case a buffer was freed in between.
+        atomic_set(&paused, true);
+        if (k_mem_slab_num_free_get(&request_slab) > 0) {
+          atomic_set(&paused, false);
+        }
+        break;
+      }
+      if (r < 0) {
+        if (atomic_get(&network_down)) break;
+        return r;
+      }
+    }
   }
 
   return 0;
@@ -160,103 +831,395 @@ static int start_coap_server(void) {
 
 
 // Main server thread function: initialises CoAP server then processes
-// requests as they come in. Quits on error.
+// requests and timers as they come in until stopped. Quits on error.
 
 static void process_coap(void) {
-  // ==> NOTE: I'VE NOT BEEN ABLE TO GET THIS MULTICAST GROUP STUFF
-  // WORKING YET.
-  // if (!join_coap_multicast_group()) goto quit;
-
-  // Initialise the CoAP server.
-  if (start_coap_server() < 0) goto quit;
+  // Initialise the CoAP server. It starts off parked: the event loop
+  // joins the CoAP multicast groups and opens the transport straight
+  // away (see unpark), unless the network has gone down again already.
+  if (open_wakeup() < 0) goto quit;
+  parked = true;
+  coap_timer_init(&unpark_timer, unpark_retry);
 
   // Process client messages, quitting if there's an error.
   // ==> NOTE: A REAL APPLICATION WOULD NEED BETTER ERROR HANDLING
   // THAN THIS!
-  while (true) {
-    if (process_client_request() < 0) goto quit;
-  }
+  if (run_event_loop() == 0) return;
 
 quit:
   quit();
 }
 
 
-#if 0
-// Multicast setup. Still need to work out how to make this go.
+#if CONFIG_BASIC_COAP_WORKERS > 0
+// Worker thread function: handle queued requests forever.
 
-static bool join_coap_multicast_group(void) {
-  struct net_if *iface = net_if_get_default();
-  if (!iface) {
-    LOG_ERR("Could not get default interface\n");
-    return false;
+static void coap_worker(void *p1, void *p2, void *p3) {
+  while (true) {
+    struct coap_request_msg *msg;
+    k_msgq_get(&request_queue, &msg, K_FOREVER);
+
+    // A NULL message is the signal to exit from stop_coap.
+    if (!msg) return;
+    handle_request_msg(msg);
   }
+}
+#endif
+
+
+// Handle a single received request and release its buffer.
+
+static void handle_request_msg(struct coap_request_msg *msg) {
+  process_coap_request(msg);
+  free_request_msg(msg);
+}
+
+
+// Send raw CoAP message data to a client.
+
+static int send_coap_data(const uint8_t *data, uint16_t len,
+                          const struct sockaddr *addr, socklen_t addr_len) {
+  // Record the packet, and optionally log it (defined in utils.h).
+  capture_packet(CAPTURE_TX, addr, data, len);
+  hexdump("Response", data, len);
+
+  int r = transport_send(data, len, addr, addr_len);
+  if (r >= 0) stats_tx(len);
+  return r;
+}
+
 
-  static struct sockaddr_in6 mcast_addr =
-    { .sin6_family = AF_INET6,
-      .sin6_addr = ALL_NODES_LOCAL_COAP_MCAST,
-      .sin6_port = htons(COAP_PORT) };
-  if (!net_if_ipv6_maddr_add(iface, &mcast_addr.sin6_addr)) {
-    LOG_ERR("Cannot join IPv6 multicast group");
-   return false;
+// Decide whether to queue a received message, before any more work is
+// spent on it. Requests from a client over its rate limit (see
+// ratelimit.c) are dropped. When the workers have more than
+// BASIC_COAP_SHED_THRESHOLD requests queued already, new requests are
+// answered with 5.03 (Service Unavailable) straight away, with a
+// Max-Age option saying how long to back off for (RFC 7252, Section
+// 5.9.3.4), rather than queued behind the others. ACKs and RSTs are
+// always let through: they answer our own messages, and are cheap.
+//
+// This runs on the thread that received the message, which for the
+// net_context transport is the network RX thread, so it mustn't
+// block: the 5.03 is handed to the event loop to send.
+
+static bool admit_request(struct coap_request_msg *msg) {
+  // Only the fixed header and token are looked at here. Anything
+  // malformed is left for the parser to reject.
+  const uint8_t *data = msg->data;
+  uint8_t tkl = msg->len >= 4 ? data[0] & 0x0f : 0;
+  if (msg->len < 4 + tkl || tkl > 8) return true;
+  uint8_t type = (data[0] >> 4) & 0x03;
+  if (type == COAP_TYPE_ACK || type == COAP_TYPE_RESET) return true;
+
+  if (!ratelimit_allow(&msg->addr)) {
+    LOG_DBG("Client over its rate limit: dropping request");
+    stats_rate_limited();
+    return false;
   }
 
+#if CONFIG_BASIC_COAP_SHED_THRESHOLD > 0
+  uint32_t queued = k_msgq_num_used_get(&request_queue);
+  if (queued < CONFIG_BASIC_COAP_SHED_THRESHOLD) return true;
+
+  // Errors aren't sent in response to multicast requests (see
+  // process_coap_request), so those are just dropped.
+  LOG_DBG("Too many requests queued: shedding one");
+  stats_shed();
+  if (msg->multicast) return false;
+
+  // Header, token and Max-Age option (with an extended delta).
+  uint8_t buf[4 + 8 + 4];
+  struct coap_packet resp;
+  uint16_t id = data[2] << 8 | data[3];
+  int r = coap_packet_init(&resp, buf, sizeof(buf), 1,
+                           type == COAP_TYPE_CON ? COAP_TYPE_ACK :
+                           COAP_TYPE_NON_CON, tkl, data + 4,
+                           COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE, id);
+  if (r >= 0) {
+    r = coap_append_option_int(&resp, COAP_OPTION_MAX_AGE,
+                               CONFIG_BASIC_COAP_SHED_MAX_AGE);
+  }
+  if (r >= 0) {
+    queue_reply(resp.data, resp.offset, &msg->addr, msg->addr_len, 0);
+  }
+  return false;
+#else
   return true;
-}
 #endif
+}
 
 
-// Process a single CoAP request from a client. This function just
-// does the socket-level stuff, then hands off immediately to another
-// function.
+// Send a queued response, from the event loop.
 
-static int process_client_request(void) {
-  struct sockaddr addr;
-  socklen_t addr_len = sizeof(addr);
-  uint8_t req[MAX_COAP_MSG_LEN];
-
-  do {
-    // Receive data from the socket. This also gets the client
-    // address, which we need for sending a reply.
-    int received = recvfrom(sock, req, sizeof(req), 0, &addr, &addr_len);
-    if (received < 0) {
-      LOG_ERR("Connection error %d", errno);
-      return -errno;
-    }
-    hexdump("RECEIVED", req, received);
+static void delayed_reply_expired(struct coap_timer *timer) {
+  struct delayed_reply *d = CONTAINER_OF(timer, struct delayed_reply, timer);
+  send_coap_data(d->data, d->len, &d->addr, d->addr_len);
+  k_mem_slab_free(&delayed_reply_slab, (void **)&d);
+}
 
-    // Hand off to the CoAP-specific processing function.
-    process_coap_request(req, received, &addr, addr_len);
-  } while (true);
 
-  return 0;
+// Queue a response to be sent after a random leisure delay. If too
+// many are waiting already, the response is dropped: the client asked
+// a whole group, so it can't rely on hearing from every member anyway.
+
+static int send_delayed_reply(const uint8_t *data, uint16_t len,
+                              const struct sockaddr *addr,
+                              socklen_t addr_len) {
+  uint32_t delay = sys_rand32_get() % (CONFIG_BASIC_COAP_MCAST_LEISURE_MS + 1);
+  return queue_reply(data, len, addr, addr_len, delay);
+}
+
+
+// Copy a response to be sent by the event loop after the given delay.
+// Never blocks: if there's no room, the response is dropped.
+
+static int queue_reply(const uint8_t *data, uint16_t len,
+                       const struct sockaddr *addr, socklen_t addr_len,
+                       uint32_t delay_ms) {
+  struct delayed_reply *d;
+  if (k_mem_slab_alloc(&delayed_reply_slab, (void **)&d, K_NO_WAIT) < 0) {
+    LOG_WRN("Too many delayed responses: dropping one");
+    stats_enomem();
+    return -ENOMEM;
+  }
+
+  memcpy(&d->addr, addr, addr_len);
+  d->addr_len = addr_len;
+  d->len = len;
+  memcpy(d->data, data, len);
+
+  coap_timer_init(&d->timer, delayed_reply_expired);
+  if (coap_timer_start(&d->timer, delay_ms) < 0) {
+    k_mem_slab_free(&delayed_reply_slab, (void **)&d);
+    stats_enomem();
+    return -ENOMEM;
+  }
+  return len;
 }
 
 
 // Process a single CoAP request for a client. This function does the
 // CoAP-level packet processing.
 
-static void process_coap_request(uint8_t *data, uint16_t data_len,
-                                 struct sockaddr *addr, socklen_t addr_len) {
+static void process_coap_request(struct coap_request_msg *msg) {
+  struct sockaddr *addr = &msg->addr;
+  socklen_t addr_len = msg->addr_len;
+
   // Parse received data as a CoAP packet. This gives us a coap_packet
   // structure containing the broken down request information, as well
   // as the request options pulled out into coap_option values.
   struct coap_packet req;
   struct coap_option options[16] = {0};
   uint8_t opt_num = 16U;
-  int r = coap_packet_parse(&req, data, data_len, options, opt_num);
+  int r = coap_packet_parse(&req, msg->data, msg->len, options, opt_num);
   if (r < 0) {
     LOG_ERR("Invalid data received (%d)\n", r);
+    stats_parse_failure();
+    return;
+  }
+
+  // ACK and RST messages are answers to our own confirmable messages,
+  // not requests. A RST can also reject a non-confirmable observe
+  // notification.
+  uint8_t type = coap_header_get_type(&req);
+  if (type == COAP_TYPE_ACK || type == COAP_TYPE_RESET) {
+    uint16_t id = coap_header_get_id(&req);
+    bool reset = type == COAP_TYPE_RESET;
+    if (!handle_con_answer(addr, id, reset) && reset) {
+      observe_handle_reset(addr, id);
+    }
+    return;
+  }
+
+  // Multicast requests must be non-confirmable (RFC 7252, Section
+  // 8.1): there's no sensible way to acknowledge a confirmable one.
+  if (msg->multicast && type == COAP_TYPE_CON) {
+    LOG_DBG("Dropping confirmable multicast request");
     return;
   }
 
-  // Hand the request off to the CoAP API's resource-based request
-  // router. We pass in the request along with our coap_resources
-  // array, which defines all the CoAP resources we support. The
-  // coap_handle_request API function routes the request to the
-  // appropriate endpoint handler function.
-  r = coap_handle_request(&req, coap_resources, options, opt_num, addr, addr_len);
+  // Check for retransmissions of requests we've already seen. If we
+  // have the response to one of those, we just send it again without
+  // calling the handler: the request buffer is no longer needed, so
+  // the response is copied into that. (The request data may be in a
+  // transport buffer rather than msg->buf, but msg->buf is always
+  // MAX_COAP_MSG_LEN bytes.)
+  struct dedup_entry *entry;
+  r = dedup_begin(addr, coap_header_get_id(&req), msg->buf, &entry);
+  if (r == -EALREADY || r == -EEXIST) {
+    LOG_DBG("Dropping duplicate of request %s",
+            r == -EALREADY ? "in progress" : "with nothing to replay");
+    stats_duplicate();
+    return;
+  }
+  if (r > 0) {
+    LOG_DBG("Replaying response to duplicate request");
+    stats_duplicate();
+    send_coap_data(msg->buf, r, addr, addr_len);
+    return;
+  }
+
+  // The No-Response option says which responses the client doesn't
+  // want. Without one, error responses to multicast requests are
+  // suppressed (RFC 7252, Section 8.2), so that a request for
+  // something only some group members have doesn't get a 4.04 from
+  // all the others.
+  struct coap_exchange exchange = { .dedup = entry,
+                                    .multicast = msg->multicast,
+                                    .method = coap_header_get_code(&req),
+                                    .received = msg->received };
+  r = coap_get_option_int(&req, COAP_OPTION_NO_RESPONSE);
+  if (r >= 0) {
+    exchange.no_response = r;
+  } else if (msg->multicast) {
+    exchange.no_response = NO_RESPONSE_4XX | NO_RESPONSE_5XX;
+  }
+
+  // Hand the request off to our resource-based request router (see
+  // router.c). It looks up the request's Uri-Path in a table generated
+  // from resources.def, which lists all the CoAP resources we support,
+  // and then we call the appropriate endpoint handler function. The
+  // resource is looked up separately from calling the handler so that
+  // requests can be counted against it.
+  struct coap_resource *res = find_coap_resource(options, opt_num);
+  exchange.resource = res ? res - coap_resources : -1;
+  stats_request(exchange.resource, exchange.method);
+
+  k_thread_custom_data_set(&exchange);
+  r = res ? call_coap_handler(res, &req, addr, addr_len) : -ENOENT;
+  k_thread_custom_data_set(NULL);
   if (r < 0) {
     LOG_WRN("No handler for such request (%d)\n", r);
   }
+
+  // If nothing was sent, a retransmission should be handled afresh.
+  if (!exchange.replied) dedup_release(entry);
+}
+
+
+// ----------------------------------------------------------------------
+// CONFIRMABLE MESSAGES
+
+static bool same_peer(const struct sockaddr *a, const struct sockaddr *b) {
+  return net_sin6(a)->sin6_port == net_sin6(b)->sin6_port &&
+    net_ipv6_addr_cmp(&net_sin6(a)->sin6_addr, &net_sin6(b)->sin6_addr);
+}
+
+
+// Send a message for the first time, and start its retransmission
+// timer with a random initial timeout between ACK_TIMEOUT and
+// ACK_TIMEOUT * ACK_RANDOM_FACTOR (RFC 7252, Section 4.2). Call with
+// the lock held.
+
+static void start_con(struct con_exchange *x) {
+  uint32_t spread = CONFIG_BASIC_COAP_ACK_TIMEOUT_MS *
+    (CONFIG_BASIC_COAP_ACK_RANDOM_FACTOR - 100) / 100;
+  x->state = CON_SENT;
+  x->retransmits = 0;
+  x->timeout = CONFIG_BASIC_COAP_ACK_TIMEOUT_MS +
+    sys_rand32_get() % (spread + 1);
+  (void)coap_timer_start(&x->timer, x->timeout);
+  stats_con_sent();
+  send_coap_data(x->data, x->len, &x->addr, x->addr_len);
+}
+
+
+// Send the oldest message waiting for the given peer, if any, now that
+// one of its outstanding messages has finished. Call with the lock
+// held.
+
+static void start_next_con(const struct sockaddr *addr) {
+  struct con_exchange *next = NULL;
+  for (int i = 0; i < ARRAY_SIZE(con_exchanges); ++i) {
+    struct con_exchange *x = &con_exchanges[i];
+    if (x->state == CON_WAITING && same_peer(&x->addr, addr) &&
+        (!next || (int32_t)(x->seq - next->seq) < 0)) {
+      next = x;
+    }
+  }
+  if (next) start_con(next);
+}
+
+
+// Free an exchange and tell its owner how it went. Call with the lock
+// held: this releases it before calling the callback, which may well
+// want locks of its own.
+
+static void finish_con(struct con_exchange *x, enum coap_con_result result) {
+  coap_con_callback_t callback = x->callback;
+  void *user_data = x->user_data;
+  uint16_t id = x->id;
+
+  coap_timer_cancel(&x->timer);
+  bool was_sent = x->state == CON_SENT;
+  x->state = CON_FREE;
+  if (was_sent) start_next_con(&x->addr);
+  k_mutex_unlock(&con_lock);
+
+  if (callback) callback(id, result, user_data);
+}
+
+
+// Retransmission timer, run on the receive thread: retransmit with
+// double the timeout, or give up after MAX_RETRANSMIT retransmissions.
+
+static void con_expired(struct coap_timer *timer) {
+  struct con_exchange *x = CONTAINER_OF(timer, struct con_exchange, timer);
+  k_mutex_lock(&con_lock, K_FOREVER);
+
+  // The exchange may have finished, and even been reused, between the
+  // timer expiring and getting the lock.
+  if (x->state != CON_SENT || coap_timer_running(timer)) {
+    k_mutex_unlock(&con_lock);
+    return;
+  }
+
+  if (x->retransmits == CONFIG_BASIC_COAP_MAX_RETRANSMIT) {
+    LOG_DBG("Confirmable message %u timed out", x->id);
+    stats_con_timeout();
+    finish_con(x, COAP_CON_TIMED_OUT);
+    return;
+  }
+
+  ++x->retransmits;
+  x->timeout *= 2;
+  (void)coap_timer_start(timer, x->timeout);
+  stats_con_retransmit();
+  send_coap_data(x->data, x->len, &x->addr, x->addr_len);
+  k_mutex_unlock(&con_lock);
+}
+
+
+// Match an empty ACK or a RST to the confirmable message it answers.
+// Returns false if it isn't for any of ours.
+
+static bool handle_con_answer(const struct sockaddr *addr, uint16_t id,
+                              bool reset) {
+  k_mutex_lock(&con_lock, K_FOREVER);
+  for (int i = 0; i < ARRAY_SIZE(con_exchanges); ++i) {
+    struct con_exchange *x = &con_exchanges[i];
+    if (x->state == CON_SENT && x->id == id && same_peer(&x->addr, addr)) {
+      finish_con(x, reset ? COAP_CON_RESET : COAP_CON_ACKED);
+      return true;
+    }
+  }
+  k_mutex_unlock(&con_lock);
+  return false;
+}
+
+
+// Drop all pending confirmable messages, when the server stops.
+
+static void cancel_con_exchanges(void) {
+  for (int i = 0; i < ARRAY_SIZE(con_exchanges); ++i) {
+    k_mutex_lock(&con_lock, K_FOREVER);
+    struct con_exchange *x = &con_exchanges[i];
+    if (x->state == CON_FREE) {
+      k_mutex_unlock(&con_lock);
+      continue;
+    }
+    // Don't let finishing this one start another.
+    x->state = CON_WAITING;
+    finish_con(x, COAP_CON_CANCELLED);
+  }
 }
@@ -8,15 +8,80 @@
 // APPLICATION LIMIT HERE?
 #define MAX_COAP_MSG_LEN 256
 
+// Maximum size of the cached part of a response: everything after
+// the header and token, i.e. options, payload marker and payload.
+#define COAP_REPLY_CACHE_LEN 32
+
+// Pre-serialized response for a resource whose representation only
+// changes occasionally. Only the message type, ID and token differ
+// between replies, so those are patched in per request.
+struct coap_reply_cache {
+  struct k_spinlock lock;
+  bool valid;
+  uint8_t code;
+  uint8_t len;
+  uint8_t body[COAP_REPLY_CACHE_LEN];
+};
+
 int send_coap_reply(struct coap_packet *cpkt,
                     const struct sockaddr *addr, socklen_t addr_len);
 
-int well_known_core_get(struct coap_resource *res,
-                        struct coap_packet *req, struct sockaddr *addr,
-                        socklen_t addr_len);
+int send_coap_message(struct coap_packet *cpkt,
+                      const struct sockaddr *addr, socklen_t addr_len);
+
+// Outcome of a confirmable message sent with send_coap_con.
+enum coap_con_result {
+  COAP_CON_ACKED,      // Acknowledged by the peer.
+  COAP_CON_RESET,      // Rejected by the peer with a RST.
+  COAP_CON_TIMED_OUT,  // No answer after MAX_RETRANSMIT retransmissions.
+  COAP_CON_CANCELLED,  // Dropped when the server stopped.
+};
+
+// Called once for each confirmable message, from whichever thread saw
+// the outcome, with no CoAP locks held.
+typedef void (*coap_con_callback_t)(uint16_t id, enum coap_con_result result,
+                                    void *user_data);
+
+// A response to be sent later, separately from the acknowledgement
+// of its request (RFC 7252, Section 5.2.2): see coap_defer_response.
+struct coap_deferred {
+  struct sockaddr addr;
+  socklen_t addr_len;
+  uint8_t token[8];
+  uint8_t tkl;
+  bool con;             // Was the request confirmable?
+  uint8_t no_response;  // Response classes not to send.
+  int resource;         // For statistics.
+  uint8_t method;
+  uint32_t received;
+};
+
+int coap_defer_response(struct coap_deferred *deferred,
+                        struct coap_packet *req,
+                        const struct sockaddr *addr, socklen_t addr_len);
+int coap_deferred_init(struct coap_deferred *deferred,
+                       struct coap_packet *resp, uint8_t *data,
+                       uint16_t max_len, uint8_t code);
+int send_coap_deferred(struct coap_deferred *deferred,
+                       struct coap_packet *resp);
+
+int send_coap_con(struct coap_packet *cpkt,
+                  const struct sockaddr *addr, socklen_t addr_len,
+                  coap_con_callback_t callback, void *user_data);
+void coap_con_usage(uint16_t *total, uint16_t *used, size_t *entry_size);
+
+int send_cached_coap_reply(struct coap_reply_cache *cache,
+                           struct coap_packet *req,
+                           const struct sockaddr *addr, socklen_t addr_len);
+void store_cached_coap_reply(struct coap_reply_cache *cache,
+                             const struct coap_packet *resp);
+void invalidate_cached_coap_reply(struct coap_reply_cache *cache);
 
 void start_coap(void);
 void stop_coap(void);
+void coap_network_up(void);
+void coap_network_down(void);
+void coap_wakeup(void);
 
 
 #endif
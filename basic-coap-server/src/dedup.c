@@ -0,0 +1,210 @@
+// Basic OpenThread CoAP server: message deduplication.
+//
+// If the ACK for a confirmable request is lost, the client sends the
+// same request again with the same message ID. Section 4.5 of RFC
+// 7252 says the server should then send the same response again
+// rather than processing the request a second time. This module keeps
+// a small table of recent (client address, message ID) pairs along
+// with the responses sent for them, so that duplicates can be
+// answered without calling the endpoint handler.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+
+#include <net/net_ip.h>
+
+#include "dedup.h"
+
+
+// From Section 4.8.2 of RFC 7252: the time from first sending a
+// confirmable message to when the sender gives up on it, using the
+// default transmission parameters. We need to remember message IDs
+// for at least this long.
+#define EXCHANGE_LIFETIME_MS (247 * MSEC_PER_SEC)
+
+enum dedup_state {
+  DEDUP_FREE,         // Unused table entry.
+  DEDUP_IN_PROGRESS,  // Request is being handled now.
+  DEDUP_DONE,         // Response sent (and saved if it fitted).
+  DEDUP_SILENT,       // Answered with nothing to replay.
+};
+
+struct dedup_entry {
+  enum dedup_state state;
+  struct in6_addr addr;
+  uint16_t port;
+  uint16_t id;
+  uint32_t first_seen;  // For EXCHANGE_LIFETIME expiry.
+  uint32_t last_used;   // For LRU eviction.
+  uint16_t len;         // Saved response length (0 if not saved).
+  uint8_t response[CONFIG_BASIC_COAP_DEDUP_RESPONSE_LEN];
+};
+
+static struct dedup_entry table[CONFIG_BASIC_COAP_DEDUP_ENTRIES];
+
+// Protects the table: entries are looked up and updated from all the
+// worker threads.
+static struct k_spinlock lock;
+
+
+static bool expired(const struct dedup_entry *entry, uint32_t now) {
+  return now - entry->first_seen >= EXCHANGE_LIFETIME_MS;
+}
+
+
+// Find a slot for a new exchange: a free or expired entry if there is
+// one, otherwise the least recently used finished one. Entries for
+// requests that are still being handled are never evicted. Call with
+// the lock held.
+
+static struct dedup_entry *find_slot(uint32_t now) {
+  struct dedup_entry *lru = NULL;
+  for (int i = 0; i < ARRAY_SIZE(table); ++i) {
+    struct dedup_entry *entry = &table[i];
+    if (entry->state == DEDUP_FREE) return entry;
+    if (entry->state == DEDUP_IN_PROGRESS) continue;
+    if (expired(entry, now)) return entry;
+    if (!lru || now - entry->last_used > now - lru->last_used) lru = entry;
+  }
+  return lru;
+}
+
+
+// ----------------------------------------------------------------------
+// PUBLIC API
+
+// Check an incoming request against the table. There are three
+// possible results:
+//
+//  - A positive return value means this is a duplicate of a request
+//    we've already answered: the saved response has been copied into
+//    buf (which must have room for BASIC_COAP_DEDUP_RESPONSE_LEN
+//    bytes), and the return value is its length. Send it again.
+//
+//  - -EALREADY means that this is a duplicate of a request that's
+//    still being handled. Drop it: the client will retransmit again
+//    if it doesn't see a response.
+//
+//  - -EEXIST means that this is a duplicate of a request that was
+//    answered with nothing to send again (see dedup_silent). Drop it.
+//
+//  - Zero means this is a new request. Handle it as normal, then call
+//    dedup_store with the response sent, dedup_silent if it was
+//    answered without one, or dedup_release if it wasn't answered at
+//    all. If the table is full of requests being handled, *entry is
+//    set to NULL and the request just isn't tracked.
+
+int dedup_begin(const struct sockaddr *addr, uint16_t id,
+                uint8_t *buf, struct dedup_entry **entry) {
+  const struct sockaddr_in6 *addr6 = net_sin6(addr);
+  uint32_t now = k_uptime_get_32();
+  int r = 0;
+
+  k_spinlock_key_t key = k_spin_lock(&lock);
+
+  for (int i = 0; i < ARRAY_SIZE(table); ++i) {
+    struct dedup_entry *e = &table[i];
+    if (e->state == DEDUP_FREE || e->id != id || e->port != addr6->sin6_port ||
+        !net_ipv6_addr_cmp(&e->addr, &addr6->sin6_addr) || expired(e, now)) {
+      continue;
+    }
+
+    // Duplicate. If we saved the response, replay it. If it was too
+    // big to save, forget the old exchange and handle the request
+    // again.
+    e->last_used = now;
+    if (e->state == DEDUP_IN_PROGRESS) {
+      r = -EALREADY;
+      goto end;
+    }
+    if (e->state == DEDUP_SILENT) {
+      r = -EEXIST;
+      goto end;
+    }
+    if (e->len > 0) {
+      memcpy(buf, e->response, e->len);
+      r = e->len;
+      goto end;
+    }
+    e->state = DEDUP_FREE;
+    break;
+  }
+
+  // New request: remember it.
+  struct dedup_entry *e = find_slot(now);
+  if (e) {
+    e->state = DEDUP_IN_PROGRESS;
+    e->addr = addr6->sin6_addr;
+    e->port = addr6->sin6_port;
+    e->id = id;
+    e->first_seen = now;
+    e->last_used = now;
+    e->len = 0;
+  }
+  *entry = e;
+
+end:
+  k_spin_unlock(&lock, key);
+  return r;
+}
+
+
+// Record the response sent for a request, for replay if the request
+// is retransmitted.
+
+void dedup_store(struct dedup_entry *entry,
+                 const uint8_t *data, uint16_t len) {
+  if (!entry) return;
+
+  k_spinlock_key_t key = k_spin_lock(&lock);
+  if (len <= sizeof(entry->response)) {
+    memcpy(entry->response, data, len);
+    entry->len = len;
+  }
+  entry->state = DEDUP_DONE;
+  k_spin_unlock(&lock, key);
+}
+
+
+// Record that a request has been dealt with, but that there's nothing
+// to send if it's repeated: e.g. a non-confirmable request whose
+// response is deferred. Duplicates are just dropped.
+
+void dedup_silent(struct dedup_entry *entry) {
+  if (!entry) return;
+
+  k_spinlock_key_t key = k_spin_lock(&lock);
+  entry->state = DEDUP_SILENT;
+  k_spin_unlock(&lock, key);
+}
+
+
+// Forget about a request that didn't produce a response, so that a
+// retransmission is handled from scratch.
+
+void dedup_release(struct dedup_entry *entry) {
+  if (!entry) return;
+
+  k_spinlock_key_t key = k_spin_lock(&lock);
+  entry->state = DEDUP_FREE;
+  k_spin_unlock(&lock, key);
+}
+
+
+// Forget all finished exchanges, e.g. after the network has been down
+// for a while, when clients may have new addresses and any
+// retransmissions are long over. Requests still being handled are
+// kept.
+
+void dedup_flush(void) {
+  k_spinlock_key_t key = k_spin_lock(&lock);
+  for (int i = 0; i < ARRAY_SIZE(table); ++i) {
+    if (table[i].state == DEDUP_DONE || table[i].state == DEDUP_SILENT) {
+      table[i].state = DEDUP_FREE;
+    }
+  }
+  k_spin_unlock(&lock, key);
+}
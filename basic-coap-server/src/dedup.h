@@ -0,0 +1,17 @@
+#ifndef _H_DEDUP_
+#define _H_DEDUP_
+
+#include <zephyr.h>
+#include <net/net_ip.h>
+
+struct dedup_entry;
+
+int dedup_begin(const struct sockaddr *addr, uint16_t id,
+                uint8_t *buf, struct dedup_entry **entry);
+void dedup_store(struct dedup_entry *entry,
+                 const uint8_t *data, uint16_t len);
+void dedup_silent(struct dedup_entry *entry);
+void dedup_release(struct dedup_entry *entry);
+void dedup_flush(void);
+
+#endif
@@ -10,16 +10,237 @@ LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
 #include <net/coap_link_format.h>
 #include <net/net_ip.h>
 
+#include "brightness.h"
+#include "buffers.h"
+#include "cbor.h"
 #include "coap.h"
+#include "endpoints.h"
 #include "led.h"
+#include "mem.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "response.h"
+#include "stats.h"
+#include "timers.h"
 #include "utils.h"
+#include "wellknown.h"
 
 
 // From Section 12.3 of RFC 7252: "text/plain" content format.
-static const uint8_t text_plain_format = 0;
+// ("application/octet-stream" is OCTET_STREAM_FORMAT, from
+// response.h, and "application/cbor" is CBOR_FORMAT, from cbor.h.)
+#define TEXT_PLAIN_FORMAT 0
 
-// Is our LED on or off? (Not wired up to anything yet...)
-static bool led_state = false;
+// Requests are handled by several worker threads, so changes to the
+// LED states are serialised with this lock. (The states themselves
+// are kept in led.c: the "led" resource is LED 0, and the "leds"
+// resource is all of them.)
+K_MUTEX_DEFINE(led_lock);
+
+// Representations of the "led" resource: plain text, or CBOR. These
+// index the cached responses below, and the observe notifications.
+enum led_repr { LED_TEXT, LED_CBOR, NUM_LED_REPRS };
+
+// Cached "GET led" responses, one per representation. There are only
+// two possible responses in each, so these are rebuilt at most once
+// per state change.
+static struct coap_reply_cache led_get_cache[NUM_LED_REPRS];
+
+
+// ----------------------------------------------------------------------
+// RESOURCE REPRESENTATIONS
+
+// Payload writers for the responses below, and for observe
+// notifications. Each takes a snapshot of the LED states (as returned
+// by get_leds) as its argument, so that responses can be built
+// without holding the LED lock.
+
+// The state of LED 0: '0' or '1'.
+
+static int write_led_state(uint8_t *buf, void *arg) {
+  const uint32_t *leds = arg;
+  buf[0] = *leds & BIT(0) ? '1' : '0';
+  return 1;
+}
+
+// The same in CBOR: a map, {"on": true} or {"on": false}, which has
+// room to grow.
+#define LED_CBOR_LEN (CBOR_HEAD_LEN(1) + CBOR_TEXT_LEN("on") + CBOR_BOOL_LEN)
+
+static int write_led_cbor(uint8_t *buf, void *arg) {
+  const uint32_t *leds = arg;
+  struct cbor_writer w;
+  cbor_writer_init(&w, buf, LED_CBOR_LEN);
+  cbor_put_map(&w, 1);
+  cbor_put_text(&w, "on");
+  cbor_put_bool(&w, *leds & BIT(0));
+  return cbor_writer_len(&w);
+}
+
+
+// The state of all the LEDs, either as a bitmask (LED 0 is the least
+// significant bit of the first byte) or as text, with a '0' or '1' for
+// each LED.
+
+static int write_leds_binary(uint8_t *buf, void *arg) {
+  const uint32_t *leds = arg;
+  int n = (led_count() + 7) / 8;
+  for (int i = 0; i < n; ++i) buf[i] = *leds >> (8 * i);
+  return n;
+}
+
+static int write_leds_text(uint8_t *buf, void *arg) {
+  const uint32_t *leds = arg;
+  int n = led_count();
+  for (int i = 0; i < n; ++i) buf[i] = *leds & BIT(i) ? '1' : '0';
+  return n;
+}
+
+// Or in CBOR, as an array of booleans, starting at LED 0.
+#define LEDS_CBOR_LEN (CBOR_HEAD_LEN(MAX_LEDS) + MAX_LEDS * CBOR_BOOL_LEN)
+
+static int write_leds_cbor(uint8_t *buf, void *arg) {
+  const uint32_t *leds = arg;
+  int n = led_count();
+  struct cbor_writer w;
+  cbor_writer_init(&w, buf, LEDS_CBOR_LEN);
+  cbor_put_array(&w, n);
+  for (int i = 0; i < n; ++i) cbor_put_bool(&w, *leds & BIT(i));
+  return cbor_writer_len(&w);
+}
+
+
+// The responses our endpoints send (see response.c): code, content
+// format, largest payload and payload writer. Responses without a
+// payload, such as errors, are sent with send_coap_status.
+COAP_RESPONSE_DEFINE(led_content, COAP_RESPONSE_CODE_CONTENT,
+                     TEXT_PLAIN_FORMAT, 1, write_led_state);
+COAP_RESPONSE_DEFINE(led_changed, COAP_RESPONSE_CODE_CHANGED,
+                     TEXT_PLAIN_FORMAT, 1, write_led_state);
+COAP_RESPONSE_DEFINE(led_cbor_content, COAP_RESPONSE_CODE_CONTENT,
+                     CBOR_FORMAT, LED_CBOR_LEN, write_led_cbor);
+COAP_RESPONSE_DEFINE(led_cbor_changed, COAP_RESPONSE_CODE_CHANGED,
+                     CBOR_FORMAT, LED_CBOR_LEN, write_led_cbor);
+COAP_RESPONSE_DEFINE(leds_binary_content, COAP_RESPONSE_CODE_CONTENT,
+                     OCTET_STREAM_FORMAT, (MAX_LEDS + 7) / 8,
+                     write_leds_binary);
+COAP_RESPONSE_DEFINE(leds_binary_changed, COAP_RESPONSE_CODE_CHANGED,
+                     OCTET_STREAM_FORMAT, (MAX_LEDS + 7) / 8,
+                     write_leds_binary);
+COAP_RESPONSE_DEFINE(leds_text_content, COAP_RESPONSE_CODE_CONTENT,
+                     TEXT_PLAIN_FORMAT, MAX_LEDS, write_leds_text);
+COAP_RESPONSE_DEFINE(leds_text_changed, COAP_RESPONSE_CODE_CHANGED,
+                     TEXT_PLAIN_FORMAT, MAX_LEDS, write_leds_text);
+COAP_RESPONSE_DEFINE(leds_cbor_content, COAP_RESPONSE_CODE_CONTENT,
+                     CBOR_FORMAT, LEDS_CBOR_LEN, write_leds_cbor);
+COAP_RESPONSE_DEFINE(leds_cbor_changed, COAP_RESPONSE_CODE_CHANGED,
+                     CBOR_FORMAT, LEDS_CBOR_LEN, write_leds_cbor);
+
+// "led" observe notifications, by representation.
+static const struct coap_response *const led_notifications[] = {
+  [LED_TEXT] = &led_content,
+  [LED_CBOR] = &led_cbor_content,
+};
+
+
+// Content format negotiation: the format a response should be in. This
+// is the one asked for with an Accept option, if there is one.
+// Otherwise, replies to PUTs are in the same format as the request,
+// and anything else is in the resource's default format.
+
+static int response_format(struct coap_packet *req, int def) {
+  int accept = coap_get_option_int(req, COAP_OPTION_ACCEPT);
+  if (accept >= 0) return accept;
+  if (coap_header_get_code(req) == COAP_METHOD_PUT) {
+    int format = coap_get_option_int(req, COAP_OPTION_CONTENT_FORMAT);
+    if (format >= 0) return format;
+  }
+  return def;
+}
+
+
+// Parse a CBOR "PUT led" payload: either a map with an "on" entry, as
+// written by write_led_cbor, or just a boolean. Other map entries are
+// ignored.
+
+static int parse_led_cbor(const uint8_t *payload, uint16_t len, bool *on) {
+  struct cbor_reader r;
+  cbor_reader_init(&r, payload, len);
+
+  uint32_t pairs;
+  bool found = false;
+  if (cbor_get_map(&r, &pairs) < 0) {
+    found = cbor_get_bool(&r, on) == 0;
+  } else {
+    for (uint32_t i = 0; i < pairs; ++i) {
+      if (cbor_match_text(&r, "on")) {
+        if (cbor_get_bool(&r, on) < 0) return -EINVAL;
+        found = true;
+      } else if (cbor_skip(&r) < 0 || cbor_skip(&r) < 0) {
+        return -EINVAL;
+      }
+    }
+  }
+  return found && cbor_at_end(&r) ? 0 : -EINVAL;
+}
+
+
+// Parse a CBOR "PUT leds" payload: an array with an entry per LED,
+// starting at LED 0, either a boolean to set the LED or null to leave
+// it alone. As for text payloads, LEDs past the end of the array are
+// left alone.
+
+static int parse_leds_cbor(const uint8_t *payload, uint16_t len,
+                           uint32_t *mask, uint32_t *values) {
+  struct cbor_reader r;
+  cbor_reader_init(&r, payload, len);
+  *mask = *values = 0;
+
+  uint32_t items;
+  if (cbor_get_array(&r, &items) < 0 || items > led_count()) return -EINVAL;
+  for (int i = 0; i < items; ++i) {
+    bool on;
+    if (cbor_get_null(&r) == 0) continue;
+    if (cbor_get_bool(&r, &on) < 0) return -EINVAL;
+    *mask |= BIT(i);
+    if (on) *values |= BIT(i);
+  }
+  return cbor_at_end(&r) ? 0 : -EINVAL;
+}
+
+
+// Parse a "PUT leds" payload into a mask of LEDs to change and their
+// new values. A binary payload is either a bitmask of the new states
+// of all the LEDs, or a bitmask of the LEDs to change followed by a
+// bitmask of their new states, laid out as for write_leds_binary. A
+// text payload has a character per LED, starting at LED 0: '0' or '1'
+// to set the LED, or '-' to leave it alone. LEDs past the end of the
+// text are left alone too.
+
+static int parse_leds(const uint8_t *payload, uint16_t len, bool text,
+                      uint32_t *mask, uint32_t *values) {
+  int n = led_count();
+  *mask = *values = 0;
+
+  if (text) {
+    if (len > n) return -EINVAL;
+    for (int i = 0; i < len; ++i) {
+      if (payload[i] == '-') continue;
+      if (payload[i] != '0' && payload[i] != '1') return -EINVAL;
+      *mask |= BIT(i);
+      if (payload[i] == '1') *values |= BIT(i);
+    }
+    return 0;
+  }
+
+  int bytes = (n + 7) / 8;
+  if (len != bytes && len != 2 * bytes) return -EINVAL;
+  for (int i = 0; i < bytes; ++i) {
+    *values |= (uint32_t)payload[len - bytes + i] << (8 * i);
+    *mask |= (uint32_t)(len == bytes ? 0xff : payload[i]) << (8 * i);
+  }
+  return 0;
+}
 
 
 // ----------------------------------------------------------------------
@@ -29,56 +250,57 @@ static bool led_state = false;
 
 static int led_get(struct coap_resource *res, struct coap_packet *req,
                    struct sockaddr *addr, socklen_t addr_len) {
-  // The only one of these that's used for the request processing is
-  // "type" (confirmable or non-confirmable). The others are retrieved
-  // here just for debugging output. (The "code" is "GET" and "id" is
-  // just a unique message ID.)
-  uint8_t code = coap_header_get_code(req);
+  // These are retrieved here just for debugging output. The response
+  // builder uses the type (confirmable or non-confirmable) to pick the
+  // response type, and copies the message ID and token.
   uint8_t type = coap_header_get_type(req);
   uint16_t id = coap_header_get_id(req);
-  LOG_INF("led_get  type: %u code %u id %u", type, code, id);
-
-  // Allocate space for the reply.
-  // ==> NOTE: IT WOULD BE WORTH FINDING OUT IF ZEPHYR HAS ANY SORT OF
-  // POOL ALLOCATOR THAT COULD BE USED INSTEAD OF k_malloc. IF WE'RE
-  // ALWAYS ALLOCATING BUFFERS OF THE SAME SIZE, WE COULD USE A POOL
-  // ALLOCATOR TO AVOID FRAGMENTATION, WHICH MIGHT BE IMPORTANT FOR
-  // LONG-RUNNING APPLICATIONS.
-  uint8_t *data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
-  if (!data) return -ENOMEM;
-
-  // For confirmable messages, we need to send an acknowledgement type
-  // packet, though we piggyback all the reply data onto that, so
-  // there's not really a separate acknowledgement message.
-  type = type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON_CON;
-
-  // Build the reply packet: the "token" is retrieved from the request
-  // and copied into the reply packet to allow the client to correlate
-  // replies with requests. We use the "Content" response code (2.05)
-  // to show that we're sending data back.
-  struct coap_packet resp;
-  uint8_t tok[8];
-  uint8_t toklen = coap_header_get_token(req, tok);
-  int r = coap_packet_init(&resp, data, MAX_COAP_MSG_LEN, 1, type, toklen,
-                           (uint8_t *)tok, COAP_RESPONSE_CODE_CONTENT, id);
-  if (r < 0) goto end;
-
-  // Add a "Content-Format" option to show we're sending back plain
-  // text data.
-  r = coap_packet_append_option(&resp, COAP_OPTION_CONTENT_FORMAT,
-                                &text_plain_format, sizeof(text_plain_format));
-  if (r < 0) goto end;
-
-  // Mark that there's a payload (this is a 0xFF byte in place of a
-  // normal option marker).
-  r = coap_packet_append_payload_marker(&resp);
-  if (r < 0) goto end;
+  LOG_PACKET("led_get  type: %u id %u", type, id);
+
+  // An Observe option of 0 registers the client to be notified of
+  // changes to the LED state, and 1 deregisters it (RFC 7641). Any
+  // other value, or no option at all, is a plain GET.
+  int observe = coap_get_option_int(req, COAP_OPTION_OBSERVE);
+  if (observe == 1) observe_deregister(res, req, addr);
+
+  // The state comes as text unless the client asks for CBOR.
+  int format = response_format(req, TEXT_PLAIN_FORMAT);
+  enum led_repr repr = format == CBOR_FORMAT ? LED_CBOR : LED_TEXT;
+  if (format != TEXT_PLAIN_FORMAT && format != CBOR_FORMAT) {
+    return send_coap_status(COAP_RESPONSE_CODE_NOT_ACCEPTABLE,
+                            req, addr, addr_len);
+  }
 
-  // Construct the reply payload.
-  uint8_t payload = led_state ? '1' : '0';
+  // Most of the time, we can just patch the header of a cached copy
+  // of the last response and send that. (Not for observe
+  // registrations though, since they need an Observe option.)
+  int r;
+  if (observe != 0) {
+    r = send_cached_coap_reply(&led_get_cache[repr], req, addr, addr_len);
+    if (r != -ENOENT) return r;
+  }
 
-  // Append the payload.
-  r = coap_packet_append_payload(&resp, &payload, 1);
+  // Allocate space for the reply. These come from a fixed-size pool
+  // (see buffers.c) rather than the heap, so this can't fail and
+  // doesn't fragment memory over time.
+  uint8_t *data = alloc_reply_buffer();
+
+  // Build a "Content" (2.05) response with the LED state, plus an
+  // Observe option if the client was registered as an observer, and
+  // remember plain GET responses for next time. This is done under the
+  // LED lock so that a PUT can't change the state between us reading
+  // it and caching the response, and so that the observe sequence
+  // number matches the state we send.
+  struct coap_packet resp;
+  k_mutex_lock(&led_lock, K_FOREVER);
+  uint32_t leds = get_leds();
+  int seq = observe == 0 ? observe_register(res, req, addr, repr) : -1;
+  r = coap_response_build(led_notifications[repr], req, seq, &leds,
+                          data, &resp);
+  if (r >= 0 && observe != 0) {
+    store_cached_coap_reply(&led_get_cache[repr], &resp);
+  }
+  k_mutex_unlock(&led_lock);
   if (r < 0) goto end;
 
   // Send the reply: note that this is a function we're providing in
@@ -93,7 +315,7 @@ static int led_get(struct coap_resource *res, struct coap_packet *req,
   // cleanup on error exits in C. Don't believe people who say that
   // "goto" is dead!
 end:
-  k_free(data);
+  free_reply_buffer(data);
   return r;
 }
 
@@ -102,14 +324,10 @@ end:
 
 static int led_put(struct coap_resource *res, struct coap_packet *req,
                    struct sockaddr *addr, socklen_t addr_len) {
-  // The only one of these that's used for the request processing is
-  // "type" (confirmable or non-confirmable). The others are retrieved
-  // here just for debugging output. (The "code" is "POST" and "id" is
-  // just a unique message ID.)
-  uint8_t code = coap_header_get_code(req);
+  // Just for debugging output, as for led_get.
   uint8_t type = coap_header_get_type(req);
   uint16_t id = coap_header_get_id(req);
-  LOG_INF("led_put  type: %u code %u id %u", type, code, id);
+  LOG_PACKET("led_put  type: %u id %u", type, id);
 
   // Retrieve the PUT payload.
   uint16_t payload_len;
@@ -117,88 +335,465 @@ static int led_put(struct coap_resource *res, struct coap_packet *req,
   if (payload) {
     hexdump("PUT Payload", payload, payload_len);
   } else {
-    LOG_INF("PUT with no payload!");
+    LOG_PACKET("PUT with no payload!");
   }
 
-  // Process the payload. If it's ASCII '1' or binary 1, switch the
-  // LED on. If it's ASCII '0' or binary 0, switch the LED off.
-  // Otherwise ignore it.
-  if (payload_len >= 1) {
+  // The payload is text (or a bare binary byte, with no
+  // Content-Format option) or CBOR.
+  int content_format = coap_get_option_int(req, COAP_OPTION_CONTENT_FORMAT);
+  if (content_format >= 0 && content_format != TEXT_PLAIN_FORMAT &&
+      content_format != CBOR_FORMAT) {
+    return send_coap_status(COAP_RESPONSE_CODE_UNSUPPORTED_CONTENT_FORMAT,
+                            req, addr, addr_len);
+  }
+  bool cbor = content_format == CBOR_FORMAT;
+
+  // The reply is in the same format as the request, unless the client
+  // asks otherwise.
+  int format = response_format(req, TEXT_PLAIN_FORMAT);
+  if (format != TEXT_PLAIN_FORMAT && format != CBOR_FORMAT) {
+    return send_coap_status(COAP_RESPONSE_CODE_NOT_ACCEPTABLE,
+                            req, addr, addr_len);
+  }
+
+  // A CBOR payload says whether the LED should be on (see
+  // parse_led_cbor), and has to make sense.
+  bool on = false;
+  if (cbor && (!payload || parse_led_cbor(payload, payload_len, &on) < 0)) {
+    return send_coap_status(COAP_RESPONSE_CODE_BAD_REQUEST,
+                            req, addr, addr_len);
+  }
+
+  // Otherwise, process the payload: if it's ASCII '1' or binary 1,
+  // switch the LED on. If it's ASCII '0' or binary 0, switch the LED
+  // off. Otherwise ignore it.
+  k_mutex_lock(&led_lock, K_FOREVER);
+  uint32_t old_state = get_leds();
+  if (cbor) {
+    if (on) {
+      led_on();
+    } else {
+      led_off();
+    }
+  } else if (payload_len >= 1) {
     if (payload[0] == '1' || payload[0] == 1) {
-      led_state = true;
       led_on();
     } else if (payload[0] == '0' || payload[0] == 0) {
-      led_state = false;
       led_off();
     }
   }
 
-  // Allocate space for the reply.
-  uint8_t *data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
-  if (!data) return -ENOMEM;
+  // If the state changed, the cached "GET led" responses are stale
+  // and any observers need to be told.
+  uint32_t leds = get_leds();
+  if ((leds ^ old_state) & BIT(0)) {
+    for (int i = 0; i < NUM_LED_REPRS; ++i) {
+      invalidate_cached_coap_reply(&led_get_cache[i]);
+    }
+    observe_notify(res, led_notifications, &leds);
+  }
+  k_mutex_unlock(&led_lock);
+
+  // Reply with "Changed" (2.04), to show that we may have modified the
+  // status of the requested resource, and the new state.
+  return send_coap_response(format == CBOR_FORMAT ? &led_cbor_changed :
+                            &led_changed, req, addr, addr_len, &leds);
+}
+
+
+// Endpoint handler for "GET leds" CoAP requests: the state of all the
+// LEDs in one response. The default is a binary bitmask, but clients
+// can ask for text or CBOR with an Accept option.
+
+static int leds_get(struct coap_resource *res, struct coap_packet *req,
+                    struct sockaddr *addr, socklen_t addr_len) {
+  LOG_PACKET("leds_get  id %u", coap_header_get_id(req));
+
+  int accept = coap_get_option_int(req, COAP_OPTION_ACCEPT);
+  const struct coap_response *spec =
+    accept < 0 || accept == OCTET_STREAM_FORMAT ? &leds_binary_content :
+    accept == TEXT_PLAIN_FORMAT ? &leds_text_content :
+    accept == CBOR_FORMAT ? &leds_cbor_content : NULL;
+  if (!spec) {
+    return send_coap_status(COAP_RESPONSE_CODE_NOT_ACCEPTABLE,
+                            req, addr, addr_len);
+  }
+
+  k_mutex_lock(&led_lock, K_FOREVER);
+  uint32_t leds = get_leds();
+  k_mutex_unlock(&led_lock);
+
+  return send_coap_response(spec, req, addr, addr_len, &leds);
+}
+
+
+// Endpoint handler for "PUT leds" CoAP requests: change any number of
+// LEDs at once (see parse_leds and parse_leds_cbor for the payload
+// formats). The reply carries the new state of all the LEDs, in the
+// same format as the request unless there's an Accept option.
+
+static int leds_put(struct coap_resource *res, struct coap_packet *req,
+                    struct sockaddr *addr, socklen_t addr_len) {
+  LOG_PACKET("leds_put  id %u", coap_header_get_id(req));
+
+  // Binary is assumed if there's no Content-Format option.
+  int format = coap_get_option_int(req, COAP_OPTION_CONTENT_FORMAT);
+  uint16_t payload_len;
+  const uint8_t *payload = coap_packet_get_payload(req, &payload_len);
+  uint32_t mask, values;
+  if (format >= 0 && format != TEXT_PLAIN_FORMAT &&
+      format != OCTET_STREAM_FORMAT && format != CBOR_FORMAT) {
+    return send_coap_status(COAP_RESPONSE_CODE_UNSUPPORTED_CONTENT_FORMAT,
+                            req, addr, addr_len);
+  }
+  int reply_format = response_format(req, OCTET_STREAM_FORMAT);
+  const struct coap_response *spec =
+    reply_format == OCTET_STREAM_FORMAT ? &leds_binary_changed :
+    reply_format == TEXT_PLAIN_FORMAT ? &leds_text_changed :
+    reply_format == CBOR_FORMAT ? &leds_cbor_changed : NULL;
+  if (!spec) {
+    return send_coap_status(COAP_RESPONSE_CODE_NOT_ACCEPTABLE,
+                            req, addr, addr_len);
+  }
+  if (!payload ||
+      (format == CBOR_FORMAT ?
+       parse_leds_cbor(payload, payload_len, &mask, &values) :
+       parse_leds(payload, payload_len, format == TEXT_PLAIN_FORMAT,
+                  &mask, &values)) < 0) {
+    return send_coap_status(COAP_RESPONSE_CODE_BAD_REQUEST,
+                            req, addr, addr_len);
+  }
+
+  // All the changes go out in one GPIO write per port. If LED 0
+  // changed, the "led" resource changed too.
+  k_mutex_lock(&led_lock, K_FOREVER);
+  uint32_t old_state = get_leds();
+  set_leds(mask, values);
+  uint32_t leds = get_leds();
+  if ((leds ^ old_state) & BIT(0)) {
+    for (int i = 0; i < NUM_LED_REPRS; ++i) {
+      invalidate_cached_coap_reply(&led_get_cache[i]);
+    }
+    observe_notify(&coap_resources[RESOURCE_led], led_notifications, &leds);
+  }
+  k_mutex_unlock(&led_lock);
+
+  return send_coap_response(spec, req, addr, addr_len, &leds);
+}
+
+
+#ifdef CONFIG_BASIC_COAP_BRIGHTNESS
+// Brightness levels are 0-255 in brightness.c, but percentages in
+// the "led/brightness" resource.
+#define LEVEL_TO_PERCENT(l) (((l) * 100 + 127) / 255)
+#define PERCENT_TO_LEVEL(p) (((p) * 255 + 50) / 100)
+
+// Parse a decimal number from text, advancing past it and any spaces
+// after it.
+static int parse_number(const uint8_t **p, const uint8_t *end,
+                        uint32_t max, uint32_t *value) {
+  const uint8_t *start = *p;
+  *value = 0;
+  for (; *p < end && **p >= '0' && **p <= '9'; ++*p) {
+    *value = *value * 10 + (**p - '0');
+    if (*value > max) return -EINVAL;
+  }
+  if (*p == start) return -EINVAL;
+  while (*p < end && **p == ' ') ++*p;
+  return 0;
+}
+
+// Parse a text "PUT led/brightness" payload: a percentage and an
+// optional fade time in milliseconds.
+static int parse_brightness_text(const uint8_t *p, uint16_t len,
+                                 uint32_t *percent, uint32_t *fade_ms) {
+  const uint8_t *end = p + len;
+  if (parse_number(&p, end, 100, percent) < 0 ||
+      (p < end && parse_number(&p, end, 3600000, fade_ms) < 0) || p != end)
+    return -EINVAL;
+  return 0;
+}
 
-  // For confirmable messages, we need to send an acknowledgement type
-  // packet, though we piggyback all the reply data onto that, so
-  // there's not really a separate acknowledgement message.
-  type = type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON_CON;
 
-  // Build the reply packet: the "token" is retrieved from the request
-  // and copied into the reply packet to allow the client to correlate
-  // replies with requests. We use the "Changed" response code (2.04)
-  // to show that we may have modified the status of the requested
-  // resource.
+// A PUT with a fade is answered when the fade has finished, with a
+// separate response, so that the client knows when the LED has got
+// there. Only the latest fade's response can be waiting: when a fade
+// is replaced by another PUT, its response is sent then.
+static struct coap_deferred fade_response;
+static struct coap_timer fade_response_timer;
+static bool fade_response_pending;
+K_MUTEX_DEFINE(fade_response_lock);
+
+// Send the response for the last fade, if it's waiting. Call with the
+// lock held.
+static void send_fade_response(void) {
+  if (!fade_response_pending) return;
+  fade_response_pending = false;
+  coap_timer_cancel(&fade_response_timer);
+
+  // Just the header and token.
+  uint8_t data[4 + 8];
   struct coap_packet resp;
-  uint8_t tok[8];
-  uint8_t toklen = coap_header_get_token(req, tok);
-  int r = coap_packet_init(&resp, data, MAX_COAP_MSG_LEN, 1, type, toklen,
-                           (uint8_t *)tok, COAP_RESPONSE_CODE_CHANGED, id);
-  if (r < 0) goto end;
+  int r = coap_deferred_init(&fade_response, &resp, data, sizeof(data),
+                             COAP_RESPONSE_CODE_CHANGED);
+  if (r >= 0) r = send_coap_deferred(&fade_response, &resp);
+  if (r < 0) LOG_ERR("Failed to send fade response (%d)", r);
+}
 
-  // Add a "Content-Format" option to show we're sending back plain
-  // text data.
-  r = coap_packet_append_option(&resp, COAP_OPTION_CONTENT_FORMAT,
-                                &text_plain_format, sizeof(text_plain_format));
-  if (r < 0) goto end;
+// Fade response timer, run on the CoAP receive thread.
+static void fade_response_expired(struct coap_timer *timer) {
+  k_mutex_lock(&fade_response_lock, K_FOREVER);
+  // Unless another PUT restarted the timer in the meantime.
+  if (!coap_timer_running(timer)) send_fade_response();
+  k_mutex_unlock(&fade_response_lock);
+}
 
-  // Mark that there's a payload (this is a 0xFF byte in place of a
-  // normal option marker).
-  r = coap_packet_append_payload_marker(&resp);
-  if (r < 0) goto end;
 
-  // Construct the reply payload.
-  uint8_t rpayload = led_state ? '1' : '0';
+// Snapshot of the brightness and fade state, for the payload writers.
+struct brightness_state {
+  uint8_t percent;
+  bool fading;
+  uint8_t target;         // Where the fade is going, as a percentage.
+  uint32_t remaining_ms;  // How long it has left.
+};
 
-  // Append the payload.
-  r = coap_packet_append_payload(&resp, &rpayload, 1);
-  if (r < 0) goto end;
+static void get_brightness_state(struct brightness_state *state) {
+  uint8_t target;
+  state->percent = LEVEL_TO_PERCENT(get_brightness());
+  state->fading = get_fade(&target, &state->remaining_ms);
+  if (state->fading) {
+    state->target = LEVEL_TO_PERCENT(target);
+  } else {
+    state->target = state->percent;
+    state->remaining_ms = 0;
+  }
+}
 
-  // Send the reply.
-  r = send_coap_reply(&resp, addr, addr_len);
 
-  // Clean up on exit.
-end:
-  k_free(data);
-  return r;
+// The brightness as a text percentage.
+
+static int write_percent(uint8_t *buf, void *arg) {
+  const struct brightness_state *state = arg;
+  char text[4];
+  int len = snprintk(text, sizeof(text), "%u", state->percent);
+  memcpy(buf, text, len);
+  return len;
 }
 
+// The brightness and any fade in progress in CBOR: {"level": 40} when
+// the LED is steady, or {"level": 40, "target": 80, "remaining": 1500}
+// during a fade.
+#define BRIGHTNESS_CBOR_LEN                                         \
+  (CBOR_HEAD_LEN(3) + CBOR_TEXT_LEN("level") + CBOR_HEAD_LEN(100) + \
+   CBOR_TEXT_LEN("target") + CBOR_HEAD_LEN(100) +                   \
+   CBOR_TEXT_LEN("remaining") + CBOR_HEAD_LEN(UINT32_MAX))
+
+static int write_brightness_cbor(uint8_t *buf, void *arg) {
+  const struct brightness_state *state = arg;
+  struct cbor_writer w;
+  cbor_writer_init(&w, buf, BRIGHTNESS_CBOR_LEN);
+  cbor_put_map(&w, state->fading ? 3 : 1);
+  cbor_put_text(&w, "level");
+  cbor_put_uint(&w, state->percent);
+  if (state->fading) {
+    cbor_put_text(&w, "target");
+    cbor_put_uint(&w, state->target);
+    cbor_put_text(&w, "remaining");
+    cbor_put_uint(&w, state->remaining_ms);
+  }
+  return cbor_writer_len(&w);
+}
+
+COAP_RESPONSE_DEFINE(brightness_content, COAP_RESPONSE_CODE_CONTENT,
+                     TEXT_PLAIN_FORMAT, 3, write_percent);
+COAP_RESPONSE_DEFINE(brightness_cbor_content, COAP_RESPONSE_CODE_CONTENT,
+                     CBOR_FORMAT, BRIGHTNESS_CBOR_LEN, write_brightness_cbor);
+
+
+// Parse a CBOR "PUT led/brightness" payload: a percentage on its own,
+// or a map with a "level" percentage and an optional "fade" time in
+// milliseconds. Other map entries are ignored.
+
+static int parse_brightness_cbor(const uint8_t *payload, uint16_t len,
+                                 uint32_t *percent, uint32_t *fade_ms) {
+  struct cbor_reader r;
+  cbor_reader_init(&r, payload, len);
+
+  uint32_t pairs;
+  bool found = false;
+  if (cbor_get_map(&r, &pairs) < 0) {
+    found = cbor_get_uint(&r, percent) == 0;
+  } else {
+    for (uint32_t i = 0; i < pairs; ++i) {
+      if (cbor_match_text(&r, "level")) {
+        if (cbor_get_uint(&r, percent) < 0) return -EINVAL;
+        found = true;
+      } else if (cbor_match_text(&r, "fade")) {
+        if (cbor_get_uint(&r, fade_ms) < 0) return -EINVAL;
+      } else if (cbor_skip(&r) < 0 || cbor_skip(&r) < 0) {
+        return -EINVAL;
+      }
+    }
+  }
+  if (!found || !cbor_at_end(&r)) return -EINVAL;
+  return *percent <= 100 && *fade_ms <= 3600000 ? 0 : -EINVAL;
+}
+
+
+// Endpoint handler for "GET led/brightness" CoAP requests: the current
+// brightness as a text percentage, or in CBOR with the fade state too.
+// During a fade, this is how far the fade has got.
+
+static int brightness_get(struct coap_resource *res, struct coap_packet *req,
+                          struct sockaddr *addr, socklen_t addr_len) {
+  LOG_PACKET("brightness_get  id %u", coap_header_get_id(req));
+
+  int format = response_format(req, TEXT_PLAIN_FORMAT);
+  const struct coap_response *spec =
+    format == TEXT_PLAIN_FORMAT ? &brightness_content :
+    format == CBOR_FORMAT ? &brightness_cbor_content : NULL;
+  if (!spec) {
+    return send_coap_status(COAP_RESPONSE_CODE_NOT_ACCEPTABLE,
+                            req, addr, addr_len);
+  }
+
+  struct brightness_state state;
+  get_brightness_state(&state);
+  return send_coap_response(spec, req, addr, addr_len, &state);
+}
+
+
+// Endpoint handler for "PUT led/brightness" CoAP requests. The payload
+// is a percentage, optionally followed by a fade time in milliseconds:
+// "40" sets 40% brightness immediately, and "40 2000" fades to 40%
+// over two seconds. In CBOR, the same is {"level": 40, "fade": 2000}
+// (see parse_brightness_cbor). The fade itself is run by a timer in
+// brightness.c, and the response is sent when it finishes (see above),
+// except to multicast requests, which are answered straight away.
+
+static int brightness_put(struct coap_resource *res, struct coap_packet *req,
+                          struct sockaddr *addr, socklen_t addr_len) {
+  LOG_PACKET("brightness_put  id %u", coap_header_get_id(req));
+
+  int format = coap_get_option_int(req, COAP_OPTION_CONTENT_FORMAT);
+  uint16_t payload_len;
+  const uint8_t *payload = coap_packet_get_payload(req, &payload_len);
+  uint32_t percent, fade_ms = 0;
+  uint8_t code = COAP_RESPONSE_CODE_CHANGED;
+  if (format >= 0 && format != TEXT_PLAIN_FORMAT && format != CBOR_FORMAT) {
+    code = COAP_RESPONSE_CODE_UNSUPPORTED_CONTENT_FORMAT;
+  } else if (!payload ||
+             (format == CBOR_FORMAT ?
+              parse_brightness_cbor(payload, payload_len, &percent, &fade_ms) :
+              parse_brightness_text(payload, payload_len,
+                                    &percent, &fade_ms)) < 0) {
+    code = COAP_RESPONSE_CODE_BAD_REQUEST;
+  } else {
+    // Start the fade with the lock held, so that two PUTs can't start
+    // their fades in one order and set up their responses in the
+    // other, leaving a response waiting for a fade that was replaced.
+    k_mutex_lock(&fade_response_lock, K_FOREVER);
+    if (fade_brightness(PERCENT_TO_LEVEL(percent), fade_ms) < 0) {
+      k_mutex_unlock(&fade_response_lock);
+      return send_coap_status(COAP_RESPONSE_CODE_INTERNAL_ERROR,
+                              req, addr, addr_len);
+    }
+
+    // Any fade in progress has just been replaced, so we're done with
+    // that one.
+    send_fade_response();
+    bool deferred = fade_ms > 0 &&
+      coap_defer_response(&fade_response, req, addr, addr_len) == 0;
+    if (deferred) {
+      fade_response_pending = true;
+      coap_timer_init(&fade_response_timer, fade_response_expired);
+      if (coap_timer_start(&fade_response_timer, fade_ms) < 0) {
+        send_fade_response();
+      }
+    }
+    k_mutex_unlock(&fade_response_lock);
+    if (deferred) return 0;
+  }
+
+  return send_coap_status(code, req, addr, addr_len);
+}
+#endif
+
 
 // ----------------------------------------------------------------------
 // CoAP RESOURCE DEFINITIONS
 
-// URI path for our LED resource.
-static const char *const led_path[] = {"led", NULL};
+// Link format attributes for our LED resource, listed in
+// ".well-known/core": resource type, interface (an actuator), content
+// formats (plain text and CBOR) and observable.
+static const char *const led_attributes[] = {
+  "rt=\"led\"", "if=\"core.a\"", "ct=\"0 60\"", "obs", NULL
+};
+static struct coap_core_metadata led_meta = { .attributes = led_attributes };
+
+// Link format attributes for the resource controlling all the LEDs at
+// once: binary (the default), plain text and CBOR formats are
+// supported.
+static const char *const leds_attributes[] = {
+  "rt=\"leds\"", "if=\"core.a\"", "ct=\"42 0 60\"", NULL
+};
+static struct coap_core_metadata leds_meta = { .attributes = leds_attributes };
+
+#ifdef CONFIG_BASIC_COAP_BRIGHTNESS
+// Link format attributes for the LED brightness resource.
+static const char *const brightness_attributes[] = {
+  "rt=\"brightness\"", "if=\"core.a\"", "ct=\"0 60\"", NULL
+};
+static struct coap_core_metadata brightness_meta = {
+  .attributes = brightness_attributes
+};
+#endif
+
+#ifdef CONFIG_BASIC_COAP_STATS
+// Link format attributes for the request statistics resource.
+static const char *const stats_attributes[] = {
+  "rt=\"stats\"", "if=\"core.rp\"", "ct=42", NULL
+};
+static struct coap_core_metadata stats_meta = {
+  .attributes = stats_attributes
+};
+#endif
+
+#ifdef CONFIG_BASIC_COAP_MEM_STATS
+// Link format attributes for the memory usage resource.
+static const char *const mem_stats_attributes[] = {
+  "rt=\"stats mem\"", "if=\"core.rp\"", "ct=42", NULL
+};
+static struct coap_core_metadata mem_stats_meta = {
+  .attributes = mem_stats_attributes
+};
+#endif
+
+#ifdef CONFIG_BASIC_COAP_RATE_LIMIT
+// Link format attributes for the per-client rate limiting resource.
+static const char *const client_stats_attributes[] = {
+  "rt=\"stats clients\"", "if=\"core.rp\"", "ct=42", NULL
+};
+static struct coap_core_metadata client_stats_meta = {
+  .attributes = client_stats_attributes
+};
+#endif
+
+// The resources themselves are listed in resources.def, which is also
+// used to generate the request router's hash table (see router.c). We
+// expand it twice: once for the NULL-terminated URI path of each
+// resource, and once for the coap_resources array itself.
+#define COAP_RESOURCE(name, get_, post_, put_, del_, user_data_, ...) \
+  static const char *const name##_path[] = { __VA_ARGS__, NULL };
+#include "resources.def"
+#undef COAP_RESOURCE
 
 struct coap_resource coap_resources[] = {
-  // Include the ".well-known/core" resource: this is handled by a
-  // common function defined in coap.c.
-  { .get = well_known_core_get,
-    .path = COAP_WELL_KNOWN_CORE_PATH, },
-
-  // Our LED resource: we have GET and PUT endpoints, and specify the
-  // URI path to the resource.
-  { .get = led_get,
-    .put = led_put,
-    .path = led_path },
+#define COAP_RESOURCE(name, get_, post_, put_, del_, user_data_, ...) \
+  { .get = get_, .post = post_, .put = put_, .del = del_, \
+    .path = name##_path, .user_data = user_data_ },
+#include "resources.def"
+#undef COAP_RESOURCE
 
   // End marker.
   {},
@@ -5,4 +5,13 @@
 
 extern struct coap_resource coap_resources[];
 
+// Index of each resource in coap_resources, from resources.def, for
+// code that needs to refer to particular resources.
+enum resource_index {
+#define COAP_RESOURCE(name, ...) RESOURCE_##name,
+#include "resources.def"
+#undef COAP_RESOURCE
+  NUM_RESOURCES
+};
+
 #endif
@@ -1,4 +1,14 @@
 // Basic OpenThread CoAP server: LED control.
+//
+// The LEDs are the children of the board's "gpio-leds" devicetree
+// node, numbered in devicetree order (so LED 0 is normally the one
+// with the "led0" alias). LEDs are set in bulk from a bitmask: the
+// changes are grouped by GPIO port and applied with one
+// gpio_port_set_masked_raw call per port, rather than one
+// gpio_pin_set call per LED.
+//
+// An LED on the same pin as the "pwm-led0" LED is switched through
+// brightness.c instead (see there for why).
 
 #include <logging/log.h>
 LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
@@ -9,42 +19,164 @@ LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
 #include <drivers/gpio.h>
 
 #include "led.h"
+#ifdef CONFIG_BASIC_COAP_BRIGHTNESS
+#include "brightness.h"
+#endif
 
-// The devicetree node identifier for the "led0" alias.
-#define LED0_NODE DT_ALIAS(led0)
+// The devicetree node identifier for the LEDs.
+#define LEDS_NODE DT_INST(0, gpio_leds)
 
-#if DT_NODE_HAS_STATUS(LED0_NODE, okay)
-#define LED0  DT_GPIO_LABEL(LED0_NODE, gpios)
-#define PIN DT_GPIO_PIN(LED0_NODE, gpios)
-#define FLAGS DT_GPIO_FLAGS(LED0_NODE, gpios)
-#else
+#if !DT_NODE_HAS_STATUS(LEDS_NODE, okay)
 // A build error here means your board isn't set up to blink an LED.
-#error "Unsupported board: led0 devicetree alias is not defined"
-#define LED0  ""
-#define PIN 0
-#define FLAGS 0
+#error "Unsupported board: no gpio-leds devicetree node"
+#endif
+
+// The pin the "pwm-led0" LED is on, numbered as nRF pins are (32 per
+// port), or -1 if it can't be one of the GPIO LEDs. The nRF PWM driver
+// takes the pin number as the "channel", so it's in the LED's pwms
+// property; other PWM controllers aren't checked.
+#define PWM_LED0_NODE DT_ALIAS(pwm_led0)
+
+#if defined(CONFIG_BASIC_COAP_BRIGHTNESS) && \
+    DT_NODE_HAS_COMPAT(DT_PHANDLE(PWM_LED0_NODE, pwms), nordic_nrf_pwm)
+#define PWM_LED0_PIN DT_PWMS_CHANNEL(PWM_LED0_NODE)
+#else
+#define PWM_LED0_PIN -1
 #endif
 
+// A GPIO LED's pin, numbered the same way.
+#define GPIO_LED_PIN(node) \
+  (DT_GPIO_PIN(node, gpios) + \
+   32 * DT_PROP_OR(DT_PHANDLE(node, gpios), port, 0))
+
+// Static description of each LED, from the devicetree.
+struct led_pin {
+  const char *label;
+  gpio_pin_t pin;
+  gpio_flags_t flags;
+  bool pwm;  // Also the "pwm-led0" LED?
+};
+
+#define LED_PIN(node) { .label = DT_GPIO_LABEL(node, gpios),          \
+                        .pin = DT_GPIO_PIN(node, gpios),              \
+                        .flags = DT_GPIO_FLAGS(node, gpios),          \
+                        .pwm = GPIO_LED_PIN(node) == PWM_LED0_PIN },
+
+static const struct led_pin led_pins[] = {
+  DT_FOREACH_CHILD(LEDS_NODE, LED_PIN)
+};
+
+#define NUM_LEDS ARRAY_SIZE(led_pins)
+#define ALL_LEDS ((uint32_t)((1ULL << NUM_LEDS) - 1))
+BUILD_ASSERT(NUM_LEDS <= MAX_LEDS, "Too many LEDs for a 32-bit mask");
+
+// The GPIO ports the LEDs are on, found at initialisation. Raw port
+// writes bypass the driver's active-low handling, so we track which
+// pins are active low and invert them ourselves.
+struct led_port {
+  const struct device *dev;
+  gpio_port_pins_t active_low;
+};
+
+static struct led_port ports[NUM_LEDS];
+static int nports;
+
+// Port index of each LED.
+static uint8_t led_port[NUM_LEDS];
+
+// Logical state of all LEDs, one bit per LED. This isn't locked:
+// callers serialise changes (see led_lock in endpoints.c).
+static uint32_t state;
 
-const static struct device *dev;
 
 bool init_led(void) {
-  dev = device_get_binding(LED0);
-  if (dev == NULL) return false;
+  for (int i = 0; i < NUM_LEDS; ++i) {
+    const struct device *dev = device_get_binding(led_pins[i].label);
+    if (dev == NULL) return false;
 
-  int ret = gpio_pin_configure(dev, PIN, GPIO_OUTPUT_ACTIVE | FLAGS);
-  if (ret < 0) return false;
+    int ret = gpio_pin_configure(dev, led_pins[i].pin,
+                                 GPIO_OUTPUT_INACTIVE | led_pins[i].flags);
+    if (ret < 0) return false;
 
-  led_off();
+    // Find or add the LED's port.
+    int p;
+    for (p = 0; p < nports && ports[p].dev != dev; ++p);
+    if (p == nports) ports[nports++].dev = dev;
+    if (led_pins[i].flags & GPIO_ACTIVE_LOW)
+      ports[p].active_low |= BIT(led_pins[i].pin);
+    led_port[i] = p;
+  }
+
+  LOG_DBG("%d LEDs on %d GPIO ports", NUM_LEDS, nports);
+  state = 0;
   return true;
 }
 
+int led_count(void) { return NUM_LEDS; }
+
+
+// An LED shared with the PWM shows whatever brightness.c last set, so
+// it counts as on at any brightness above zero.
+
+uint32_t get_leds(void) {
+  uint32_t leds = state;
+#ifdef CONFIG_BASIC_COAP_BRIGHTNESS
+  for (int i = 0; i < NUM_LEDS; ++i) {
+    if (!led_pins[i].pwm || !brightness_ready()) continue;
+    leds = get_brightness() > 0 ? leds | BIT(i) : leds & ~BIT(i);
+  }
+#endif
+  return leds;
+}
+
+
+// Set the LEDs selected by mask to the corresponding bits of values,
+// leaving the others alone. Bits beyond the number of LEDs are
+// ignored.
+
+int set_leds(uint32_t mask, uint32_t values) {
+  mask &= ALL_LEDS;
+
+  // Collect the pins to change and their new levels for each port.
+  // An LED shared with the PWM is set through brightness.c instead,
+  // unless the PWM isn't available.
+  gpio_port_pins_t pins[NUM_LEDS] = { 0 };
+  gpio_port_value_t levels[NUM_LEDS] = { 0 };
+  int r = 0;
+  for (int i = 0; i < NUM_LEDS; ++i) {
+    if (!(mask & BIT(i))) continue;
+#ifdef CONFIG_BASIC_COAP_BRIGHTNESS
+    if (led_pins[i].pwm && brightness_ready()) {
+      int ret = fade_brightness(values & BIT(i) ? 255 : 0, 0);
+      if (ret < 0) r = ret;
+      continue;
+    }
+#endif
+    gpio_port_pins_t bit = BIT(led_pins[i].pin);
+    pins[led_port[i]] |= bit;
+    if (values & BIT(i)) levels[led_port[i]] |= bit;
+  }
+
+  for (int p = 0; p < nports; ++p) {
+    if (!pins[p]) continue;
+    gpio_port_value_t raw = levels[p] ^ (ports[p].active_low & pins[p]);
+    int ret = gpio_port_set_masked_raw(ports[p].dev, pins[p], raw);
+    if (ret < 0) r = ret;
+  }
+
+  state = (state & ~mask) | (values & mask);
+  return r;
+}
+
+
+// Single LED control, for LED 0.
+
 void led_on(void) {
   LOG_DBG("===> LED ON");
-  gpio_pin_set(dev, PIN, true);
+  set_leds(BIT(0), BIT(0));
 }
 
 void led_off(void) {
   LOG_DBG("===> LED OFF");
-  gpio_pin_set(dev, PIN, false);
+  set_leds(BIT(0), 0);
 }
@@ -1,8 +1,18 @@
 #ifndef _H_LED_
 #define _H_LED_
 
+#include <stdint.h>
+
+// LED states are passed around as bitmasks, so there can be at most
+// this many.
+#define MAX_LEDS 32
+
 bool init_led(void);
 
+int led_count(void);
+uint32_t get_leds(void);
+int set_leds(uint32_t mask, uint32_t values);
+
 void led_on(void);
 void led_off(void);
 
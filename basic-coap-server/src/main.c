@@ -16,9 +16,15 @@ LOG_MODULE_REGISTER(basic_coap_server, LOG_LEVEL_DBG);
 #include <net/net_event.h>
 #include <net/net_conn_mgr.h>
 
+#include "brightness.h"
+#include "buffers.h"
+#include "capture.h"
 #include "coap.h"
 #include "led.h"
+#include "mem.h"
 #include "endpoints.h"
+#include "ratelimit.h"
+#include "stats.h"
 
 
 // ----------------------------------------------------------------------
@@ -51,20 +57,21 @@ static void event_handler(struct net_mgmt_event_callback *cb,
   }
 
   // If we're connected, flag it and release the semaphore that holds
-  // off application initialisation.
+  // off application initialisation. If the CoAP server is running
+  // already, it brings itself back up (see coap.c). (The "quit"
+  // command resends the current state, which isn't a new connection.)
   if (mgmt_event == NET_EVENT_L4_CONNECTED) {
     LOG_INF("Network connected");
+    if (!connected) coap_network_up();
     connected = true;
     k_sem_give(&run_app);
     return;
   }
 
   // If we're disconnected, flag it and reset the semaphore that holds
-  // off application initialisation.
-  // ==> NOTE: I'M NOT SURE WHAT THIS REALLY DOES ONCE THE CoAP SERVER
-  // IS RUNNING. IT CERTAINLY DOESN'T STOP IT. IN A REAL APPLICATION,
-  // YOU WOULD WANT TO BE MORE CAREFUL ABOUT WHAT HAPPENS AS NETWORK
-  // CONNECTIONS COME AND GO.
+  // off application initialisation. A running CoAP server parks
+  // itself until the network comes back: on Thread networks,
+  // partitions and re-attaches are routine, so this isn't the end.
   if (mgmt_event == NET_EVENT_L4_DISCONNECTED) {
     if (!connected) {
       LOG_INF("Waiting network to be connected");
@@ -73,6 +80,7 @@ static void event_handler(struct net_mgmt_event_callback *cb,
       connected = false;
     }
 
+    coap_network_down();
     k_sem_reset(&run_app);
     return;
   }
@@ -98,8 +106,11 @@ static void init_app(void) {
 
   LOG_INF("Basic CoAP server");
 
-  // Initialise LED GPIO.
+  // Initialise LED GPIO and PWM.
   init_led();
+#ifdef CONFIG_BASIC_COAP_BRIGHTNESS
+  if (!init_brightness()) LOG_ERR("LED brightness control unavailable");
+#endif
 
   // Initialise network connection callback.
   net_mgmt_init_event_callback(&mgmt_cb, event_handler, EVENT_MASK);
@@ -127,8 +138,84 @@ static int cmd_quit(const struct shell *shell, size_t argc, char *argv[]) {
   return 0;
 }
 
+// Show CoAP reply buffer pool usage. This is accessible as
+// "basic_coap buffers" in the Zephyr shell.
+
+static int cmd_buffers(const struct shell *shell,
+                       size_t argc, char *argv[]) {
+  struct reply_buffer_stats stats;
+  get_reply_buffer_stats(&stats);
+  shell_print(shell, "Reply buffers: %u total, %u in use, "
+              "high-water %u, waits %u",
+              stats.total, stats.used, stats.high_water, stats.waits);
+  return 0;
+}
+
+#ifdef CONFIG_BASIC_COAP_CAPTURE
+// Dump the packet capture ring as a hex-encoded pcap file. This is
+// accessible as "basic_coap capture dump" in the Zephyr shell.
+
+static int cmd_capture_dump(const struct shell *shell,
+                            size_t argc, char *argv[]) {
+  capture_dump(shell);
+  return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE
+  (capture_commands,
+   SHELL_CMD(dump, NULL,
+             "Print captured packets as hex pcap (decode with xxd -r -p)\n",
+             cmd_capture_dump),
+   SHELL_SUBCMD_SET_END);
+#endif
+
+#ifdef CONFIG_BASIC_COAP_MEM_STATS
+// Show stack, heap and pool usage. This is accessible as
+// "basic_coap mem" in the Zephyr shell.
+
+static int cmd_mem(const struct shell *shell, size_t argc, char *argv[]) {
+  mem_print(shell);
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_BASIC_COAP_STATS
+// Show request statistics and latency histograms. This is accessible
+// as "basic_coap stats" in the Zephyr shell.
+
+static int cmd_stats(const struct shell *shell, size_t argc, char *argv[]) {
+  stats_print(shell);
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_BASIC_COAP_RATE_LIMIT
+// Show per-client rate limiting counters. This is accessible as
+// "basic_coap clients" in the Zephyr shell.
+
+static int cmd_clients(const struct shell *shell,
+                       size_t argc, char *argv[]) {
+  ratelimit_print(shell);
+  return 0;
+}
+#endif
+
 SHELL_STATIC_SUBCMD_SET_CREATE
   (basic_coap_commands,
+   SHELL_CMD(buffers, NULL, "Show CoAP reply buffer usage\n", cmd_buffers),
+#ifdef CONFIG_BASIC_COAP_RATE_LIMIT
+   SHELL_CMD(clients, NULL, "Show per-client rate limiting counters\n",
+             cmd_clients),
+#endif
+#ifdef CONFIG_BASIC_COAP_CAPTURE
+   SHELL_CMD(capture, &capture_commands, "Packet capture ring\n", NULL),
+#endif
+#ifdef CONFIG_BASIC_COAP_MEM_STATS
+   SHELL_CMD(mem, NULL, "Show stack, heap and pool usage\n", cmd_mem),
+#endif
+#ifdef CONFIG_BASIC_COAP_STATS
+   SHELL_CMD(stats, NULL, "Show CoAP request statistics\n", cmd_stats),
+#endif
    SHELL_CMD(quit, NULL, "Quit the basic CoAP server application\n", cmd_quit),
    SHELL_SUBCMD_SET_END);
 
@@ -155,11 +242,10 @@ void main(void) {
   // Wait for shell "basic_coap quit" command.
   k_sem_take(&quit_lock, K_FOREVER);
 
-  // Kill CoAP server thread if it's running.
-  if (connected) {
-    LOG_INF("Stopping...");
-    stop_coap();
-  }
+  // Stop the CoAP server, whether it's running or parked waiting for
+  // the network.
+  LOG_INF("Stopping...");
+  stop_coap();
 
   LOG_DBG("Done");
 }
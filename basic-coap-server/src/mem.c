@@ -0,0 +1,291 @@
+// Basic OpenThread CoAP server: memory usage report.
+//
+// How much of each thread's stack has ever been used (stacks are
+// filled with a known pattern at creation, with CONFIG_INIT_STACKS, so
+// the untouched part can be measured), how the system heap is doing,
+// and how full the network packet and buffer pools and our own memory
+// slabs and tables are. This is for right-sizing all of those, which
+// are otherwise guesses.
+//
+// The report is shown by the "basic_coap mem" shell command, and
+// served in binary form from the "stats/mem" resource.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+#include <shell/shell.h>
+#include <sys/byteorder.h>
+
+#include <net/buf.h>
+#include <net/coap.h>
+#include <net/net_pkt.h>
+
+#if CONFIG_HEAP_MEM_POOL_SIZE > 0
+// Zephyr 2.4 has no API for heap usage, so we walk the heap's chunks
+// using the heap implementation's private header (from lib/os). Only
+// get_heap_usage looks inside the heap: that's all that needs
+// changing if the heap's internals do.
+#include <heap.h>
+#endif
+
+#include "buffers.h"
+#include "coap.h"
+#include "mem.h"
+#include "response.h"
+
+
+// Memory slabs defined in coap.c and buffers.c.
+extern struct k_mem_slab request_slab;
+extern struct k_mem_slab delayed_reply_slab;
+extern struct k_mem_slab reply_slab;
+
+#if CONFIG_HEAP_MEM_POOL_SIZE > 0
+// The system heap used by k_malloc, defined by the kernel.
+extern struct k_heap _system_heap;
+#endif
+
+
+// ----------------------------------------------------------------------
+// GATHERING
+
+struct heap_usage {
+  uint32_t total;
+  uint32_t used;
+  uint32_t free;
+  uint32_t largest_free;  // Largest allocation that could succeed now.
+};
+
+struct pool_usage {
+  const char *name;
+  uint16_t total;
+  uint16_t used;
+  size_t entry_size;  // Bytes per entry, or 0 if not known.
+};
+
+enum {
+  POOL_REPLY_BUFFERS, POOL_REQUESTS, POOL_DELAYED_REPLIES,
+  POOL_CON_EXCHANGES, POOL_NET_RX_PKTS, POOL_NET_TX_PKTS,
+  POOL_NET_RX_BUFS, POOL_NET_TX_BUFS,
+  NUM_POOLS
+};
+
+
+// Walk the system heap's chunks, with the heap locked so that they
+// can't be split or merged under us.
+
+static void get_heap_usage(struct heap_usage *usage) {
+  memset(usage, 0, sizeof(*usage));
+#if CONFIG_HEAP_MEM_POOL_SIZE > 0
+  k_spinlock_key_t key = k_spin_lock(&_system_heap.lock);
+  struct z_heap *h = _system_heap.heap.heap;
+
+  // Chunk 0 holds the heap's own bookkeeping, so isn't counted.
+  for (chunkid_t c = right_chunk(h, 0); c < h->len; c = right_chunk(h, c)) {
+    uint32_t bytes = chunk_size(h, c) * CHUNK_UNIT;
+    if (chunk_used(h, c)) {
+      usage->used += bytes;
+    } else {
+      usage->free += bytes;
+      usage->largest_free = MAX(usage->largest_free, bytes);
+    }
+  }
+  k_spin_unlock(&_system_heap.lock, key);
+
+  usage->total = usage->used + usage->free;
+#endif
+}
+
+
+static void slab_usage(struct pool_usage *usage, const char *name,
+                       struct k_mem_slab *slab) {
+  usage->name = name;
+  usage->total = slab->num_blocks;
+  usage->used = k_mem_slab_num_used_get(slab);
+  usage->entry_size = slab->block_size;
+}
+
+static void buf_pool_usage(struct pool_usage *usage, const char *name,
+                           struct net_buf_pool *pool) {
+  usage->name = name;
+  usage->total = pool->buf_count;
+#ifdef CONFIG_NET_BUF_FIXED_DATA_SIZE
+  usage->entry_size = CONFIG_NET_BUF_DATA_SIZE;
+#else
+  usage->entry_size = 0;
+#endif
+#ifdef CONFIG_NET_BUF_POOL_USAGE
+  usage->used = pool->buf_count - atomic_get(&pool->avail_count);
+#else
+  usage->used = 0;
+#endif
+}
+
+static void get_pool_usage(struct pool_usage pools[NUM_POOLS]) {
+  slab_usage(&pools[POOL_REPLY_BUFFERS], "reply buffers", &reply_slab);
+  slab_usage(&pools[POOL_REQUESTS], "requests", &request_slab);
+  slab_usage(&pools[POOL_DELAYED_REPLIES], "delayed replies",
+             &delayed_reply_slab);
+
+  struct pool_usage *con = &pools[POOL_CON_EXCHANGES];
+  con->name = "CON exchanges";
+  coap_con_usage(&con->total, &con->used, &con->entry_size);
+
+  struct k_mem_slab *rx, *tx;
+  struct net_buf_pool *rx_data, *tx_data;
+  net_pkt_get_info(&rx, &tx, &rx_data, &tx_data);
+  slab_usage(&pools[POOL_NET_RX_PKTS], "net RX packets", rx);
+  slab_usage(&pools[POOL_NET_TX_PKTS], "net TX packets", tx);
+  buf_pool_usage(&pools[POOL_NET_RX_BUFS], "net RX buffers", rx_data);
+  buf_pool_usage(&pools[POOL_NET_TX_BUFS], "net TX buffers", tx_data);
+}
+
+
+// Stack usage of a thread, in bytes. Returns false if it can't be
+// measured.
+
+static bool stack_usage(const struct k_thread *thread,
+                        size_t *size, size_t *used) {
+  size_t unused;
+  if (k_thread_stack_space_get(thread, &unused) < 0) return false;
+  *size = thread->stack_info.size;
+  *used = *size - unused;
+  return true;
+}
+
+
+// ----------------------------------------------------------------------
+// SHELL OUTPUT
+
+static void print_thread(const struct k_thread *thread, void *user_data) {
+  const struct shell *shell = user_data;
+  const char *name = k_thread_name_get((k_tid_t)thread);
+  size_t size, used;
+  if (!stack_usage(thread, &size, &used)) {
+    shell_print(shell, "  %-16s (unavailable)", name ? name : "?");
+    return;
+  }
+  shell_print(shell, "  %-16s %5u / %5u bytes (%u%%)", name ? name : "?",
+              (uint32_t)used, (uint32_t)size,
+              size ? (uint32_t)(100 * used / size) : 0);
+}
+
+void mem_print(const struct shell *shell) {
+  shell_print(shell, "Stack high-water marks:");
+  k_thread_foreach(print_thread, (void *)shell);
+
+  struct heap_usage heap;
+  get_heap_usage(&heap);
+  shell_print(shell, "Heap: %u bytes, %u used, %u free, "
+              "largest free block %u (fragmentation %u%%)",
+              heap.total, heap.used, heap.free, heap.largest_free,
+              heap.free ? 100 - 100 * heap.largest_free / heap.free : 0);
+
+  struct pool_usage pools[NUM_POOLS];
+  get_pool_usage(pools);
+  shell_print(shell, "Pools:");
+  for (int i = 0; i < NUM_POOLS; ++i) {
+    if (pools[i].entry_size) {
+      shell_print(shell, "  %-16s %3u / %3u used, %4u bytes each",
+                  pools[i].name, pools[i].used, pools[i].total,
+                  (uint32_t)pools[i].entry_size);
+    } else {
+      shell_print(shell, "  %-16s %3u / %3u used", pools[i].name,
+                  pools[i].used, pools[i].total);
+    }
+  }
+  if (!IS_ENABLED(CONFIG_NET_BUF_POOL_USAGE)) {
+    shell_print(shell, "(Enable CONFIG_NET_BUF_POOL_USAGE for net "
+                "buffer usage.)");
+  }
+}
+
+
+// ----------------------------------------------------------------------
+// "stats/mem" RESOURCE
+//
+// Binary (application/octet-stream), with multi-byte values
+// little-endian:
+//
+//   u8 version (1), u8 threads, u8 pools, u8 flags (bit 0: not all
+//       threads fitted)
+//   u32 heap total, used, free, largest free block (bytes)
+//   threads * { char name[8] (NUL-padded, maybe not terminated),
+//               u16 stack size, u16 stack used (bytes) }
+//   pools * { u16 total, u16 used }, in the order reply buffers,
+//       requests, delayed replies, outgoing confirmable messages, net
+//       RX packets, net TX packets, net RX buffers, net TX buffers
+//
+// Threads whose stack usage can't be measured are left out.
+
+#define THREAD_NAME_LEN 8
+#define THREAD_ENTRY_LEN (THREAD_NAME_LEN + 4)
+#define FIXED_LEN (4 + 16 + 4 * NUM_POOLS)
+
+#define MAX_PAYLOAD COAP_RESPONSE_MAX_PAYLOAD
+#define MAX_THREADS ((MAX_PAYLOAD - FIXED_LEN) / THREAD_ENTRY_LEN)
+
+struct thread_render {
+  uint8_t *p;
+  uint8_t count;
+  bool truncated;
+};
+
+static void render_thread(const struct k_thread *thread, void *user_data) {
+  struct thread_render *r = user_data;
+  size_t size, used;
+  if (!stack_usage(thread, &size, &used)) return;
+  if (r->count == MAX_THREADS) {
+    r->truncated = true;
+    return;
+  }
+
+  const char *name = k_thread_name_get((k_tid_t)thread);
+  memset(r->p, 0, THREAD_NAME_LEN);
+  if (name) strncpy((char *)r->p, name, THREAD_NAME_LEN);
+  sys_put_le16(MIN(size, UINT16_MAX), r->p + THREAD_NAME_LEN);
+  sys_put_le16(MIN(used, UINT16_MAX), r->p + THREAD_NAME_LEN + 2);
+  r->p += THREAD_ENTRY_LEN;
+  ++r->count;
+}
+
+static int write_mem(uint8_t *buf, void *arg) {
+  uint8_t *p = buf + 4;
+
+  struct heap_usage heap;
+  get_heap_usage(&heap);
+  sys_put_le32(heap.total, p);
+  sys_put_le32(heap.used, p + 4);
+  sys_put_le32(heap.free, p + 8);
+  sys_put_le32(heap.largest_free, p + 12);
+  p += 16;
+
+  struct thread_render threads = { .p = p };
+  k_thread_foreach(render_thread, &threads);
+  p = threads.p;
+
+  struct pool_usage pools[NUM_POOLS];
+  get_pool_usage(pools);
+  for (int i = 0; i < NUM_POOLS; ++i) {
+    sys_put_le16(pools[i].total, p);
+    sys_put_le16(pools[i].used, p + 2);
+    p += 4;
+  }
+
+  buf[0] = 1;
+  buf[1] = threads.count;
+  buf[2] = NUM_POOLS;
+  buf[3] = threads.truncated ? BIT(0) : 0;
+  return p - buf;
+}
+
+// The payload is rendered straight into the reply buffer.
+COAP_RESPONSE_DEFINE(mem_content, COAP_RESPONSE_CODE_CONTENT,
+                     OCTET_STREAM_FORMAT, MAX_PAYLOAD, write_mem);
+
+int mem_stats_get(struct coap_resource *res, struct coap_packet *req,
+                  struct sockaddr *addr, socklen_t addr_len) {
+  return send_coap_response(&mem_content, req, addr, addr_len, NULL);
+}
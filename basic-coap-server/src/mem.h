@@ -0,0 +1,14 @@
+#ifndef _H_MEM_
+#define _H_MEM_
+
+#include <zephyr.h>
+#include <shell/shell.h>
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+void mem_print(const struct shell *shell);
+
+int mem_stats_get(struct coap_resource *res, struct coap_packet *req,
+                  struct sockaddr *addr, socklen_t addr_len);
+
+#endif
@@ -0,0 +1,114 @@
+// Basic OpenThread CoAP server: multicast group membership.
+//
+// We join the link-local and realm-local "All CoAP Nodes" groups
+// (ff02::fd and ff03::fd, RFC 7252 Section 12.8), plus any groups
+// listed in CONFIG_BASIC_COAP_MCAST_GROUPS, on the default interface,
+// so that a controller can switch a whole set of nodes with a single
+// multicast request. Adding the address to the interface is all that
+// OpenThread needs: the L2 code subscribes the Thread interface to
+// any multicast address added to the Zephyr interface.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <net/net_if.h>
+#include <net/net_ip.h>
+
+#include "multicast.h"
+
+
+// The "All CoAP Nodes" address FF0X::FD, from the "IPv6 Multicast
+// Address Space Registry", in the "Variable Scope Multicast
+// Addresses" space (RFC 3307), in link-local (FF02) and realm-local
+// (FF03) scopes. On Thread networks, realm-local means the whole mesh.
+#define ALL_COAP_NODES_LINK_LOCAL {{{0xff,0x02,0,0,0,0,0,0,0,0,0,0,0,0,0,0xfd}}}
+#define ALL_COAP_NODES_REALM_LOCAL {{{0xff,0x03,0,0,0,0,0,0,0,0,0,0,0,0,0,0xfd}}}
+
+#define MAX_GROUPS (2 + CONFIG_BASIC_COAP_MCAST_MAX_GROUPS)
+
+static struct in6_addr groups[MAX_GROUPS];
+static int ngroups;
+
+
+// Join one group, if it isn't already joined.
+
+static bool join_group(struct net_if *iface, const struct in6_addr *addr) {
+  struct net_if_mcast_addr *maddr = net_if_ipv6_maddr_lookup(addr, &iface);
+  if (!maddr) {
+    maddr = net_if_ipv6_maddr_add(iface, addr);
+    if (!maddr) {
+      LOG_ERR("Cannot join IPv6 multicast group: no free address slot");
+      return false;
+    }
+  }
+  if (!net_if_ipv6_maddr_is_joined(maddr)) net_if_ipv6_maddr_join(maddr);
+
+  groups[ngroups++] = *addr;
+  return true;
+}
+
+
+// Join the All CoAP Nodes groups and the configured extra groups.
+// Returns the number of groups joined. Configured groups that aren't
+// valid multicast addresses are skipped with an error.
+
+int join_multicast_groups(void) {
+  struct net_if *iface = net_if_get_default();
+  if (!iface) {
+    LOG_ERR("Could not get default interface");
+    return -ENODEV;
+  }
+
+  static const struct in6_addr all_coap_nodes[] = {
+    ALL_COAP_NODES_LINK_LOCAL, ALL_COAP_NODES_REALM_LOCAL
+  };
+  ngroups = 0;
+  for (int i = 0; i < ARRAY_SIZE(all_coap_nodes); ++i) {
+    join_group(iface, &all_coap_nodes[i]);
+  }
+
+  // Extra groups are given as a space-separated list.
+  char list[] = CONFIG_BASIC_COAP_MCAST_GROUPS;
+  char *save;
+  for (char *s = strtok_r(list, " ", &save); s; s = strtok_r(NULL, " ", &save)) {
+    struct in6_addr addr;
+    if (net_addr_pton(AF_INET6, s, &addr) < 0 ||
+        !net_ipv6_is_addr_mcast(&addr)) {
+      LOG_ERR("Invalid multicast group %s", log_strdup(s));
+      continue;
+    }
+    if (ngroups == MAX_GROUPS) {
+      LOG_ERR("Too many multicast groups: ignoring %s", log_strdup(s));
+      break;
+    }
+    join_group(iface, &addr);
+  }
+
+  return ngroups;
+}
+
+
+// Leave all the groups we joined. (If something else had already
+// joined one of them, it's left too: nothing else in this application
+// uses these groups.)
+
+void leave_multicast_groups(void) {
+  for (int i = 0; i < ngroups; ++i) {
+    struct net_if *iface = NULL;
+    struct net_if_mcast_addr *maddr =
+      net_if_ipv6_maddr_lookup(&groups[i], &iface);
+    if (!maddr) continue;
+    net_if_ipv6_maddr_leave(maddr);
+    net_if_ipv6_maddr_rm(iface, &groups[i]);
+  }
+  ngroups = 0;
+}
+
+
+int multicast_group_count(void) { return ngroups; }
+
+const struct in6_addr *multicast_group(int i) { return &groups[i]; }
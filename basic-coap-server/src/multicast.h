@@ -0,0 +1,12 @@
+#ifndef _H_MULTICAST_
+#define _H_MULTICAST_
+
+#include <net/net_ip.h>
+
+int join_multicast_groups(void);
+void leave_multicast_groups(void);
+
+int multicast_group_count(void);
+const struct in6_addr *multicast_group(int i);
+
+#endif
@@ -0,0 +1,242 @@
+// Basic OpenThread CoAP server: resource observation (RFC 7641).
+//
+// Clients can register interest in a resource by sending a GET with
+// an Observe option. After that, the server sends them a notification
+// every time the resource changes, so they don't need to poll.
+//
+// Observers are kept in a fixed-size table. Most notifications are
+// sent non-confirmable, but every BASIC_COAP_OBSERVE_CON_INTERVAL'th
+// one is confirmable, and retransmitted by coap.c until it's
+// acknowledged. An observer that never acknowledges one of those (or
+// that rejects any notification with a RST) is dropped.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+
+#include <net/coap.h>
+#include <net/net_ip.h>
+
+#include "buffers.h"
+#include "coap.h"
+#include "observe.h"
+#include "response.h"
+#include "stats.h"
+
+
+// Observe option sequence numbers are 24 bits (RFC 7641, Section 4.4).
+#define OBSERVE_SEQ_MASK 0xffffff
+
+struct observer {
+  struct coap_resource *res;  // NULL for a free table entry.
+  struct sockaddr_in6 addr;
+  uint8_t token[8];
+  uint8_t tkl;
+  uint16_t last_id;           // Message ID of latest notification.
+  uint16_t con_id;            // Message ID of unacknowledged CON.
+  bool con_pending;           // Is con_id still being retransmitted?
+  uint8_t since_con;          // Notifications since the last CON.
+  uint8_t repr;               // Representation asked for: see below.
+};
+
+static struct observer observers[CONFIG_BASIC_COAP_OBSERVERS];
+
+// Protects the observer table. This is a mutex rather than a spinlock
+// because notifications are sent with it held.
+K_MUTEX_DEFINE(observe_lock);
+
+
+static bool same_addr(const struct observer *obs,
+                      const struct sockaddr *addr) {
+  const struct sockaddr_in6 *addr6 = net_sin6(addr);
+  return obs->addr.sin6_port == addr6->sin6_port &&
+    net_ipv6_addr_cmp(&obs->addr.sin6_addr, &addr6->sin6_addr);
+}
+
+
+// Find an existing observer of a resource by address and token. Call
+// with the lock held.
+
+static struct observer *find_observer(struct coap_resource *res,
+                                      const struct sockaddr *addr,
+                                      const uint8_t *token, uint8_t tkl) {
+  for (int i = 0; i < ARRAY_SIZE(observers); ++i) {
+    struct observer *obs = &observers[i];
+    if (obs->res == res && same_addr(obs, addr) &&
+        obs->tkl == tkl && !memcmp(obs->token, token, tkl)) {
+      return obs;
+    }
+  }
+  return NULL;
+}
+
+
+// Called by coap.c when a confirmable notification has been
+// acknowledged, or given up on.
+
+static void notification_done(uint16_t id, enum coap_con_result result,
+                              void *user_data) {
+  struct observer *obs = user_data;
+  k_mutex_lock(&observe_lock, K_FOREVER);
+
+  // The observer may have gone, or registered again, in the meantime.
+  if (obs->res && obs->con_pending && obs->con_id == id) {
+    obs->con_pending = false;
+    if (result == COAP_CON_RESET) {
+      LOG_INF("Observer sent RST: removing");
+      obs->res = NULL;
+    } else if (result == COAP_CON_TIMED_OUT) {
+      LOG_INF("Observer timed out: removing");
+      obs->res = NULL;
+    }
+  }
+
+  k_mutex_unlock(&observe_lock);
+}
+
+
+// Send a notification to one observer. Call with the lock held.
+
+static void send_notification(struct observer *obs, uint32_t seq,
+                              const struct coap_response *spec, void *arg) {
+  // Decide whether this one is confirmable. While an earlier
+  // confirmable notification is still being retransmitted, this one
+  // is sent non-confirmable: that one decides whether the observer is
+  // still there.
+  bool con = ++obs->since_con >= CONFIG_BASIC_COAP_OBSERVE_CON_INTERVAL &&
+    !obs->con_pending;
+  if (con) obs->since_con = 0;
+
+  uint8_t *data = alloc_reply_buffer();
+  uint16_t id = coap_next_id();
+
+  int r = coap_response_write(spec, data,
+                              con ? COAP_TYPE_CON : COAP_TYPE_NON_CON,
+                              id, obs->token, obs->tkl, seq, arg);
+  if (r < 0) goto end;
+
+  struct coap_packet resp = {
+    .data = data,
+    .offset = r,
+    .max_len = MAX_COAP_MSG_LEN,
+  };
+
+  if (con) {
+    r = send_coap_con(&resp, (struct sockaddr *)&obs->addr,
+                      sizeof(obs->addr), notification_done, obs);
+  } else {
+    r = send_coap_message(&resp, (struct sockaddr *)&obs->addr,
+                          sizeof(obs->addr));
+  }
+  if (r < 0) goto end;
+
+  obs->last_id = id;
+  if (con) {
+    obs->con_id = id;
+    obs->con_pending = true;
+  }
+
+end:
+  free_reply_buffer(data);
+}
+
+
+// ----------------------------------------------------------------------
+// PUBLIC API
+
+// Register the sender of a GET request with an Observe option as an
+// observer of a resource. repr says which of the resource's
+// representations (e.g. content formats) the observer asked for: it
+// picks the response from those passed to observe_notify. Returns the
+// sequence number to put in the Observe option of the response, or
+// -ENOMEM if the observer table is full (in which case, the request
+// should be answered as a normal GET, which tells the client it isn't
+// registered).
+
+int observe_register(struct coap_resource *res, struct coap_packet *req,
+                     const struct sockaddr *addr, uint8_t repr) {
+  uint8_t token[8];
+  uint8_t tkl = coap_header_get_token(req, token);
+
+  k_mutex_lock(&observe_lock, K_FOREVER);
+
+  // Re-registration just refreshes the existing entry.
+  struct observer *obs = find_observer(res, addr, token, tkl);
+  for (int i = 0; !obs && i < ARRAY_SIZE(observers); ++i) {
+    if (!observers[i].res) obs = &observers[i];
+  }
+
+  int r = -ENOMEM;
+  if (obs) {
+    memset(obs, 0, sizeof(*obs));
+    obs->res = res;
+    memcpy(&obs->addr, addr, sizeof(obs->addr));
+    memcpy(obs->token, token, tkl);
+    obs->tkl = tkl;
+    obs->repr = repr;
+    r = res->age & OBSERVE_SEQ_MASK;
+  } else {
+    LOG_WRN("Observer table full");
+    stats_enomem();
+  }
+
+  k_mutex_unlock(&observe_lock);
+  return r;
+}
+
+
+// Remove an observer, for a GET with Observe = 1.
+
+void observe_deregister(struct coap_resource *res, struct coap_packet *req,
+                        const struct sockaddr *addr) {
+  uint8_t token[8];
+  uint8_t tkl = coap_header_get_token(req, token);
+
+  k_mutex_lock(&observe_lock, K_FOREVER);
+  struct observer *obs = find_observer(res, addr, token, tkl);
+  if (obs) obs->res = NULL;
+  k_mutex_unlock(&observe_lock);
+}
+
+
+// Notify all observers of a resource that its state has changed. Each
+// notification is built from the entry in reprs (see response.h) for
+// the representation the observer registered for, whose payload
+// writer is passed arg.
+
+void observe_notify(struct coap_resource *res,
+                    const struct coap_response *const reprs[], void *arg) {
+  k_mutex_lock(&observe_lock, K_FOREVER);
+
+  res->age = (res->age + 1) & OBSERVE_SEQ_MASK;
+  for (int i = 0; i < ARRAY_SIZE(observers); ++i) {
+    if (observers[i].res == res) {
+      send_notification(&observers[i], res->age,
+                        reprs[observers[i].repr], arg);
+    }
+  }
+
+  k_mutex_unlock(&observe_lock);
+}
+
+
+// Handle a RST message from a client that isn't for a confirmable
+// message (see notification_done for those). A RST in reply to a
+// non-confirmable notification means the observer isn't interested
+// any more.
+
+void observe_handle_reset(const struct sockaddr *addr, uint16_t id) {
+  k_mutex_lock(&observe_lock, K_FOREVER);
+
+  for (int i = 0; i < ARRAY_SIZE(observers); ++i) {
+    struct observer *obs = &observers[i];
+    if (obs->res && same_addr(obs, addr) && id == obs->last_id) {
+      LOG_INF("Observer sent RST: removing");
+      obs->res = NULL;
+    }
+  }
+
+  k_mutex_unlock(&observe_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef _H_OBSERVE_
+#define _H_OBSERVE_
+
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+#include "response.h"
+
+int observe_register(struct coap_resource *res, struct coap_packet *req,
+                     const struct sockaddr *addr, uint8_t repr);
+void observe_deregister(struct coap_resource *res, struct coap_packet *req,
+                        const struct sockaddr *addr);
+void observe_notify(struct coap_resource *res,
+                    const struct coap_response *const reprs[], void *arg);
+void observe_handle_reset(const struct sockaddr *addr, uint16_t id);
+
+#endif
@@ -0,0 +1,177 @@
+// Basic OpenThread CoAP server: per-client rate limiting.
+//
+// One misbehaving client, or a storm of retransmissions, shouldn't be
+// able to keep the server busy enough to starve everyone else. Each
+// client gets a token bucket: a request takes a token, tokens come
+// back at BASIC_COAP_RATE_LIMIT_RATE per second, and up to
+// BASIC_COAP_RATE_LIMIT_BURST can be saved up. Requests that find the
+// bucket empty are dropped before they're queued for a worker.
+//
+// Clients are tracked by IPv6 address (not port, so that a client
+// can't get round its limit by changing port) in a small fixed-size
+// table. When the table is full, the least recently seen client is
+// evicted, and a client that comes back later starts again with a
+// full bucket and its counters at zero.
+//
+// The table is shown by the "basic_coap clients" shell command, and
+// served in binary form from the "stats/clients" resource.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+#include <shell/shell.h>
+#include <sys/byteorder.h>
+
+#include <net/coap.h>
+#include <net/net_ip.h>
+
+#include "ratelimit.h"
+#include "response.h"
+
+
+// Tokens are counted in thousandths, so that a bucket can be refilled
+// by the millisecond.
+#define TOKEN 1000
+#define BUCKET_SIZE (CONFIG_BASIC_COAP_RATE_LIMIT_BURST * TOKEN)
+
+struct peer {
+  bool used;
+  struct in6_addr addr;
+  uint32_t tokens;     // Thousandths of a request.
+  uint32_t refilled;   // Uptime (ms) the bucket was last topped up.
+  uint32_t allowed;    // Requests let through...
+  uint32_t dropped;    // ...and dropped for being over the limit.
+};
+
+static struct peer peers[CONFIG_BASIC_COAP_RATE_LIMIT_PEERS];
+
+// Protects the table. Requests are checked on the thread that receives
+// them, but the shell and the "stats/clients" resource read it too.
+static struct k_spinlock lock;
+
+
+// Find a client's entry, or make one, evicting the client we've heard
+// from least recently if the table is full. Call with the lock held.
+
+static struct peer *find_peer(const struct in6_addr *addr, uint32_t now) {
+  // A free entry beats any used one.
+  struct peer *slot = NULL;
+  for (int i = 0; i < ARRAY_SIZE(peers); ++i) {
+    struct peer *p = &peers[i];
+    if (p->used && net_ipv6_addr_cmp(&p->addr, addr)) return p;
+    if (!slot || (slot->used && (!p->used ||
+                                 now - p->refilled > now - slot->refilled))) {
+      slot = p;
+    }
+  }
+
+  *slot = (struct peer){
+    .used = true,
+    .addr = *addr,
+    .tokens = BUCKET_SIZE,
+    .refilled = now,
+  };
+  return slot;
+}
+
+
+// ----------------------------------------------------------------------
+// PUBLIC API
+
+// Charge a request to the client that sent it. Returns false if the
+// client is over its limit, in which case the request should be
+// dropped.
+
+bool ratelimit_allow(const struct sockaddr *addr) {
+  uint32_t now = k_uptime_get_32();
+
+  k_spinlock_key_t key = k_spin_lock(&lock);
+
+  // Top up the bucket for the time since we last heard from the
+  // client. (The refill time also serves for LRU eviction.)
+  struct peer *p = find_peer(&net_sin6(addr)->sin6_addr, now);
+  uint64_t tokens = p->tokens +
+    (uint64_t)(now - p->refilled) * CONFIG_BASIC_COAP_RATE_LIMIT_RATE;
+  p->tokens = MIN(tokens, BUCKET_SIZE);
+  p->refilled = now;
+
+  bool allow = p->tokens >= TOKEN;
+  if (allow) {
+    p->tokens -= TOKEN;
+    ++p->allowed;
+  } else {
+    ++p->dropped;
+  }
+
+  k_spin_unlock(&lock, key);
+  return allow;
+}
+
+
+void ratelimit_print(const struct shell *shell) {
+  uint32_t now = k_uptime_get_32();
+
+  for (int i = 0; i < ARRAY_SIZE(peers); ++i) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct peer p = peers[i];
+    k_spin_unlock(&lock, key);
+    if (!p.used) continue;
+
+    char addr[NET_IPV6_ADDR_LEN];
+    net_addr_ntop(AF_INET6, &p.addr, addr, sizeof(addr));
+    shell_print(shell, "%s: %u allowed, %u dropped, last seen %u ms ago",
+                addr, p.allowed, p.dropped, now - p.refilled);
+  }
+}
+
+
+// ----------------------------------------------------------------------
+// "stats/clients" RESOURCE
+//
+// Binary (application/octet-stream), with multi-byte values
+// little-endian:
+//
+//   u8 version (1), u8 clients
+//   clients * { u8 address[16], u32 allowed, u32 dropped,
+//               u32 ms since last request }
+//
+// in no particular order.
+
+#define CLIENT_ENTRY_LEN (16 + 3 * 4)
+#define CLIENTS_LEN (2 + CONFIG_BASIC_COAP_RATE_LIMIT_PEERS * CLIENT_ENTRY_LEN)
+
+static int write_clients(uint8_t *buf, void *arg) {
+  uint32_t now = k_uptime_get_32();
+  uint8_t *p = buf + 2;
+  uint8_t count = 0;
+
+  for (int i = 0; i < ARRAY_SIZE(peers); ++i) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    struct peer peer = peers[i];
+    k_spin_unlock(&lock, key);
+    if (!peer.used) continue;
+
+    memcpy(p, &peer.addr, 16);
+    sys_put_le32(peer.allowed, p + 16);
+    sys_put_le32(peer.dropped, p + 20);
+    sys_put_le32(now - peer.refilled, p + 24);
+    p += CLIENT_ENTRY_LEN;
+    ++count;
+  }
+
+  buf[0] = 1;
+  buf[1] = count;
+  return p - buf;
+}
+
+// The payload is rendered straight into the reply buffer.
+COAP_RESPONSE_DEFINE(clients_content, COAP_RESPONSE_CODE_CONTENT,
+                     OCTET_STREAM_FORMAT, CLIENTS_LEN, write_clients);
+
+int client_stats_get(struct coap_resource *res, struct coap_packet *req,
+                     struct sockaddr *addr, socklen_t addr_len) {
+  return send_coap_response(&clients_content, req, addr, addr_len, NULL);
+}
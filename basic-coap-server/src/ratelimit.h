@@ -0,0 +1,22 @@
+#ifndef _H_RATELIMIT_
+#define _H_RATELIMIT_
+
+#include <zephyr.h>
+#include <shell/shell.h>
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+#ifdef CONFIG_BASIC_COAP_RATE_LIMIT
+bool ratelimit_allow(const struct sockaddr *addr);
+
+void ratelimit_print(const struct shell *shell);
+
+int client_stats_get(struct coap_resource *res, struct coap_packet *req,
+                     struct sockaddr *addr, socklen_t addr_len);
+#else
+static inline bool ratelimit_allow(const struct sockaddr *addr) {
+  return true;
+}
+#endif
+
+#endif
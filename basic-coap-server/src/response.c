@@ -0,0 +1,125 @@
+// Basic OpenThread CoAP server: response builder.
+//
+// Most of our responses are the same few bytes every time apart from
+// the message ID, token, payload and sometimes an Observe option, so
+// rather than building each one up an option at a time with the CoAP
+// API (which checks for space and works out option deltas for every
+// call), endpoints declare the kinds of response they send with
+// COAP_RESPONSE_DEFINE: code, content format and a function to write
+// the payload. The Content-Format option is encoded at compile time,
+// and the payload size is checked against the reply buffer size then
+// too, so a response is just written out in one pass here.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <net/coap.h>
+
+#include "buffers.h"
+#include "coap.h"
+#include "response.h"
+
+
+// Separates the options from the payload.
+#define PAYLOAD_MARKER 0xff
+
+
+// Write a whole response message into data, which must have room for
+// MAX_COAP_MSG_LEN bytes. An Observe option with the given sequence
+// number is included if observe isn't negative. Returns the message
+// length, or an error code from the payload writer.
+
+int coap_response_write(const struct coap_response *spec, uint8_t *data,
+                        uint8_t type, uint16_t id,
+                        const uint8_t *token, uint8_t tkl,
+                        int32_t observe, void *arg) {
+  // Fixed header (RFC 7252, Section 3): version 1, type and token
+  // length, code, message ID. Then the token.
+  uint8_t *p = data;
+  *p++ = (1 << 6) | (type << 4) | tkl;
+  *p++ = spec->code;
+  *p++ = id >> 8;
+  *p++ = id & 0xff;
+  memcpy(p, token, tkl);
+  p += tkl;
+
+  // Options go in order of option number, each with the difference
+  // from the previous one. Observe (6) comes before Content-Format
+  // (12), whose pre-encoded delta assumes it's the first option.
+  if (observe >= 0) {
+    uint8_t len = observe > 0xffff ? 3 : observe > 0xff ? 2 : observe ? 1 : 0;
+    *p++ = (COAP_OPTION_OBSERVE << 4) | len;
+    for (int i = len - 1; i >= 0; --i) *p++ = observe >> (8 * i);
+  }
+  if (spec->format_len) {
+    memcpy(p, spec->format_opt, spec->format_len);
+    if (observe >= 0) p[0] -= COAP_OPTION_OBSERVE << 4;
+    p += spec->format_len;
+  }
+
+  // The payload goes after the marker, which is left out if there's
+  // no payload.
+  if (spec->write) {
+    int len = spec->write(p + 1, arg);
+    if (len < 0) return len;
+    if (len > 0) {
+      *p = PAYLOAD_MARKER;
+      p += 1 + len;
+    }
+  }
+
+  return p - data;
+}
+
+
+// Build a piggybacked response to a request in data (a reply buffer),
+// and set up resp to describe it, e.g. for store_cached_coap_reply or
+// send_coap_reply.
+
+int coap_response_build(const struct coap_response *spec,
+                        struct coap_packet *req, int32_t observe, void *arg,
+                        uint8_t *data, struct coap_packet *resp) {
+  // The request has been parsed already, so its token length is valid
+  // and the token is right after the header.
+  uint8_t type = coap_header_get_type(req);
+  type = type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON_CON;
+  int r = coap_response_write(spec, data, type, coap_header_get_id(req),
+                              req->data + 4, req->data[0] & 0x0f,
+                              observe, arg);
+  if (r < 0) return r;
+
+  *resp = (struct coap_packet){
+    .data = data,
+    .offset = r,
+    .max_len = MAX_COAP_MSG_LEN,
+  };
+  return 0;
+}
+
+
+// Build and send a piggybacked response to a request in one go.
+
+int send_coap_response(const struct coap_response *spec,
+                       struct coap_packet *req,
+                       const struct sockaddr *addr, socklen_t addr_len,
+                       void *arg) {
+  uint8_t *data = alloc_reply_buffer();
+  struct coap_packet resp;
+  int r = coap_response_build(spec, req, -1, arg, data, &resp);
+  if (r >= 0) r = send_coap_reply(&resp, addr, addr_len);
+  free_reply_buffer(data);
+  return r;
+}
+
+
+// Send a response with no options or payload, e.g. an error.
+
+int send_coap_status(uint8_t code, struct coap_packet *req,
+                     const struct sockaddr *addr, socklen_t addr_len) {
+  const struct coap_response spec = { .code = code };
+  return send_coap_response(&spec, req, addr, addr_len, NULL);
+}
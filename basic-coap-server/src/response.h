@@ -0,0 +1,73 @@
+#ifndef _H_RESPONSE_
+#define _H_RESPONSE_
+
+#include <zephyr.h>
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+#include "coap.h"
+
+// Writes a resource representation into buf, which has room for the
+// response's max_payload bytes. Returns the payload length (zero for
+// no payload), or a negative error code.
+typedef int (*coap_payload_writer_t)(uint8_t *buf, void *arg);
+
+// A kind of response an endpoint sends: its code, content format and
+// payload writer, with the Content-Format option already encoded. Use
+// COAP_RESPONSE_DEFINE to declare one.
+struct coap_response {
+  uint8_t code;
+  uint8_t max_payload;
+  uint8_t format_len;     // Bytes of format_opt used: 0 if no option.
+  uint8_t format_opt[3];  // Content-Format option, as the first option.
+  coap_payload_writer_t write;
+};
+
+// No Content-Format option.
+#define COAP_NO_FORMAT -1
+
+// "application/octet-stream" (RFC 7252, Section 12.3), for binary
+// representations.
+#define OCTET_STREAM_FORMAT 42
+
+// Most that a response can have ahead of the payload: header, longest
+// token, Observe and Content-Format options and payload marker. Every
+// response declared with COAP_RESPONSE_DEFINE fits in a reply buffer,
+// so building one needs no bounds checks.
+#define COAP_RESPONSE_OVERHEAD (4 + 8 + 4 + 3 + 1)
+#define COAP_RESPONSE_MAX_PAYLOAD (MAX_COAP_MSG_LEN - COAP_RESPONSE_OVERHEAD)
+
+#define COAP_RESPONSE_FORMAT_LEN(f) \
+  ((f) < 0 ? 0 : (f) == 0 ? 1 : (f) < 256 ? 2 : 3)
+
+#define COAP_RESPONSE_DEFINE(name, code_, format, max_payload_, write_) \
+  BUILD_ASSERT((max_payload_) <= COAP_RESPONSE_MAX_PAYLOAD,             \
+               "Payload too big for a CoAP response");                  \
+  static const struct coap_response name = {                           \
+    .code = code_,                                                      \
+    .max_payload = max_payload_,                                        \
+    .format_len = COAP_RESPONSE_FORMAT_LEN(format),                     \
+    .format_opt = {                                                     \
+      (format) < 0 ? 0 : (COAP_OPTION_CONTENT_FORMAT << 4) |            \
+        (COAP_RESPONSE_FORMAT_LEN(format) - 1),                         \
+      (format) < 256 ? (format) & 0xff : ((format) >> 8) & 0xff,        \
+      (format) & 0xff                                                   \
+    },                                                                  \
+    .write = write_,                                                    \
+  }
+
+int coap_response_write(const struct coap_response *spec, uint8_t *data,
+                        uint8_t type, uint16_t id,
+                        const uint8_t *token, uint8_t tkl,
+                        int32_t observe, void *arg);
+int coap_response_build(const struct coap_response *spec,
+                        struct coap_packet *req, int32_t observe, void *arg,
+                        uint8_t *data, struct coap_packet *resp);
+int send_coap_response(const struct coap_response *spec,
+                       struct coap_packet *req,
+                       const struct sockaddr *addr, socklen_t addr_len,
+                       void *arg);
+int send_coap_status(uint8_t code, struct coap_packet *req,
+                     const struct sockaddr *addr, socklen_t addr_len);
+
+#endif
@@ -0,0 +1,79 @@
+// Basic OpenThread CoAP server: request routing.
+//
+// This replaces the Zephyr coap_handle_request function, which
+// compares the request's Uri-Path against every resource in turn.
+// Instead, the resource list in resources.def is turned into a
+// perfect hash table at build time (by scripts/gen_router.py), so a
+// request is routed by hashing its Uri-Path once, looking up a single
+// table slot, and comparing against that one candidate resource. The
+// cost doesn't depend on the number of resources.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <net/coap.h>
+
+#include "endpoints.h"
+#include "router.h"
+#include "router_hash.h"
+
+// Generated from resources.def: ROUTER_* sizes, router_displace and
+// router_slots.
+#include "router_table.h"
+
+
+// Check that the Uri-Path options in a request match a resource's
+// path exactly. The hash lookup only gives us a candidate: requests
+// for unknown paths land in some slot too.
+static bool path_matches(const struct coap_resource *res,
+                         const struct coap_option *options, uint8_t opt_num) {
+  const char *const *seg = res->path;
+  for (int i = 0; i < opt_num; ++i) {
+    if (options[i].delta != COAP_OPTION_URI_PATH) continue;
+    if (!*seg) return false;
+    if (strlen(*seg) != options[i].len ||
+        memcmp(*seg, options[i].value, options[i].len) != 0)
+      return false;
+    ++seg;
+  }
+  return *seg == NULL;
+}
+
+// Find the resource for a request's Uri-Path, or NULL if there isn't
+// one. The options are as returned by coap_packet_parse.
+struct coap_resource *find_coap_resource(struct coap_option *options,
+                                         uint8_t opt_num) {
+  uint32_t h = ROUTER_HASH_INIT;
+  for (int i = 0; i < opt_num; ++i)
+    if (options[i].delta == COAP_OPTION_URI_PATH)
+      h = router_hash_segment(h, options[i].value, options[i].len);
+
+  uint32_t slot = router_slot(h, router_displace,
+                              ROUTER_BUCKET_MASK, ROUTER_SLOT_MASK);
+  if (router_slots[slot] == ROUTER_EMPTY) return NULL;
+
+  struct coap_resource *res = &coap_resources[router_slots[slot]];
+  return path_matches(res, options, opt_num) ? res : NULL;
+}
+
+// Call a resource's handler function for the request's method. This
+// returns 0 without doing anything if the resource doesn't support
+// the method, and otherwise the result of the handler.
+int call_coap_handler(struct coap_resource *res, struct coap_packet *req,
+                      struct sockaddr *addr, socklen_t addr_len) {
+  coap_method_t method;
+  switch (coap_header_get_code(req)) {
+  case COAP_METHOD_GET:    method = res->get; break;
+  case COAP_METHOD_POST:   method = res->post; break;
+  case COAP_METHOD_PUT:    method = res->put; break;
+  case COAP_METHOD_DELETE: method = res->del; break;
+  default:                 method = NULL; break;
+  }
+  if (!method) return 0;
+
+  return method(res, req, addr, addr_len);
+}
@@ -0,0 +1,13 @@
+#ifndef _H_ROUTER_
+#define _H_ROUTER_
+
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+struct coap_resource *find_coap_resource(struct coap_option *options,
+                                         uint8_t opt_num);
+
+int call_coap_handler(struct coap_resource *res, struct coap_packet *req,
+                      struct sockaddr *addr, socklen_t addr_len);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _H_ROUTER_HASH_
+#define _H_ROUTER_HASH_
+
+// Hash functions for the generated resource router (see router.c).
+// scripts/gen_router.py computes the routing tables with the same
+// functions, so the two must be kept in step. This header has no
+// Zephyr dependencies so that it can also be used in the host-side
+// router benchmark.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FNV-1a offset basis and prime.
+#define ROUTER_HASH_INIT 2166136261u
+#define ROUTER_HASH_PRIME 16777619u
+
+// Add one Uri-Path segment to a path hash. A '/' is hashed before each
+// segment, so that "a/bc" and "ab/c" hash differently.
+static inline uint32_t router_hash_segment(uint32_t h, const uint8_t *seg,
+                                           size_t len) {
+  h = (h ^ '/') * ROUTER_HASH_PRIME;
+  for (size_t i = 0; i < len; ++i) h = (h ^ seg[i]) * ROUTER_HASH_PRIME;
+  return h;
+}
+
+// Murmur3 finaliser, to spread the path hash over all 32 bits.
+static inline uint32_t router_hash_mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+// Map a path hash to a routing table slot, "hash and displace" style:
+// the high bits pick a bucket, and the bucket's displacement value
+// (chosen by the generator) is mixed in to pick the slot. Both table
+// sizes are powers of two.
+static inline uint32_t router_slot(uint32_t h, const uint16_t *displace,
+                                   uint32_t bucket_mask, uint32_t slot_mask) {
+  uint32_t d = displace[(router_hash_mix(h) >> 16) & bucket_mask];
+  return router_hash_mix(h ^ (d * 0x9e3779b9u)) & slot_mask;
+}
+
+#endif
@@ -0,0 +1,363 @@
+// Basic OpenThread CoAP server: request statistics.
+//
+// Counts of packets and bytes in and out, and of things going wrong,
+// plus requests, error responses and bytes sent for each resource and
+// method, and a histogram of request handling latency for each
+// resource. Latency is measured with the cycle counter, from the
+// request being received to its response being sent, and bucketed by
+// powers of two: bucket i counts latencies of 2^(i-1) up to 2^i
+// cycles. All the counters are atomics, since they're updated from
+// the receive thread and all the workers.
+//
+// The statistics are shown by the "basic_coap stats" shell command,
+// and served in binary form from the "stats" resource, so that they
+// can be collected from a whole fleet of nodes over the network.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+#include <shell/shell.h>
+#include <sys/byteorder.h>
+
+#include <net/coap.h>
+
+#include "coap.h"
+#include "endpoints.h"
+#include "response.h"
+#include "stats.h"
+
+
+enum stats_method { M_GET, M_POST, M_PUT, M_DELETE, M_OTHER, NUM_METHODS };
+static const char *const method_names[NUM_METHODS] = {
+  "GET", "POST", "PUT", "DELETE", "other"
+};
+
+#define NUM_BUCKETS 32
+
+// Requests for unknown paths are counted against an extra resource at
+// the end.
+#define UNKNOWN_RESOURCE NUM_RESOURCES
+
+struct resource_stats {
+  atomic_t requests[NUM_METHODS];
+  atomic_t errors[NUM_METHODS];
+  atomic_t tx_bytes[NUM_METHODS];
+  atomic_t latency[NUM_BUCKETS];
+  atomic_t cycles;  // Sum of all latencies, wrapping at 2^32.
+};
+
+struct global_stats {
+  atomic_t rx_packets;
+  atomic_t rx_bytes;
+  atomic_t tx_packets;
+  atomic_t tx_bytes;
+  atomic_t parse_failures;
+  atomic_t enomem;
+  atomic_t duplicates;
+  atomic_t con_sent;        // Confirmable messages we sent...
+  atomic_t con_retransmits; // ...retransmissions of them...
+  atomic_t con_timeouts;    // ...and ones never acknowledged.
+  atomic_t rate_limited;    // Requests from clients over their limit.
+  atomic_t shed;            // Requests turned away with 5.03.
+  atomic_t connections;     // Network connections (and reconnections).
+  atomic_t first_last;      // Time from connecting to serving the first
+  atomic_t first_max;       // request: latest, and worst (ms).
+};
+
+static struct global_stats totals;
+static struct resource_stats resources[NUM_RESOURCES + 1];
+
+
+static int method_index(uint8_t method) {
+  switch (method) {
+  case COAP_METHOD_GET: return M_GET;
+  case COAP_METHOD_POST: return M_POST;
+  case COAP_METHOD_PUT: return M_PUT;
+  case COAP_METHOD_DELETE: return M_DELETE;
+  default: return M_OTHER;
+  }
+}
+
+static struct resource_stats *resource_stats(int resource) {
+  if (resource < 0 || resource > NUM_RESOURCES) resource = UNKNOWN_RESOURCE;
+  return &resources[resource];
+}
+
+static int latency_bucket(uint32_t cycles) {
+  return cycles ? MIN(NUM_BUCKETS - 1, 32 - __builtin_clz(cycles)) : 0;
+}
+
+
+// ----------------------------------------------------------------------
+// RECORDING
+
+void stats_rx(uint16_t len) {
+  atomic_inc(&totals.rx_packets);
+  atomic_add(&totals.rx_bytes, len);
+}
+
+void stats_tx(uint16_t len) {
+  atomic_inc(&totals.tx_packets);
+  atomic_add(&totals.tx_bytes, len);
+}
+
+void stats_parse_failure(void) { atomic_inc(&totals.parse_failures); }
+
+void stats_enomem(void) { atomic_inc(&totals.enomem); }
+
+void stats_duplicate(void) { atomic_inc(&totals.duplicates); }
+
+void stats_rate_limited(void) { atomic_inc(&totals.rate_limited); }
+
+void stats_shed(void) { atomic_inc(&totals.shed); }
+
+void stats_connected(void) { atomic_inc(&totals.connections); }
+
+
+// The first request since the network connected has been served, this
+// long after it connected.
+
+void stats_first_request(uint32_t ms) {
+  atomic_set(&totals.first_last, ms);
+  atomic_val_t max = atomic_get(&totals.first_max);
+  while (ms > (uint32_t)max && !atomic_cas(&totals.first_max, max, ms)) {
+    max = atomic_get(&totals.first_max);
+  }
+}
+
+void stats_con_sent(void) { atomic_inc(&totals.con_sent); }
+
+void stats_con_retransmit(void) { atomic_inc(&totals.con_retransmits); }
+
+void stats_con_timeout(void) { atomic_inc(&totals.con_timeouts); }
+
+
+// A request has been routed to a resource (or to UNKNOWN_RESOURCE, or
+// -1 for an unknown path).
+
+void stats_request(int resource, uint8_t method) {
+  atomic_inc(&resource_stats(resource)->requests[method_index(method)]);
+}
+
+
+// A response has been sent for a request, which was received at cycle
+// count "received".
+
+void stats_response(int resource, uint8_t method, uint8_t code,
+                    uint16_t len, uint32_t received) {
+  struct resource_stats *s = resource_stats(resource);
+  int m = method_index(method);
+  uint8_t code_class = code >> 5;
+  if (code_class == 4 || code_class == 5) atomic_inc(&s->errors[m]);
+  atomic_add(&s->tx_bytes[m], len);
+  uint32_t cycles = k_cycle_get_32() - received;
+  atomic_inc(&s->latency[latency_bucket(cycles)]);
+  atomic_add(&s->cycles, cycles);
+}
+
+
+// ----------------------------------------------------------------------
+// SHELL OUTPUT
+
+// Write a resource's path into a buffer, e.g. "led/brightness".
+
+static void resource_name(int resource, char *buf, size_t size) {
+  if (resource == UNKNOWN_RESOURCE) {
+    snprintk(buf, size, "(unknown)");
+    return;
+  }
+  size_t pos = 0;
+  buf[0] = '\0';
+  for (const char *const *seg = coap_resources[resource].path; *seg; ++seg) {
+    pos += snprintk(buf + pos, size - pos, "%s%s",
+                    seg == coap_resources[resource].path ? "" : "/", *seg);
+    if (pos >= size) break;
+  }
+}
+
+void stats_print(const struct shell *shell) {
+  shell_print(shell, "Received %u packets (%u bytes), sent %u (%u bytes)",
+              atomic_get(&totals.rx_packets), atomic_get(&totals.rx_bytes),
+              atomic_get(&totals.tx_packets), atomic_get(&totals.tx_bytes));
+  shell_print(shell, "Parse failures %u, out of memory %u, duplicates %u",
+              atomic_get(&totals.parse_failures), atomic_get(&totals.enomem),
+              atomic_get(&totals.duplicates));
+  shell_print(shell, "Confirmable messages sent %u, retransmissions %u, "
+              "timed out %u", atomic_get(&totals.con_sent),
+              atomic_get(&totals.con_retransmits),
+              atomic_get(&totals.con_timeouts));
+  shell_print(shell, "Rate limited %u, shed %u",
+              atomic_get(&totals.rate_limited), atomic_get(&totals.shed));
+  shell_print(shell, "Network connections %u, connection to first request "
+              "%u ms (worst %u ms)", atomic_get(&totals.connections),
+              atomic_get(&totals.first_last), atomic_get(&totals.first_max));
+
+  uint32_t hz = sys_clock_hw_cycles_per_sec();
+
+  for (int r = 0; r <= NUM_RESOURCES; ++r) {
+    struct resource_stats *s = &resources[r];
+    char name[32];
+    resource_name(r, name, sizeof(name));
+
+    bool header = false;
+    for (int m = 0; m < NUM_METHODS; ++m) {
+      uint32_t requests = atomic_get(&s->requests[m]);
+      if (!requests) continue;
+      if (!header) shell_print(shell, "%s:", name);
+      header = true;
+      shell_print(shell, "  %-6s %8u requests, %6u errors, %8u bytes sent",
+                  method_names[m], requests, atomic_get(&s->errors[m]),
+                  atomic_get(&s->tx_bytes[m]));
+    }
+    if (!header) continue;
+
+    // Only the occupied part of the histogram.
+    for (int b = 0; b < NUM_BUCKETS; ++b) {
+      uint32_t n = atomic_get(&s->latency[b]);
+      if (!n) continue;
+      shell_print(shell, "  latency < %8u us: %u",
+                  (uint32_t)(BIT64(b) * USEC_PER_SEC / hz), n);
+    }
+  }
+}
+
+
+// ----------------------------------------------------------------------
+// "stats" RESOURCE
+//
+// "GET stats" returns a summary, and "GET stats?r=<path>" the details
+// for one resource (e.g. "?r=led/brightness"). Both are binary
+// (application/octet-stream), with all multi-byte values as
+// little-endian 32-bit unsigned integers. They start with a common
+// header:
+//
+//   u8 version (1), u8 resources, u8 methods, u8 buckets,
+//   u32 cycle counter frequency (Hz)
+//
+// where "resources" counts the unknown-path pseudo-resource, and
+// "methods" and "buckets" are the sizes of the tables below. The
+// summary then has:
+//
+//   u32 rx packets, rx bytes, tx packets, tx bytes,
+//       parse failures, out of memory, duplicates
+//   u32 requests[resources], in coap_resources order (as listed in
+//       .well-known/core), with unknown paths last
+//   u32 latency[buckets], summed over all resources
+//   u32 confirmable messages sent, retransmissions, timeouts
+//   u32 requests dropped by rate limiting, shed with 5.03
+//   u32 network connections, ms from the latest one to the first
+//       request served after it, worst such time
+//
+// and the details for a resource have:
+//
+//   u32 requests[methods], errors[methods], tx bytes[methods], for
+//       GET, POST, PUT, DELETE and anything else
+//   u32 latency[buckets]
+//   u32 latency sum (cycles, modulo 2^32)
+//
+// The latency sum is for working out the mean cost of a response:
+// take the difference between two readings, and divide it by the
+// difference in the histogram totals.
+
+#define HEADER_LEN 8
+#define SUMMARY_LEN \
+  (HEADER_LEN + 4 * (7 + NUM_RESOURCES + 1 + NUM_BUCKETS + 3 + 2 + 3))
+#define DETAIL_LEN (HEADER_LEN + 4 * (3 * NUM_METHODS + NUM_BUCKETS + 1))
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+  sys_put_le32(v, p);
+  return p + 4;
+}
+
+static uint8_t *put_header(uint8_t *p) {
+  *p++ = 1;
+  *p++ = NUM_RESOURCES + 1;
+  *p++ = NUM_METHODS;
+  *p++ = NUM_BUCKETS;
+  return put_u32(p, sys_clock_hw_cycles_per_sec());
+}
+
+static int write_summary(uint8_t *buf, void *arg) {
+  uint8_t *p = put_header(buf);
+  p = put_u32(p, atomic_get(&totals.rx_packets));
+  p = put_u32(p, atomic_get(&totals.rx_bytes));
+  p = put_u32(p, atomic_get(&totals.tx_packets));
+  p = put_u32(p, atomic_get(&totals.tx_bytes));
+  p = put_u32(p, atomic_get(&totals.parse_failures));
+  p = put_u32(p, atomic_get(&totals.enomem));
+  p = put_u32(p, atomic_get(&totals.duplicates));
+
+  uint32_t latency[NUM_BUCKETS] = { 0 };
+  for (int r = 0; r <= NUM_RESOURCES; ++r) {
+    uint32_t requests = 0;
+    for (int m = 0; m < NUM_METHODS; ++m)
+      requests += atomic_get(&resources[r].requests[m]);
+    p = put_u32(p, requests);
+    for (int b = 0; b < NUM_BUCKETS; ++b)
+      latency[b] += atomic_get(&resources[r].latency[b]);
+  }
+  for (int b = 0; b < NUM_BUCKETS; ++b) p = put_u32(p, latency[b]);
+
+  p = put_u32(p, atomic_get(&totals.con_sent));
+  p = put_u32(p, atomic_get(&totals.con_retransmits));
+  p = put_u32(p, atomic_get(&totals.con_timeouts));
+  p = put_u32(p, atomic_get(&totals.rate_limited));
+  p = put_u32(p, atomic_get(&totals.shed));
+  p = put_u32(p, atomic_get(&totals.connections));
+  p = put_u32(p, atomic_get(&totals.first_last));
+  p = put_u32(p, atomic_get(&totals.first_max));
+
+  return p - buf;
+}
+
+static int write_detail(uint8_t *buf, void *arg) {
+  struct resource_stats *s = arg;
+  uint8_t *p = put_header(buf);
+  for (int m = 0; m < NUM_METHODS; ++m) p = put_u32(p, atomic_get(&s->requests[m]));
+  for (int m = 0; m < NUM_METHODS; ++m) p = put_u32(p, atomic_get(&s->errors[m]));
+  for (int m = 0; m < NUM_METHODS; ++m) p = put_u32(p, atomic_get(&s->tx_bytes[m]));
+  for (int b = 0; b < NUM_BUCKETS; ++b) p = put_u32(p, atomic_get(&s->latency[b]));
+  p = put_u32(p, atomic_get(&s->cycles));
+  return p - buf;
+}
+
+// The payload is rendered straight into the reply buffer.
+COAP_RESPONSE_DEFINE(summary_content, COAP_RESPONSE_CODE_CONTENT,
+                     OCTET_STREAM_FORMAT, SUMMARY_LEN, write_summary);
+COAP_RESPONSE_DEFINE(detail_content, COAP_RESPONSE_CODE_CONTENT,
+                     OCTET_STREAM_FORMAT, DETAIL_LEN, write_detail);
+
+// Find the resource named in an "r=<path>" query. Returns the resource
+// index, NUM_RESOURCES + 1 if there's no query, or -ENOENT.
+
+static int query_resource(struct coap_packet *req) {
+  struct coap_option query;
+  if (coap_find_options(req, COAP_OPTION_URI_QUERY, &query, 1) < 1)
+    return NUM_RESOURCES + 1;
+  if (query.len < 2 || memcmp(query.value, "r=", 2) != 0) return -ENOENT;
+
+  for (int r = 0; r <= NUM_RESOURCES; ++r) {
+    char name[32];
+    resource_name(r, name, sizeof(name));
+    if (strlen(name) == query.len - 2 &&
+        memcmp(name, query.value + 2, query.len - 2) == 0)
+      return r;
+  }
+  return -ENOENT;
+}
+
+int stats_get(struct coap_resource *res, struct coap_packet *req,
+              struct sockaddr *addr, socklen_t addr_len) {
+  int resource = query_resource(req);
+  if (resource < 0) {
+    return send_coap_status(COAP_RESPONSE_CODE_NOT_FOUND, req, addr, addr_len);
+  }
+  if (resource > NUM_RESOURCES) {
+    return send_coap_response(&summary_content, req, addr, addr_len, NULL);
+  }
+  return send_coap_response(&detail_content, req, addr, addr_len,
+                            &resources[resource]);
+}
@@ -0,0 +1,48 @@
+#ifndef _H_STATS_
+#define _H_STATS_
+
+#include <zephyr.h>
+#include <shell/shell.h>
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+#ifdef CONFIG_BASIC_COAP_STATS
+void stats_rx(uint16_t len);
+void stats_tx(uint16_t len);
+void stats_parse_failure(void);
+void stats_enomem(void);
+void stats_duplicate(void);
+void stats_rate_limited(void);
+void stats_shed(void);
+void stats_connected(void);
+void stats_first_request(uint32_t ms);
+void stats_con_sent(void);
+void stats_con_retransmit(void);
+void stats_con_timeout(void);
+void stats_request(int resource, uint8_t method);
+void stats_response(int resource, uint8_t method, uint8_t code,
+                    uint16_t len, uint32_t received);
+
+void stats_print(const struct shell *shell);
+
+int stats_get(struct coap_resource *res, struct coap_packet *req,
+              struct sockaddr *addr, socklen_t addr_len);
+#else
+static inline void stats_rx(uint16_t len) { }
+static inline void stats_tx(uint16_t len) { }
+static inline void stats_parse_failure(void) { }
+static inline void stats_enomem(void) { }
+static inline void stats_duplicate(void) { }
+static inline void stats_rate_limited(void) { }
+static inline void stats_shed(void) { }
+static inline void stats_connected(void) { }
+static inline void stats_first_request(uint32_t ms) { }
+static inline void stats_con_sent(void) { }
+static inline void stats_con_retransmit(void) { }
+static inline void stats_con_timeout(void) { }
+static inline void stats_request(int resource, uint8_t method) { }
+static inline void stats_response(int resource, uint8_t method, uint8_t code,
+                                  uint16_t len, uint32_t received) { }
+#endif
+
+#endif
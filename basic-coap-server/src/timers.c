@@ -0,0 +1,154 @@
+// Basic OpenThread CoAP server: protocol timers.
+//
+// Deadlines for things like delayed multicast responses are kept in a
+// binary min-heap ordered by expiry time, so that the event loop in
+// coap.c can use the earliest one as its poll timeout and run all the
+// timers on the receive thread, rather than each needing a kernel
+// timer, a work item or a thread of its own. Timers can be started
+// and cancelled from any thread: if a new timer becomes the earliest,
+// the event loop is woken up to recalculate its timeout.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "coap.h"
+#include "timers.h"
+
+
+static struct coap_timer *heap[CONFIG_BASIC_COAP_TIMERS];
+static int heap_size;
+static struct k_spinlock heap_lock;
+
+
+// ----------------------------------------------------------------------
+// HEAP OPERATIONS (called with heap_lock held)
+
+static void heap_set(int i, struct coap_timer *timer) {
+  heap[i] = timer;
+  timer->index = i;
+}
+
+static void sift_up(int i) {
+  struct coap_timer *timer = heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (heap[parent]->deadline <= timer->deadline) break;
+    heap_set(i, heap[parent]);
+    i = parent;
+  }
+  heap_set(i, timer);
+}
+
+static void sift_down(int i) {
+  struct coap_timer *timer = heap[i];
+  while (true) {
+    int child = 2 * i + 1;
+    if (child >= heap_size) break;
+    if (child + 1 < heap_size &&
+        heap[child + 1]->deadline < heap[child]->deadline) ++child;
+    if (timer->deadline <= heap[child]->deadline) break;
+    heap_set(i, heap[child]);
+    i = child;
+  }
+  heap_set(i, timer);
+}
+
+static void heap_remove(struct coap_timer *timer) {
+  int i = timer->index;
+  timer->index = -1;
+  if (--heap_size == i) return;
+
+  // Move the last timer into the hole and restore the heap order,
+  // which may mean moving it either way.
+  struct coap_timer *moved = heap[heap_size];
+  heap_set(i, moved);
+  sift_up(i);
+  sift_down(moved->index);
+}
+
+
+// ----------------------------------------------------------------------
+// PUBLIC API
+
+void coap_timer_init(struct coap_timer *timer,
+                     void (*expired)(struct coap_timer *timer)) {
+  timer->expired = expired;
+  timer->index = -1;
+}
+
+
+// Start (or restart) a timer. Returns -ENOMEM if too many timers are
+// running already.
+
+int coap_timer_start(struct coap_timer *timer, uint32_t delay_ms) {
+  k_spinlock_key_t key = k_spin_lock(&heap_lock);
+  if (timer->index >= 0) heap_remove(timer);
+  if (heap_size == ARRAY_SIZE(heap)) {
+    k_spin_unlock(&heap_lock, key);
+    LOG_WRN("Too many CoAP timers");
+    return -ENOMEM;
+  }
+
+  timer->deadline = k_uptime_get() + delay_ms;
+  heap[heap_size] = timer;
+  sift_up(heap_size++);
+  bool earliest = timer->index == 0;
+  k_spin_unlock(&heap_lock, key);
+
+  if (earliest) coap_wakeup();
+  return 0;
+}
+
+
+// Stop a timer if it's running. Cancelling a timer from another thread
+// doesn't wait for its expiry function if that's already running.
+
+void coap_timer_cancel(struct coap_timer *timer) {
+  k_spinlock_key_t key = k_spin_lock(&heap_lock);
+  if (timer->index >= 0) heap_remove(timer);
+  k_spin_unlock(&heap_lock, key);
+}
+
+
+bool coap_timer_running(const struct coap_timer *timer) {
+  return timer->index >= 0;
+}
+
+
+// How long until the earliest timer expires, in ms, as a poll()
+// timeout: -1 if no timers are running.
+
+int coap_timers_next_timeout(void) {
+  k_spinlock_key_t key = k_spin_lock(&heap_lock);
+  int64_t timeout = -1;
+  if (heap_size > 0) {
+    timeout = MAX(heap[0]->deadline - k_uptime_get(), 0);
+  }
+  k_spin_unlock(&heap_lock, key);
+  return MIN(timeout, INT_MAX);
+}
+
+
+// Run the expiry functions of all the timers that are due (or of all
+// running timers, when the server is stopping). The lock isn't held
+// while they run, so they can start timers themselves.
+
+void coap_timers_expire(bool all) {
+  int64_t now = k_uptime_get();
+  while (true) {
+    k_spinlock_key_t key = k_spin_lock(&heap_lock);
+    struct coap_timer *timer = NULL;
+    if (heap_size > 0 && (all || heap[0]->deadline <= now)) {
+      timer = heap[0];
+      heap_remove(timer);
+    }
+    k_spin_unlock(&heap_lock, key);
+
+    if (!timer) break;
+    timer->expired(timer);
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef _H_TIMERS_
+#define _H_TIMERS_
+
+#include <zephyr.h>
+
+// A protocol timer, run on the CoAP receive thread by the event loop
+// in coap.c. Embed one in whatever needs a deadline and use
+// CONTAINER_OF in the expiry function to get back to it.
+struct coap_timer {
+  void (*expired)(struct coap_timer *timer);
+  int64_t deadline;  // Uptime in ms.
+  int index;         // Position in the timer heap, or -1 if not running.
+};
+
+void coap_timer_init(struct coap_timer *timer,
+                     void (*expired)(struct coap_timer *timer));
+int coap_timer_start(struct coap_timer *timer, uint32_t delay_ms);
+void coap_timer_cancel(struct coap_timer *timer);
+bool coap_timer_running(const struct coap_timer *timer);
+
+// For the event loop.
+int coap_timers_next_timeout(void);
+void coap_timers_expire(bool all);
+
+#endif
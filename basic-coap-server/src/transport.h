@@ -0,0 +1,49 @@
+#ifndef _H_TRANSPORT_
+#define _H_TRANSPORT_
+
+#include <zephyr.h>
+#include <net/net_ip.h>
+
+#include "coap.h"
+
+// This is the IANA assigned port for CoAP.
+#define COAP_PORT 5683
+
+// And for CoAP over DTLS.
+#define COAPS_PORT 5684
+
+// A received CoAP message waiting to be handled by a worker thread.
+struct coap_request_msg {
+  struct sockaddr addr;
+  socklen_t addr_len;
+  uint8_t *data;      // Message data: buf, or a transport receive buffer.
+  uint16_t len;
+  void *transport;    // Transport data released with the message.
+  bool multicast;     // Sent to one of our multicast groups?
+  uint32_t received;  // Cycle count on arrival, for latency statistics.
+  uint8_t buf[MAX_COAP_MSG_LEN];
+};
+
+// Provided by coap.c for use by the transports.
+struct coap_request_msg *alloc_request_msg(k_timeout_t timeout);
+void free_request_msg(struct coap_request_msg *msg);
+void coap_request_received(struct coap_request_msg *msg);
+
+// Sockets are polled by the event loop in coap.c, which calls their
+// handler on the receive thread when they're readable. A handler
+// returns -EAGAIN if it couldn't get a request buffer, in which case
+// the loop stops polling until one is freed, or another negative error
+// code to stop the server.
+typedef int (*coap_socket_handler_t)(int fd, void *user_data);
+int coap_add_socket(int fd, coap_socket_handler_t handler, void *user_data);
+
+// Provided by the transport selected in Kconfig: see transport/*.c.
+// transport_open is called on the receive thread before the event
+// loop starts.
+int transport_open(void);
+void transport_close(void);
+int transport_send(const uint8_t *data, uint16_t len,
+                   const struct sockaddr *addr, socklen_t addr_len);
+void transport_release(struct coap_request_msg *msg);
+
+#endif
@@ -0,0 +1,161 @@
+// Basic OpenThread CoAP server: net_context transport.
+//
+// This transport sits directly on Zephyr's net_context API instead of
+// the socket layer. Received packets are handed to us by the network
+// stack in a callback, and if the CoAP message is contiguous in the
+// packet buffer (which it almost always is for 802.15.4-sized frames),
+// it's parsed in place: the packet is held until the request has been
+// handled, rather than being copied into a socket receive buffer and
+// then out again into our own.
+//
+// Replies are built with the CoAP packet API, which needs contiguous
+// memory, so they're still written into a reply buffer first. From
+// there, net_context_sendto copies them straight into a new TX
+// packet, skipping the socket layer.
+//
+// Everything happens in the receive callback, so this transport adds
+// no sockets to the event loop in coap.c, which just runs the timers.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+
+#include <net/net_context.h>
+#include <net/net_ip.h>
+#include <net/net_pkt.h>
+
+#include "transport.h"
+
+
+// How long to wait for a TX packet when sending.
+#define PKT_WAIT_TIME K_MSEC(100)
+
+// CoAP UDP network context.
+static struct net_context *ctx;
+
+// Keeps the context from being released under a sender's feet, when
+// the server is parked because the network went down.
+K_MUTEX_DEFINE(ctx_lock);
+
+
+// Network stack receive callback: this runs in the network RX thread,
+// so it mustn't block. If there's no request buffer free, the packet
+// is dropped and the client will retransmit.
+
+static void udp_received(struct net_context *context, struct net_pkt *pkt,
+                         union net_ip_header *ip_hdr,
+                         union net_proto_header *proto_hdr,
+                         int status, void *user_data) {
+  if (!pkt) return;
+
+  size_t len = net_pkt_remaining_data(pkt);
+  if (len > MAX_COAP_MSG_LEN) {
+    LOG_WRN("Dropping oversized message (%u bytes)", len);
+    net_pkt_unref(pkt);
+    return;
+  }
+
+  struct coap_request_msg *msg = alloc_request_msg(K_NO_WAIT);
+  if (!msg) {
+    LOG_WRN("Request queue full: dropping message");
+    net_pkt_unref(pkt);
+    return;
+  }
+
+  // Save the client address for the reply: the IP and UDP headers are
+  // only valid during this callback.
+  struct sockaddr_in6 *addr6 = net_sin6(&msg->addr);
+  addr6->sin6_family = AF_INET6;
+  net_ipaddr_copy(&addr6->sin6_addr, &ip_hdr->ipv6->src);
+  addr6->sin6_port = proto_hdr->udp->src_port;
+  msg->addr_len = sizeof(*addr6);
+  msg->len = len;
+
+  // The context is bound to the unspecified address, so it gets
+  // requests sent to our multicast groups as well.
+  msg->multicast = net_ipv6_is_addr_mcast(&ip_hdr->ipv6->dst);
+
+  // Parse in place if we can, holding on to the packet until the
+  // request is released. Otherwise copy the message out.
+  if (net_pkt_is_contiguous(pkt, len)) {
+    msg->data = net_pkt_cursor_get_pos(pkt);
+    msg->transport = pkt;
+  } else {
+    net_pkt_read(pkt, msg->buf, len);
+    net_pkt_unref(pkt);
+  }
+
+  coap_request_received(msg);
+}
+
+
+// Create and bind a UDP network context on the CoAP port and register
+// our receive callback.
+
+int transport_open(void) {
+  struct sockaddr_in6 addr6;
+  memset(&addr6, 0, sizeof(addr6));
+  addr6.sin6_family = AF_INET6;
+  addr6.sin6_port = htons(COAP_PORT);
+
+  int r = net_context_get(AF_INET6, SOCK_DGRAM, IPPROTO_UDP, &ctx);
+  if (r < 0) {
+    LOG_ERR("Failed to get UDP network context %d", r);
+    return r;
+  }
+
+  r = net_context_bind(ctx, (struct sockaddr *)&addr6, sizeof(addr6));
+  if (r < 0) {
+    LOG_ERR("Failed to bind UDP network context %d", r);
+    goto fail;
+  }
+
+  r = net_context_recv(ctx, udp_received, K_NO_WAIT, NULL);
+  if (r < 0) {
+    LOG_ERR("Failed to set receive callback %d", r);
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  net_context_put(ctx);
+  ctx = NULL;
+  return r;
+}
+
+
+void transport_close(void) {
+  k_mutex_lock(&ctx_lock, K_FOREVER);
+  if (ctx) net_context_put(ctx);
+  ctx = NULL;
+  k_mutex_unlock(&ctx_lock);
+}
+
+
+// Send CoAP message data to a client. The network context does its own
+// locking, so this is safe to call from several threads: ctx_lock just
+// stops the context going away while we're using it.
+
+int transport_send(const uint8_t *data, uint16_t len,
+                   const struct sockaddr *addr, socklen_t addr_len) {
+  k_mutex_lock(&ctx_lock, K_FOREVER);
+  int r = -ENETDOWN;
+  if (ctx) {
+    r = net_context_sendto(ctx, data, len, addr, addr_len,
+                           NULL, PKT_WAIT_TIME, NULL);
+    if (r < 0) LOG_ERR("Failed to send %d", r);
+  }
+  k_mutex_unlock(&ctx_lock);
+  return r;
+}
+
+
+// Drop our reference to the received packet, if we kept it.
+
+void transport_release(struct coap_request_msg *msg) {
+  if (msg->transport) net_pkt_unref((struct net_pkt *)msg->transport);
+  msg->transport = NULL;
+}
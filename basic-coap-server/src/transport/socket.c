@@ -0,0 +1,336 @@
+// Basic OpenThread CoAP server: BSD socket transport.
+//
+// This is the default transport: a UDP socket bound to the unspecified
+// address for unicast requests, plus one bound to each multicast group
+// we've joined, all polled by the event loop in coap.c. The
+// socket API can't tell us a datagram's destination address, but the
+// network stack delivers each one to the most specifically bound
+// socket, so the socket it arrives on tells us whether a request was
+// multicast. Replies are sent from the unicast socket.
+//
+// With CONFIG_BASIC_COAP_DTLS, there's also a DTLS 1.2 socket on the
+// CoAPs port, using Zephyr's TLS socket layer with a pre-shared key.
+// Zephyr's DTLS server sockets handle one client session at a time,
+// and we remember which client that is, so that replies and observe
+// notifications to it go back through the secure socket.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <net/net_ip.h>
+#include <net/socket.h>
+#include <net/udp.h>
+#ifdef CONFIG_BASIC_COAP_DTLS
+#include <net/tls_credentials.h>
+#endif
+
+#include "multicast.h"
+#include "transport.h"
+
+
+// The event loop's wakeup socket takes one poll slot too.
+#define NUM_DTLS_SOCKETS IS_ENABLED(CONFIG_BASIC_COAP_DTLS)
+#define MAX_SOCKETS (1 + 2 + CONFIG_BASIC_COAP_MCAST_MAX_GROUPS + \
+                     NUM_DTLS_SOCKETS)
+BUILD_ASSERT(MAX_SOCKETS + 1 <= CONFIG_NET_SOCKETS_POLL_MAX,
+             "CONFIG_NET_SOCKETS_POLL_MAX is too small for the CoAP sockets");
+
+// CoAP socket file descriptors: the unicast socket comes first.
+static int fds[MAX_SOCKETS];
+static int nfds;
+
+
+static int socket_readable(int fd, void *user_data);
+
+// Lock serialising sends on the CoAP sockets, since replies can come
+// from any of the worker threads. This also protects the DTLS peer
+// address, and the socket list against the transport being closed.
+K_MUTEX_DEFINE(send_lock);
+
+#ifdef CONFIG_BASIC_COAP_DTLS
+// Credentials for the DTLS socket, in Zephyr's TLS credential store.
+#define DTLS_SEC_TAG 1
+
+#define MAX_PSK_LEN 32
+
+static int dtls_fd = -1;
+
+// The client of the current DTLS session, if there is one.
+static struct sockaddr_in6 dtls_peer;
+static bool dtls_peer_valid;
+
+static int dtls_readable(int fd, void *user_data);
+#endif
+
+
+// Bind a socket to an address and port, and add it to the event loop.
+// The socket is closed if anything fails.
+
+static int add_socket(int s, const struct in6_addr *addr, uint16_t port,
+                      coap_socket_handler_t handler, void *user_data) {
+  // Create a listener socket address on the given port.
+  struct sockaddr_in6 addr6;
+  memset(&addr6, 0, sizeof(addr6));
+  addr6.sin6_family = AF_INET6;
+  addr6.sin6_port = htons(port);
+  if (addr) addr6.sin6_addr = *addr;
+
+  // Bind the socket to our address: this means that this socket will
+  // receive any messages sent to this address on the port.
+  int r = bind(s, (struct sockaddr *)&addr6, sizeof(addr6));
+  if (r < 0) {
+    r = -errno;
+    LOG_ERR("Failed to bind UDP socket %d", errno);
+    (void)close(s);
+    return r;
+  }
+
+  r = coap_add_socket(s, handler, user_data);
+  if (r < 0) {
+    (void)close(s);
+    return r;
+  }
+
+  fds[nfds++] = s;
+  return 0;
+}
+
+
+// Create a UDP socket bound to an address on the CoAP port, and add it
+// to the event loop.
+
+static int open_socket(const struct in6_addr *addr) {
+  // Create a UDPv6 ("datagram") socket.
+  int s = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (s < 0) {
+    LOG_ERR("Failed to create UDP socket %d", errno);
+    return -errno;
+  }
+
+  // The handler's user data is the group address for multicast
+  // sockets, so that it can tell which requests were multicast.
+  return add_socket(s, addr, COAP_PORT, socket_readable, (void *)addr);
+}
+
+
+#ifdef CONFIG_BASIC_COAP_DTLS
+// Add the pre-shared key and its identity to the TLS credential store.
+// The store keeps pointers rather than copies, so the key has to stay
+// around.
+
+static int add_credentials(void) {
+  static uint8_t psk[MAX_PSK_LEN];
+  static size_t psk_len;
+
+  // The credentials are still there if the server is restarted.
+  if (psk_len > 0) return 0;
+
+  psk_len = hex2bin(CONFIG_BASIC_COAP_DTLS_PSK,
+                    strlen(CONFIG_BASIC_COAP_DTLS_PSK), psk, sizeof(psk));
+  if (psk_len == 0) {
+    LOG_ERR("Invalid DTLS pre-shared key");
+    return -EINVAL;
+  }
+
+  int r = tls_credential_add(DTLS_SEC_TAG, TLS_CREDENTIAL_PSK, psk, psk_len);
+  if (r < 0) goto fail;
+  r = tls_credential_add(DTLS_SEC_TAG, TLS_CREDENTIAL_PSK_ID,
+                         CONFIG_BASIC_COAP_DTLS_PSK_ID,
+                         strlen(CONFIG_BASIC_COAP_DTLS_PSK_ID));
+  if (r < 0) goto fail;
+  return 0;
+
+fail:
+  LOG_ERR("Failed to add DTLS credentials %d", r);
+  psk_len = 0;
+  return r;
+}
+
+
+// Create the DTLS server socket on the CoAPs port.
+
+static int open_dtls_socket(void) {
+  int r = add_credentials();
+  if (r < 0) return r;
+
+  int s = socket(AF_INET6, SOCK_DGRAM, IPPROTO_DTLS_1_2);
+  if (s < 0) {
+    LOG_ERR("Failed to create DTLS socket %d", errno);
+    return -errno;
+  }
+
+  sec_tag_t tags[] = { DTLS_SEC_TAG };
+  int role = TLS_DTLS_ROLE_SERVER;
+  if (setsockopt(s, SOL_TLS, TLS_SEC_TAG_LIST, tags, sizeof(tags)) < 0 ||
+      setsockopt(s, SOL_TLS, TLS_DTLS_ROLE, &role, sizeof(role)) < 0) {
+    r = -errno;
+    LOG_ERR("Failed to set DTLS socket options %d", errno);
+    (void)close(s);
+    return r;
+  }
+
+  r = add_socket(s, NULL, COAPS_PORT, dtls_readable, NULL);
+  if (r < 0) return r;
+  dtls_fd = s;
+  dtls_peer_valid = false;
+  return 0;
+}
+
+
+// Is an address the client of the current DTLS session?
+
+static bool is_dtls_peer(const struct sockaddr *addr) {
+  const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+  return dtls_peer_valid && addr->sa_family == AF_INET6 &&
+         addr6->sin6_port == dtls_peer.sin6_port &&
+         net_ipv6_addr_cmp(&addr6->sin6_addr, &dtls_peer.sin6_addr);
+}
+#endif
+
+
+// Initialise the CoAP server. The Zephyr CoAP API doesn't have
+// anything to do with sockets, so you set up the low-level server
+// sockets yourself. It's just a simple UDP "socket + bind" thing
+// anyway, once for unicast and once for each multicast group.
+
+int transport_open(void) {
+  nfds = 0;
+  int r = open_socket(NULL);
+  if (r < 0) return r;
+
+  // A group we can't listen on isn't fatal: unicast still works.
+  int ngroups = MIN(multicast_group_count(),
+                    MAX_SOCKETS - 1 - NUM_DTLS_SOCKETS);
+  for (int i = 0; i < ngroups; ++i) {
+    if (open_socket(multicast_group(i)) < 0) {
+      LOG_WRN("Not listening on multicast group %d", i);
+    }
+  }
+
+#ifdef CONFIG_BASIC_COAP_DTLS
+  // Nor is failing to set up DTLS.
+  if (open_dtls_socket() < 0) {
+    LOG_WRN("Not listening for CoAP over DTLS");
+  }
+#endif
+
+  return 0;
+}
+
+
+// Receive a CoAP request from a client. This function just does the
+// socket-level stuff, then hands the request off for processing.
+
+static int receive_request(int fd, bool multicast) {
+  // Get a buffer for the request. If they're all in use, the event
+  // loop stops polling, leaving incoming packets queued in the network
+  // stack.
+  struct coap_request_msg *msg = alloc_request_msg(K_NO_WAIT);
+  if (!msg) return -EAGAIN;
+
+  // Receive data from the socket. This also gets the client address,
+  // which we need for sending a reply. A DTLS socket can be readable
+  // with no application data for us, during a handshake, so we don't
+  // wait here.
+  int received = recvfrom(fd, msg->buf, sizeof(msg->buf), MSG_DONTWAIT,
+                          &msg->addr, &msg->addr_len);
+  if (received < 0) {
+    int err = errno;
+    free_request_msg(msg);
+    if (err == EAGAIN) return 0;
+    LOG_ERR("Connection error %d", err);
+    return -err;
+  }
+  msg->len = received;
+  msg->multicast = multicast;
+
+#ifdef CONFIG_BASIC_COAP_DTLS
+  // Remember the DTLS client before anything can be sent back to it.
+  if (fd == dtls_fd) {
+    k_mutex_lock(&send_lock, K_FOREVER);
+    memcpy(&dtls_peer, &msg->addr, sizeof(dtls_peer));
+    dtls_peer_valid = true;
+    k_mutex_unlock(&send_lock);
+  }
+#endif
+
+  coap_request_received(msg);
+  return 0;
+}
+
+
+// Event loop handler for the plain CoAP sockets, whose user data is
+// the group address for multicast sockets.
+
+static int socket_readable(int fd, void *user_data) {
+  return receive_request(fd, user_data != NULL);
+}
+
+
+#ifdef CONFIG_BASIC_COAP_DTLS
+// Event loop handler for the DTLS socket. A failed handshake or a
+// broken session is the client's problem, not a reason to stop the
+// server.
+
+static int dtls_readable(int fd, void *user_data) {
+  int r = receive_request(fd, false);
+  if (r < 0 && r != -EAGAIN) {
+    LOG_WRN("DTLS session ended (%d)", r);
+    k_mutex_lock(&send_lock, K_FOREVER);
+    dtls_peer_valid = false;
+    k_mutex_unlock(&send_lock);
+    return 0;
+  }
+  return r;
+}
+#endif
+
+
+void transport_close(void) {
+  // Workers may still be sending replies, e.g. when the server is
+  // parked because the network went down.
+  k_mutex_lock(&send_lock, K_FOREVER);
+  for (int i = 0; i < nfds; ++i) (void)close(fds[i]);
+  nfds = 0;
+#ifdef CONFIG_BASIC_COAP_DTLS
+  dtls_fd = -1;
+  dtls_peer_valid = false;
+#endif
+  k_mutex_unlock(&send_lock);
+}
+
+
+// Use the basic socket API to send the reply data over the unicast
+// server socket, or the DTLS socket for the DTLS client.
+
+int transport_send(const uint8_t *data, uint16_t len,
+                   const struct sockaddr *addr, socklen_t addr_len) {
+  k_mutex_lock(&send_lock, K_FOREVER);
+  if (nfds == 0) {
+    k_mutex_unlock(&send_lock);
+    return -ENETDOWN;
+  }
+  int fd = fds[0];
+#ifdef CONFIG_BASIC_COAP_DTLS
+  if (is_dtls_peer(addr)) fd = dtls_fd;
+#endif
+  int r = sendto(fd, data, len, 0, addr, addr_len);
+  if (r < 0) {
+    LOG_ERR("Failed to send %d", errno);
+    r = -errno;
+  }
+  k_mutex_unlock(&send_lock);
+
+  return r;
+}
+
+
+// Requests are received straight into the message buffer, so there's
+// nothing extra to release.
+
+void transport_release(struct coap_request_msg *msg) {
+}
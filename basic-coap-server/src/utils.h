@@ -3,7 +3,18 @@
 
 #include <zephyr.h>
 
+// Per-packet text logging: these compile to nothing unless
+// CONFIG_BASIC_COAP_PACKET_LOG is set.
+
+#define LOG_PACKET(...)                                         \
+  do {                                                          \
+    if (IS_ENABLED(CONFIG_BASIC_COAP_PACKET_LOG)) {             \
+      LOG_INF(__VA_ARGS__);                                     \
+    }                                                           \
+  } while (0)
+
 static inline void hexdump(const char *str, const uint8_t *pkt, size_t len) {
+  if (!IS_ENABLED(CONFIG_BASIC_COAP_PACKET_LOG)) return;
   if (!len) {
     LOG_DBG("%s zero-length packet", str);
     return;
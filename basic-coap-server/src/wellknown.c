@@ -0,0 +1,330 @@
+// Basic OpenThread CoAP server: ".well-known/core" resource discovery.
+//
+// The CoRE link format document (RFC 6690) describing our resources
+// is rendered once at startup from the coap_resources table, rather
+// than on every discovery request. Requests can filter it with a query
+// like "?rt=led" or "?if=core.a", and if the result doesn't fit in one
+// message, it's sent using block-wise transfer (RFC 7959).
+//
+// Resource attributes come from a struct coap_core_metadata in each
+// resource's user_data field, as for the Zephyr link format code.
+
+#include <logging/log.h>
+LOG_MODULE_DECLARE(basic_coap_server, LOG_LEVEL_DBG);
+
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <net/coap.h>
+#include <net/coap_link_format.h>
+
+#include "buffers.h"
+#include "coap.h"
+#include "endpoints.h"
+#include "wellknown.h"
+
+
+// From Section 7.2 of RFC 6690: "application/link-format" content
+// format.
+static const uint8_t link_format = 40;
+
+// Largest document we'll send in a single message without using
+// block-wise transfer: leave room for the header, token, options and
+// payload marker.
+#define SINGLE_PAYLOAD_MAX (MAX_COAP_MSG_LEN - 24)
+
+#define BLOCK_SIZE CONFIG_BASIC_COAP_WELL_KNOWN_BLOCK_SIZE
+BUILD_ASSERT((BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
+             "Block size must be a power of two");
+
+// Maximum number of links in the document.
+#define MAX_LINKS 16
+
+// The rendered document, and where each resource's link is in it.
+struct link {
+  const struct coap_resource *res;
+  uint16_t start;
+  uint16_t len;
+};
+
+static char doc[CONFIG_BASIC_COAP_WELL_KNOWN_MAX];
+static struct link links[MAX_LINKS];
+static int nlinks;
+
+
+// ----------------------------------------------------------------------
+// RENDERING
+
+// Append a string to the document being rendered, returning false if
+// there's no room for it.
+
+static bool append(uint16_t *pos, const char *str) {
+  size_t len = strlen(str);
+  if (*pos + len > sizeof(doc)) return false;
+  memcpy(doc + *pos, str, len);
+  *pos += len;
+  return true;
+}
+
+
+// Render the link for one resource, e.g. </led>;rt="led";obs.
+
+static bool render_link(uint16_t *pos, const struct coap_resource *res) {
+  if (!append(pos, "<")) return false;
+  for (const char * const *seg = res->path; *seg; ++seg) {
+    if (!append(pos, "/") || !append(pos, *seg)) return false;
+  }
+  if (!append(pos, ">")) return false;
+
+  const struct coap_core_metadata *meta = res->user_data;
+  if (meta && meta->attributes) {
+    for (const char * const *attr = meta->attributes; *attr; ++attr) {
+      if (!append(pos, ";") || !append(pos, *attr)) return false;
+    }
+  }
+  return true;
+}
+
+
+// Render the document from the resource table. This is called once
+// when the server starts.
+
+void init_well_known_core(void) {
+  uint16_t pos = 0;
+  nlinks = 0;
+
+  for (const struct coap_resource *res = coap_resources; res->path; ++res) {
+    // Don't list the discovery resource itself.
+    if (res->get == well_known_core_get) continue;
+
+    if (nlinks == MAX_LINKS) {
+      LOG_ERR("Too many resources for .well-known/core");
+      break;
+    }
+
+    uint16_t start = pos;
+    if (!render_link(&pos, res)) {
+      LOG_ERR("No room for .well-known/core link");
+      break;
+    }
+    links[nlinks++] = (struct link){
+      .res = res, .start = start, .len = pos - start
+    };
+  }
+
+  LOG_DBG(".well-known/core: %d links, %u bytes", nlinks, pos);
+}
+
+
+// ----------------------------------------------------------------------
+// FILTERING
+
+// A query filter: "name=value", where value may end with "*" for a
+// prefix match (RFC 6690, Section 4.1).
+struct filter {
+  const char *name;
+  uint8_t name_len;
+  const char *value;
+  uint8_t value_len;
+  bool prefix;
+};
+
+
+// Does one value from an attribute match the filter value?
+
+static bool value_matches(const struct filter *f,
+                          const char *value, size_t len) {
+  if (f->prefix) {
+    return len >= f->value_len && !memcmp(value, f->value, f->value_len);
+  }
+  return len == f->value_len && !memcmp(value, f->value, len);
+}
+
+
+// Does a resource have an attribute matching the filter? Attribute
+// values may be quoted, and may be space-separated lists, like
+// rt="light led", in which case any entry can match.
+
+static bool link_matches(const struct filter *f,
+                         const struct coap_resource *res) {
+  if (!f->name) return true;
+
+  const struct coap_core_metadata *meta = res->user_data;
+  if (!meta || !meta->attributes) return false;
+
+  for (const char * const *attr = meta->attributes; *attr; ++attr) {
+    const char *a = *attr;
+    if (strncmp(a, f->name, f->name_len) || a[f->name_len] != '=') continue;
+
+    const char *v = a + f->name_len + 1;
+    const char *end = v + strlen(v);
+    if (*v == '"') {
+      ++v;
+      if (end > v && end[-1] == '"') --end;
+    }
+    while (v < end) {
+      const char *sp = memchr(v, ' ', end - v);
+      if (!sp) sp = end;
+      if (value_matches(f, v, sp - v)) return true;
+      v = sp + 1;
+    }
+  }
+  return false;
+}
+
+
+// Set up a filter from the first Uri-Query option in a request, if
+// there is one. The filter points into the option value.
+
+static int parse_filter(struct coap_packet *req, struct coap_option *query,
+                        struct filter *f) {
+  memset(f, 0, sizeof(*f));
+  if (coap_find_options(req, COAP_OPTION_URI_QUERY, query, 1) <= 0) return 0;
+
+  const char *q = (const char *)query->value;
+  const char *eq = memchr(q, '=', query->len);
+  if (!eq || eq == q) return -EINVAL;
+
+  f->name = q;
+  f->name_len = eq - q;
+  f->value = eq + 1;
+  f->value_len = query->len - f->name_len - 1;
+  if (f->value_len > 0 && f->value[f->value_len - 1] == '*') {
+    f->prefix = true;
+    --f->value_len;
+  }
+  return 0;
+}
+
+
+// Walk the links matching a filter as if they had been joined into one
+// document with commas between them, copying up to max bytes starting
+// at offset into dst (if it's not NULL). Returns the total length of
+// the filtered document and sets *copied to the number of bytes
+// copied.
+
+static size_t walk_links(const struct filter *f, size_t offset,
+                         uint8_t *dst, size_t max, size_t *copied) {
+  size_t pos = 0;
+  *copied = 0;
+
+  for (int i = 0; i < nlinks; ++i) {
+    if (!link_matches(f, links[i].res)) continue;
+
+    // Each link is preceded by a comma, apart from the first.
+    for (int piece = pos ? 0 : 1; piece < 2; ++piece) {
+      const char *src = piece ? doc + links[i].start : ",";
+      size_t len = piece ? links[i].len : 1;
+
+      // Copy the part of this piece that overlaps the requested range.
+      if (dst && pos + len > offset && pos < offset + max) {
+        size_t from = pos < offset ? offset - pos : 0;
+        size_t n = MIN(len - from, offset + max - (pos + from));
+        memcpy(dst + *copied, src + from, n);
+        *copied += n;
+      }
+      pos += len;
+    }
+  }
+
+  return pos;
+}
+
+
+// ----------------------------------------------------------------------
+// ENDPOINT HANDLER
+
+// Send a CoAP reply for the ".well-known/core" resource introspection
+// endpoint. This is for the "well known" CoAP resources, which are
+// basically an introspection method for learning about what "real"
+// resources are supported.
+
+int well_known_core_get(struct coap_resource *res,
+                        struct coap_packet *req, struct sockaddr *addr,
+                        socklen_t addr_len) {
+  uint8_t type = coap_header_get_type(req);
+  type = type == COAP_TYPE_CON ? COAP_TYPE_ACK : COAP_TYPE_NON_CON;
+  uint16_t id = coap_header_get_id(req);
+  uint8_t tok[8];
+  uint8_t toklen = coap_header_get_token(req, tok);
+
+  // Work out which links we're sending, and how much data that is.
+  struct coap_option query;
+  struct filter filter;
+  uint8_t code = COAP_RESPONSE_CODE_CONTENT;
+  size_t copied;
+  size_t total = 0;
+  if (parse_filter(req, &query, &filter) < 0) {
+    code = COAP_RESPONSE_CODE_BAD_REQUEST;
+  } else {
+    total = walk_links(&filter, 0, NULL, 0, &copied);
+    if (total == 0) code = COAP_RESPONSE_CODE_NOT_FOUND;
+  }
+
+  // Work out which block we're sending. The Block2 option value is
+  // the block number, a "more" flag and the block size as a power of
+  // two (RFC 7959, Section 2.2). If the client didn't ask for a block
+  // and the document fits in one message, we don't use blocks at all.
+  int block2 = coap_get_option_int(req, COAP_OPTION_BLOCK2);
+  bool blockwise = block2 >= 0 || total > SINGLE_PAYLOAD_MAX;
+  uint8_t szx = __builtin_ctz(BLOCK_SIZE) - 4;
+  uint32_t num = 0;
+  if (block2 >= 0) {
+    if ((block2 & 0x07) == 7) {
+      code = COAP_RESPONSE_CODE_BAD_REQUEST;
+    } else {
+      szx = MIN(szx, block2 & 0x07);
+      num = block2 >> 4;
+    }
+  }
+  size_t size = blockwise ? 1 << (szx + 4) : total;
+  size_t offset = num * size;
+  if (code == COAP_RESPONSE_CODE_CONTENT && offset >= total) {
+    code = COAP_RESPONSE_CODE_BAD_REQUEST;
+  }
+
+  // Allocate reply buffer.
+  uint8_t *data = alloc_reply_buffer();
+
+  struct coap_packet resp;
+  int r = coap_packet_init(&resp, data, MAX_COAP_MSG_LEN, 1, type, toklen,
+                           tok, code, id);
+  if (r < 0 || code != COAP_RESPONSE_CODE_CONTENT) goto send;
+
+  r = coap_packet_append_option(&resp, COAP_OPTION_CONTENT_FORMAT,
+                                &link_format, sizeof(link_format));
+  if (r < 0) goto end;
+
+  if (blockwise) {
+    bool more = offset + size < total;
+    r = coap_append_option_int(&resp, COAP_OPTION_BLOCK2,
+                               (num << 4) | (more << 3) | szx);
+    if (r < 0) goto end;
+
+    // Tell the client the total size up front.
+    if (num == 0) {
+      r = coap_append_option_int(&resp, COAP_OPTION_SIZE2, total);
+      if (r < 0) goto end;
+    }
+  }
+
+  r = coap_packet_append_payload_marker(&resp);
+  if (r < 0) goto end;
+
+  // Copy the payload straight from the pre-rendered document into the
+  // reply buffer.
+  if (resp.offset + size > resp.max_len) {
+    r = -ENOMEM;
+    goto end;
+  }
+  walk_links(&filter, offset, resp.data + resp.offset, size, &copied);
+  resp.offset += copied;
+
+send:
+  if (r >= 0) r = send_coap_reply(&resp, addr, addr_len);
+
+end:
+  free_reply_buffer(data);
+  return r;
+}
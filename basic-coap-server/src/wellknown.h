@@ -0,0 +1,13 @@
+#ifndef _H_WELLKNOWN_
+#define _H_WELLKNOWN_
+
+#include <net/net_ip.h>
+#include <net/coap.h>
+
+void init_well_known_core(void);
+
+int well_known_core_get(struct coap_resource *res,
+                        struct coap_packet *req, struct sockaddr *addr,
+                        socklen_t addr_len);
+
+#endif
@@ -0,0 +1,223 @@
+import random
+import socket
+import struct
+import asyncio
+
+from aiocoap import *
+
+
+def host_for_uri(ipaddr):
+    """Wrap a bare IPv6 address in brackets for use in a URI."""
+    if ':' in ipaddr and not ipaddr.startswith('['):
+        return '[' + ipaddr + ']'
+    return ipaddr
+
+
+class CoAPClient:
+    """Get and set the LED state of one node.
+
+    Clients for many nodes can share one aiocoap context by passing it
+    in, rather than each creating their own."""
+
+    def __init__(self, ipaddr, context=None, path='led'):
+        self.uri = 'coap://{}/{}'.format(host_for_uri(ipaddr), path)
+        self.context = context
+
+    async def create_context(self):
+        self.context = await Context.create_client_context()
+
+    async def get_state(self):
+        if self.context is None:
+            await self.create_context()
+
+        request = Message(code=GET, uri=self.uri)
+        response = await self.context.request(request).response
+        check_response(response)
+        return parse_state(response.payload)
+
+    async def observe_state(self):
+        """Register as an observer and yield the state from the first
+        response and from each notification after it. Ends if the
+        server stops sending notifications, or doesn't register us at
+        all (e.g. because its observer table is full)."""
+        if self.context is None:
+            await self.create_context()
+
+        request = Message(code=GET, uri=self.uri, observe=0)
+        pr = self.context.request(request)
+        response = await pr.response
+        check_response(response)
+        yield parse_state(response.payload)
+
+        async for response in pr.observation:
+            yield parse_state(response.payload)
+
+    async def set_state(self, on_off):
+        if self.context is None:
+            await self.create_context()
+
+        payload = b'1' if on_off else b'0'
+        request = Message(code=PUT, uri=self.uri, payload=payload)
+        response = await self.context.request(request).response
+        check_response(response)
+
+
+def parse_state(payload):
+    if len(payload) > 0:
+        if payload[0] == ord('1') or payload[0] == 1:
+            return "ON"
+        else:
+            return "OFF"
+    else:
+        return "---"
+
+
+class CoAPError(Exception):
+    """An error response. Server errors (5.xx) may be worth retrying;
+    client errors (4.xx) won't go away by themselves."""
+    def __init__(self, code):
+        super().__init__(str(code))
+        self.retryable = int(code) >> 5 == 5
+
+
+def check_response(response):
+    if not response.code.is_successful():
+        raise CoAPError(response.code)
+
+
+# ----------------------------------------------------------------------
+# STATE CACHE
+
+class LedStateCache:
+    """Local copy of a node's LED state, kept up to date by Observe
+    notifications, so that the UI can show it without a round trip
+    over the mesh.
+
+    Writes are coalesced: while a PUT is in flight, further writes just
+    replace the desired state, and only the latest one is sent when the
+    PUT completes. A burst of button presses costs at most two PUTs."""
+
+    # How long to wait before registering again when an observation
+    # ends or fails.
+    RESUBSCRIBE_DELAY = 10.0
+
+    def __init__(self, client, on_change=None):
+        self.client = client
+        self.on_change = on_change
+        self.state = None
+        self.desired = None
+        self.writer = None
+        self.observer = None
+
+    def start(self):
+        self.observer = asyncio.ensure_future(self._observe())
+
+    def stop(self):
+        if self.observer:
+            self.observer.cancel()
+            self.observer = None
+
+    async def get(self):
+        """The cached state, fetched from the node only if we don't have
+        it yet."""
+        if self.state is None:
+            self._update(await self.client.get_state())
+        return self.state
+
+    def set(self, on_off):
+        """Ask for a new state. Returns a future that completes when
+        this state (or a later one) has been written."""
+        self.desired = on_off
+        if self.writer is None or self.writer.done():
+            self.writer = asyncio.ensure_future(self._write())
+        return self.writer
+
+    async def _write(self):
+        while self.desired is not None:
+            on_off = self.desired
+            self.desired = None
+            await self.client.set_state(on_off)
+            self._update("ON" if on_off else "OFF")
+
+    async def _observe(self):
+        while True:
+            try:
+                async for state in self.client.observe_state():
+                    self._update(state)
+            except asyncio.CancelledError:
+                raise
+            except Exception as e:
+                print('Observation failed:', e)
+            await asyncio.sleep(self.RESUBSCRIBE_DELAY)
+
+    def _update(self, state):
+        if state == self.state:
+            return
+        self.state = state
+        if self.on_change:
+            self.on_change(state)
+
+
+# ----------------------------------------------------------------------
+# DISCOVERY
+#
+# aiocoap only hands back the first response to a multicast request,
+# so discovery sends its own non-confirmable "GET
+# /.well-known/core?rt=led" to a group and collects every node that
+# answers. The server delays responses to multicast requests by up to
+# CONFIG_BASIC_COAP_MCAST_LEISURE_MS (5 s by default), so the timeout
+# needs to be longer than that.
+
+ALL_COAP_NODES = 'ff03::fd'
+
+
+def discovery_request(message_id, token):
+    def option(delta, value):
+        return bytes([delta << 4 | len(value)]) + value
+
+    # Uri-Path (11) ".well-known" is 11 bytes long, which still fits
+    # in the 4-bit length field.
+    return (struct.pack('!BBH', 0x50 | len(token), 0x01, message_id) +
+            token +
+            option(11, b'.well-known') +
+            option(0, b'core') +
+            option(4, b'rt=led'))
+
+
+class _DiscoveryProtocol(asyncio.DatagramProtocol):
+    def __init__(self, token):
+        self.token = token
+        self.found = []
+
+    def datagram_received(self, data, addr):
+        if len(data) < 4 + len(self.token):
+            return
+        tkl = data[0] & 0x0f
+        code = data[1]
+        if data[4:4 + tkl] != self.token or code >> 5 != 2:
+            return
+        if addr[0] not in self.found:
+            self.found.append(addr[0])
+
+
+async def discover(group=ALL_COAP_NODES, iface=None, timeout=6.0, port=5683):
+    """Return the addresses of the nodes in a multicast group that have
+    an LED resource."""
+    sock = socket.socket(socket.AF_INET6, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_MULTICAST_HOPS, 8)
+    if iface:
+        sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_MULTICAST_IF,
+                        socket.if_nametoindex(iface))
+    sock.bind(('::', 0))
+
+    token = random.getrandbits(32).to_bytes(4, 'big')
+    loop = asyncio.get_running_loop()
+    transport, protocol = await loop.create_datagram_endpoint(
+        lambda: _DiscoveryProtocol(token), sock=sock)
+    try:
+        transport.sendto(discovery_request(random.getrandbits(16), token),
+                         (group, port))
+        await asyncio.sleep(timeout)
+    finally:
+        transport.close()
+    return protocol.found